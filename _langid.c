@@ -7,52 +7,646 @@
  *
  * Marco Lui <saffsd@gmail.com>, September 2014
  */
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
+#include <limits.h>
+#include <unistd.h>
 #include "liblangid.h"
+#include "modelref.h"
 
 /* Docstrings */
 static char module_docstring[] =
-    "This module provides an off-the-shelf language identifier.";
+    "This module provides an off-the-shelf language identifier.\n\n"
+    "Texts may be str (classified as UTF-8) or any object supporting the buffer\n"
+    "protocol, such as bytes, bytearray, memoryview or mmap, which is read in\n"
+    "place. The GIL is released while classifying, so calls from several\n"
+    "threads run in parallel, and alongside Identifier.reload.";
+static char identifier_docstring[] =
+    "Identifier(model=None, languages=None)\n\n"
+    "A language identifier using the in-built model, or the protocol-buffer or\n"
+    "native model file at path model. If languages is given, only those\n"
+    "languages are considered.";
 static char identify_docstring[] =
-    "Identify the language of a piece of text.";
+    "identify(text) -> lang\n\nIdentify the language of a piece of text.";
+static char classify_docstring[] =
+    "classify(text) -> (lang, prob)\n\n"
+    "Identify the language of a piece of text, with its normalised probability.";
+static char rank_docstring[] =
+    "rank(text, k=None) -> [(lang, logprob, prob), ...]\n\n"
+    "The k most probable languages of a piece of text, best first; all of\n"
+    "them if k is None.";
+static char identify_batch_docstring[] =
+    "identify_batch(texts) -> [lang, ...]\n\n"
+    "Identify the language of each of a sequence of texts. This is faster than\n"
+    "separate calls for short texts.";
+static char reload_docstring[] =
+    "reload(model=None)\n\n"
+    "Load the model again, from path model if given and otherwise from where it\n"
+    "was loaded before, keeping to the same languages, and swap it in. Calls\n"
+    "running meanwhile in other threads finish with the old model, and the old\n"
+    "model is freed after the last of them. A file that cannot be read raises\n"
+    "OSError, and one that is not a well-formed model ValueError; either way\n"
+    "the old model stays in use.";
+static char load_model_docstring[] =
+    "load_model(model=None, languages=None) -> Identifier\n\n"
+    "Load a model; the same as Identifier(model, languages).";
 
-/* Available functions */
-static PyObject *langid_identify(PyObject *self, PyObject *args);
+/* A model as loaded for an Identifier, with the model it is a subset of */
+typedef struct {
+    LanguageIdentifier *lid;
+    LanguageIdentifier *full_lid;   /* the parent of a language subset */
+} Model;
 
-/* Module specification */
-static PyMethodDef module_methods[] = {
-    {"identify", langid_identify, METH_VARARGS, identify_docstring},
-    {NULL, NULL, 0, NULL}
-};
+/* What a call needs: a reader of the Identifier's ModelRef, and a Workspace
+ * for the model last entered through it */
+typedef struct {
+    ModelReader *reader;
+    Workspace *ws;
+    unsigned long version;          /* of the model ws was allocated for */
+} Session;
+
+/* A swappable model and the Sessions for calls on it. Sessions are taken
+ * from and returned to the idle list while holding the GIL, so there are
+ * only ever as many as there have been concurrent calls.
+ */
+typedef struct {
+    PyObject_HEAD
+    ModelRef *ref;
+    const LanguageIdentifier *lid;  /* the current model */
+    PyObject *langs;                /* a str for each of its languages */
+    PyObject *model, *languages;    /* as given, to reload them */
+    unsigned retired;               /* models replaced, not yet freed */
+    Session **idle;
+    Py_ssize_t n_idle, max_idle;
+} Identifier;
 
-/* Global LanguageIdentifier instance */
-LanguageIdentifier *identifier;
+static PyTypeObject IdentifierType;
 
-/* Initialize the module */
-PyMODINIT_FUNC init_langid(void)
+/* The Identifier used by the module-level functions */
+static Identifier *default_identifier;
+
+static void free_session(Session *sn)
+{
+    if (sn->ws != NULL) free_workspace(sn->ws);
+    free_model_reader(sn->reader);
+    PyMem_Free(sn);
+}
+
+/* Enter the current model for a call, setting lid to it; the Workspace of
+ * the Session returned fits it. NULL if out of memory.
+ */
+static Session *begin_call(Identifier *self, const LanguageIdentifier **lid)
+{
+    Session *sn;
+
+    if (self->n_idle) sn = self->idle[--self->n_idle];
+    else {
+        if ((sn = PyMem_Malloc(sizeof(Session))) == NULL) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+        sn->reader = alloc_model_reader(self->ref);
+        sn->ws = NULL;
+        sn->version = 0;
+    }
+    *lid = model_enter(sn->reader);
+    if (model_version(sn->reader) != sn->version) {
+        if (sn->ws != NULL) free_workspace(sn->ws);
+        sn->ws = alloc_workspace(*lid);
+        sn->version = model_version(sn->reader);
+    }
+    return sn;
+}
+
+/* Leave the model of a call, once nothing of its result points into it */
+static void end_call(Identifier *self, Session *sn)
+{
+    Session **idle;
+
+    model_leave(sn->reader);
+    if (self->retired) self->retired = model_reclaim(self->ref);
+
+    if (self->n_idle == self->max_idle) {
+        idle = PyMem_Realloc(self->idle, (self->max_idle * 2 + 4) * sizeof(Session *));
+        if (idle == NULL) {
+            free_session(sn);
+            return;
+        }
+        self->idle = idle;
+        self->max_idle = self->max_idle * 2 + 4;
+    }
+    self->idle[self->n_idle++] = sn;
+}
+
+/* The str for a language returned by liblangid */
+static PyObject *lang_object(Identifier *self, const char *lang)
+{
+    unsigned i;
+    PyObject *o;
+
+    for (i = 0; i < self->lid->num_langs; i++) {
+        if ((*self->lid->nb_classes)[i] == lang) {
+            o = PyTuple_GET_ITEM(self->langs, i);
+            Py_INCREF(o);
+            return o;
+        }
+    }
+    return PyUnicode_FromString(lang);
+}
+
+/* A text being classified. str is used through its cached UTF-8 form,
+ * anything else through the buffer protocol; neither is copied. Either
+ * way the object is held until release_text, as the text is read without
+ * the GIL and its container, such as a list, may drop it meanwhile.
+ */
+typedef struct {
+    Py_buffer view;
+    PyObject *str;
+    const char *text;
+    Py_ssize_t len;
+    int is_buffer;
+} Text;
+
+static int get_text(PyObject *obj, Text *t)
+{
+    t->is_buffer = 0;
+    t->str = NULL;
+    if (PyUnicode_Check(obj)) {
+        if ((t->text = PyUnicode_AsUTF8AndSize(obj, &t->len)) == NULL)
+            return -1;
+        Py_INCREF(obj);
+        t->str = obj;
+        return 0;
+    }
+    if (PyObject_GetBuffer(obj, &t->view, PyBUF_SIMPLE) < 0)
+        return -1;
+    t->text = (const char *) t->view.buf;
+    t->len = t->view.len;
+    t->is_buffer = 1;
+    return 0;
+}
+
+static void release_text(Text *t)
+{
+    if (t->is_buffer) PyBuffer_Release(&t->view);
+    Py_XDECREF(t->str);
+}
+
+static void release_model(void *owner)
+{
+    Model *m = (Model *) owner;
+
+    destroy_identifier(m->lid);
+    if (m->full_lid != NULL) destroy_identifier(m->full_lid);
+    PyMem_RawFree(m);
+}
+
+/* Load the model at path model, or the default one for None, restricted
+ * to a sequence of languages unless that is None. The file is read without
+ * the GIL. NULL, with an exception set, if it cannot be loaded.
+ */
+static Model *load_model(PyObject *model, PyObject *languages)
 {
-    PyObject *m = Py_InitModule3("_langid", module_methods, module_docstring);
-    if (m == NULL)
-        return;
+    PyObject *path = NULL, *seq = NULL;
+    const char **lang_list = NULL;
+    Model *m;
+    Py_ssize_t i, n = 0;
+    int ok = 0;
 
-    identifier = get_default_identifier();
+    if ((m = PyMem_RawCalloc(1, sizeof(Model))) == NULL)
+        return (Model *) PyErr_NoMemory();
+
+    if (model != Py_None) {
+        /* checked first for an OSError with the reason */
+        if (!PyUnicode_FSConverter(model, &path))
+            goto done;
+        if (access(PyBytes_AS_STRING(path), R_OK) != 0) {
+            PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, model);
+            goto done;
+        }
+    }
+    if (languages != Py_None) {
+        if ((seq = PySequence_Fast(languages, "languages must be a sequence of str")) == NULL)
+            goto done;
+        n = PySequence_Fast_GET_SIZE(seq);
+        if ((lang_list = PyMem_Malloc((n ? n : 1) * sizeof(char *))) == NULL) {
+            PyErr_NoMemory();
+            goto done;
+        }
+        for (i = 0; i < n; i++) {
+            if ((lang_list[i] = PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(seq, i))) == NULL)
+                goto done;
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    if (path != NULL) m->lid = try_load_identifier(PyBytes_AS_STRING(path));
+    else {
+#ifdef LANGID_DEFAULT_MODEL
+        m->lid = try_load_identifier(LANGID_DEFAULT_MODEL);
+#else
+        m->lid = get_default_identifier();
+#endif
+    }
+    if (m->lid != NULL && lang_list != NULL) {
+        m->full_lid = m->lid;
+        m->lid = subset_identifier(m->full_lid, lang_list, n);
+    }
+    Py_END_ALLOW_THREADS
+
+    if (m->lid == NULL && m->full_lid == NULL) {
+        /* try_load_identifier has said why on stderr */
+        if (path != NULL) PyErr_Format(PyExc_ValueError, "not a well-formed model: %s", PyBytes_AS_STRING(path));
+        else PyErr_SetString(PyExc_ValueError, "the default model is not well-formed");
+        goto done;
+    }
+    if (m->lid == NULL) {
+        PyErr_SetString(PyExc_ValueError, "no languages given, or a language is not in the model");
+        destroy_identifier(m->full_lid);
+        goto done;
+    }
+    ok = 1;
+
+  done:
+    Py_XDECREF(path);
+    Py_XDECREF(seq);
+    PyMem_Free(lang_list);
+    if (!ok) {
+        PyMem_RawFree(m);
+        return NULL;
+    }
+    return m;
+}
+
+/* A tuple of a str for each language of lid */
+static PyObject *lang_tuple(const LanguageIdentifier *lid)
+{
+    PyObject *langs, *s;
+    unsigned i;
+
+    if ((langs = PyTuple_New(lid->num_langs)) == NULL)
+        return NULL;
+    for (i = 0; i < lid->num_langs; i++) {
+        if ((s = PyUnicode_InternFromString((*lid->nb_classes)[i])) == NULL) {
+            Py_DECREF(langs);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(langs, i, s);
+    }
+    return langs;
+}
+
+static int Identifier_init(Identifier *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"model", "languages", NULL};
+    PyObject *model = Py_None, *languages = Py_None;
+    Model *m;
+
+    if (self->ref != NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "Identifier is already initialised");
+        return -1;
+    }
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OO", kwlist, &model, &languages))
+        return -1;
+    /* a copy, which reload finds as it was */
+    if (languages == Py_None) Py_INCREF(languages);
+    else if ((languages = PySequence_Tuple(languages)) == NULL) return -1;
+    if ((m = load_model(model, languages)) == NULL || (self->langs = lang_tuple(m->lid)) == NULL) {
+        if (m != NULL) release_model(m);
+        Py_DECREF(languages);
+        return -1;
+    }
+
+    self->ref = alloc_model_ref(m->lid, m, release_model);
+    self->lid = m->lid;
+    Py_INCREF(model);
+    self->model = model;
+    self->languages = languages;
+    return 0;
+}
+
+static void Identifier_dealloc(Identifier *self)
+{
+    Py_ssize_t i;
+
+    /* no call is running, as each holds a reference */
+    for (i = 0; i < self->n_idle; i++) free_session(self->idle[i]);
+    PyMem_Free(self->idle);
+    if (self->ref != NULL) free_model_ref(self->ref);
+    Py_XDECREF(self->langs);
+    Py_XDECREF(self->model);
+    Py_XDECREF(self->languages);
+    Py_TYPE(self)->tp_free((PyObject *) self);
 }
 
-static PyObject *langid_identify(PyObject *self, PyObject *args)
+static int check_ready(Identifier *self)
 {
-    char *bytes;
+    if (self->ref == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "Identifier is not initialised");
+        return -1;
+    }
+    return 0;
+}
+
+/* The streaming interface takes a size_t length, so texts of any size
+ * can be classified.
+ */
+static PyObject *Identifier_identify(Identifier *self, PyObject *arg)
+{
+    const LanguageIdentifier *lid;
+    Session *sn;
     const char *lang;
-    int numBytes;
     PyObject *ret;
+    Text t;
+
+    if (check_ready(self) < 0 || get_text(arg, &t) < 0)
+        return NULL;
 
-    if (!PyArg_ParseTuple(args, "s#", &bytes, &numBytes))
+    if ((sn = begin_call(self, &lid)) == NULL) {
+        release_text(&t);
         return NULL;
-    
-    /* Run our identifier */
-    lang = identify(identifier, bytes, numBytes);
+    }
+    Py_BEGIN_ALLOW_THREADS
+    identify_begin_r(lid, sn->ws);
+    identify_feed_r(lid, sn->ws, t.text, t.len);
+    lang = identify_finish_r(lid, sn->ws);
+    Py_END_ALLOW_THREADS
+    release_text(&t);
 
-    /* Build the output object */
-    ret = Py_BuildValue("s", lang);
+    ret = lang_object(self, lang);
+    end_call(self, sn);
     return ret;
 }
 
+/* The top k languages of text, k capped at the number of languages. The
+ * call is left to the caller, with end_call once the names are taken; it
+ * is not begun, and sn is NULL, if 0 is returned.
+ */
+static unsigned rank_text(Identifier *self, PyObject *arg, LangScore *scores, unsigned k, Session **sn)
+{
+    const LanguageIdentifier *lid;
+    Text t;
+
+    *sn = NULL;
+    if (get_text(arg, &t) < 0)
+        return 0;
+
+    if ((*sn = begin_call(self, &lid)) == NULL) {
+        release_text(&t);
+        return 0;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    identify_begin_r(lid, (*sn)->ws);
+    identify_feed_r(lid, (*sn)->ws, t.text, t.len);
+    k = rank_finish_r(lid, (*sn)->ws, scores, k);
+    Py_END_ALLOW_THREADS
+    release_text(&t);
+
+    return k;
+}
+
+static PyObject *Identifier_classify(Identifier *self, PyObject *arg)
+{
+    LangScore best;
+    Session *sn;
+    PyObject *ret;
+
+    if (check_ready(self) < 0 || rank_text(self, arg, &best, 1, &sn) == 0)
+        return NULL;
+
+    ret = Py_BuildValue("(Nd)", lang_object(self, best.lang), best.prob);
+    end_call(self, sn);
+    return ret;
+}
+
+static PyObject *Identifier_rank(Identifier *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"text", "k", NULL};
+    PyObject *text, *k_obj = Py_None, *ret = NULL, *item;
+    LangScore *scores;
+    Session *sn;
+    Py_ssize_t k;
+    unsigned i, n;
+
+    if (check_ready(self) < 0 || !PyArg_ParseTupleAndKeywords(args, kwds, "O|O", kwlist, &text, &k_obj))
+        return NULL;
+    if (k_obj == Py_None) k = self->lid->num_langs;
+    else if ((k = PyNumber_AsSsize_t(k_obj, PyExc_OverflowError)) == -1 && PyErr_Occurred()) return NULL;
+    if (k < 1) {
+        PyErr_SetString(PyExc_ValueError, "k must be at least 1");
+        return NULL;
+    }
+    if (k > self->lid->num_langs) k = self->lid->num_langs;
+
+    if ((scores = PyMem_Malloc(k * sizeof(LangScore))) == NULL)
+        return PyErr_NoMemory();
+    if ((n = rank_text(self, text, scores, k, &sn)) == 0)
+        goto done;
+
+    if ((ret = PyList_New(n)) == NULL)
+        goto done;
+    for (i = 0; i < n; i++) {
+        if ((item = Py_BuildValue("(Ndd)", lang_object(self, scores[i].lang), scores[i].logprob, scores[i].prob)) == NULL) {
+            Py_CLEAR(ret);
+            goto done;
+        }
+        PyList_SET_ITEM(ret, i, item);
+    }
+
+  done:
+    if (sn != NULL) end_call(self, sn);
+    PyMem_Free(scores);
+    return ret;
+}
+
+static PyObject *Identifier_identify_batch(Identifier *self, PyObject *arg)
+{
+    PyObject *seq, *ret = NULL, *lang;
+    Text *t = NULL;
+    const char **texts = NULL, **out = NULL;
+    int *lens = NULL;
+    Py_ssize_t i, n, got = 0;
+    const LanguageIdentifier *lid;
+    Session *sn = NULL;
+
+    if (check_ready(self) < 0)
+        return NULL;
+    if ((seq = PySequence_Fast(arg, "identify_batch expects a sequence of texts")) == NULL)
+        return NULL;
+    n = PySequence_Fast_GET_SIZE(seq);
+
+    t = PyMem_Malloc((n ? n : 1) * sizeof(Text));
+    texts = PyMem_Malloc((n ? n : 1) * sizeof(char *));
+    out = PyMem_Malloc((n ? n : 1) * sizeof(char *));
+    lens = PyMem_Malloc((n ? n : 1) * sizeof(int));
+    if (t == NULL || texts == NULL || out == NULL || lens == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    for (got = 0; got < n; got++) {
+        if (get_text(PySequence_Fast_GET_ITEM(seq, got), &t[got]) < 0)
+            goto done;
+        if (t[got].len > INT_MAX) {
+            release_text(&t[got]);
+            PyErr_SetString(PyExc_OverflowError, "text too long for identify_batch; use identify");
+            goto done;
+        }
+        texts[got] = t[got].text;
+        lens[got] = t[got].len;
+    }
+
+    if ((sn = begin_call(self, &lid)) == NULL)
+        goto done;
+    Py_BEGIN_ALLOW_THREADS
+    identify_batch_r(lid, sn->ws, texts, lens, n, out);
+    Py_END_ALLOW_THREADS
+
+    if ((ret = PyList_New(n)) == NULL)
+        goto done;
+    for (i = 0; i < n; i++) {
+        if ((lang = lang_object(self, out[i])) == NULL) {
+            Py_CLEAR(ret);
+            goto done;
+        }
+        PyList_SET_ITEM(ret, i, lang);
+    }
+
+  done:
+    if (sn != NULL) end_call(self, sn);
+    for (i = 0; i < got; i++) release_text(&t[i]);
+    PyMem_Free(t);
+    PyMem_Free(texts);
+    PyMem_Free(out);
+    PyMem_Free(lens);
+    Py_DECREF(seq);
+    return ret;
+}
+
+/* Swap in a model loaded afresh. Calls begun before take the old model to
+ * the end; end_call frees it after the last of them. */
+static PyObject *Identifier_reload(Identifier *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"model", NULL};
+    PyObject *model = NULL, *langs;
+    Model *m;
+
+    if (check_ready(self) < 0 || !PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &model))
+        return NULL;
+    if (model == NULL || model == Py_None) model = self->model;
+    Py_INCREF(model);
+    if ((m = load_model(model, self->languages)) == NULL || (langs = lang_tuple(m->lid)) == NULL) {
+        if (m != NULL) release_model(m);
+        Py_DECREF(model);
+        return NULL;
+    }
+
+    /* with the GIL held again, so that lid and langs change together */
+    model_swap(self->ref, m->lid, m);
+    self->lid = m->lid;
+    Py_SETREF(self->langs, langs);
+    Py_SETREF(self->model, model);
+    self->retired = model_reclaim(self->ref);
+    Py_RETURN_NONE;
+}
+
+static PyObject *Identifier_get_languages(Identifier *self, void *closure)
+{
+    if (check_ready(self) < 0)
+        return NULL;
+    Py_INCREF(self->langs);
+    return self->langs;
+}
+
+static PyMethodDef Identifier_methods[] = {
+    {"identify", (PyCFunction) Identifier_identify, METH_O, identify_docstring},
+    {"classify", (PyCFunction) Identifier_classify, METH_O, classify_docstring},
+    {"rank", (PyCFunction) Identifier_rank, METH_VARARGS | METH_KEYWORDS, rank_docstring},
+    {"identify_batch", (PyCFunction) Identifier_identify_batch, METH_O, identify_batch_docstring},
+    {"reload", (PyCFunction) Identifier_reload, METH_VARARGS | METH_KEYWORDS, reload_docstring},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef Identifier_getset[] = {
+    {"languages", (getter) Identifier_get_languages, NULL, "The languages considered, in model order.", NULL},
+    {NULL}
+};
+
+static PyTypeObject IdentifierType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_langid.Identifier",
+    .tp_basicsize = sizeof(Identifier),
+    .tp_dealloc = (destructor) Identifier_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = identifier_docstring,
+    .tp_methods = Identifier_methods,
+    .tp_getset = Identifier_getset,
+    .tp_init = (initproc) Identifier_init,
+    .tp_new = PyType_GenericNew,
+};
+
+/* Module-level functions, using the default Identifier */
+static PyObject *langid_identify(PyObject *self, PyObject *arg)
+{
+    return Identifier_identify(default_identifier, arg);
+}
+
+static PyObject *langid_classify(PyObject *self, PyObject *arg)
+{
+    return Identifier_classify(default_identifier, arg);
+}
+
+static PyObject *langid_rank(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    return Identifier_rank(default_identifier, args, kwds);
+}
+
+static PyObject *langid_identify_batch(PyObject *self, PyObject *arg)
+{
+    return Identifier_identify_batch(default_identifier, arg);
+}
+
+static PyObject *langid_load_model(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    return PyObject_Call((PyObject *) &IdentifierType, args, kwds);
+}
+
+/* Module specification */
+static PyMethodDef module_methods[] = {
+    {"identify", langid_identify, METH_O, identify_docstring},
+    {"classify", langid_classify, METH_O, classify_docstring},
+    {"rank", (PyCFunction) langid_rank, METH_VARARGS | METH_KEYWORDS, rank_docstring},
+    {"identify_batch", langid_identify_batch, METH_O, identify_batch_docstring},
+    {"load_model", (PyCFunction) langid_load_model, METH_VARARGS | METH_KEYWORDS, load_model_docstring},
+    {NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef langid_module = {
+    PyModuleDef_HEAD_INIT, "_langid", module_docstring, -1, module_methods
+};
+
+/* Initialize the module */
+PyMODINIT_FUNC PyInit__langid(void)
+{
+    PyObject *m;
+
+    if (PyType_Ready(&IdentifierType) < 0)
+        return NULL;
+    if ((m = PyModule_Create(&langid_module)) == NULL)
+        return NULL;
+
+    default_identifier = (Identifier *) PyObject_CallObject((PyObject *) &IdentifierType, NULL);
+    if (default_identifier == NULL) {
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    Py_INCREF(&IdentifierType);
+    if (PyModule_AddObject(m, "Identifier", (PyObject *) &IdentifierType) < 0) {
+        Py_DECREF(&IdentifierType);
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    return m;
+}
@@ -0,0 +1,217 @@
+/*
+ * Microbenchmarks for the stages of liblangid.
+ *
+ * Each stage is timed over documents of increasing length, cut from a
+ * corpus file or from generated text, and reported as one JSON object per
+ * line with throughput and latency percentiles. Stages too quick to time
+ * one call at a time are timed in groups of repeated calls, each group
+ * giving one sample of the mean time per call. identify_batch_r is timed on
+ * batches of BATCH_SIZE documents and reported per document.
+ *
+ * -F MB fuses the model with that much memory for fused rows first; only
+ * the identify_r numbers reflect it.
+ *
+ * -g BYTES writes that much generated text instead, for use as a corpus by
+ * bench.sh.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "liblangid.h"
+
+/* shortest time worth taking a sample over, and the time spent per test */
+#define MIN_SAMPLE_NS 2000.0
+#define DEFAULT_SECONDS 0.25
+#define MAX_SAMPLES 100000
+
+static const size_t lengths[] = {16, 64, 256, 1024, 4096, 16384, 65536};
+#define NUM_LENGTHS (sizeof(lengths) / sizeof(lengths[0]))
+
+typedef enum { STAGE_TEXT_TO_FV, STAGE_FV_TO_LOGPROB, STAGE_LOGPROB_TO_PRED, STAGE_IDENTIFY, STAGE_BATCH } Stage;
+static const char *stage_names[] = {"text_to_fv", "fv_to_logprob", "logprob_to_pred", "identify_r", "identify_batch_r"};
+
+static double now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b){
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* Text for when no corpus is given: words built from a fixed set of
+ * syllables by a fixed-seed generator, so every run sees the same bytes.
+ */
+static char *generate_text(size_t len){
+    static const char *syllables[] = {
+        "the", "and", "ing", "der", "die", "und", "ent", "les", "que", "ion",
+        "na", "ka", "ar", "en", "er", "ti", "ta", "ko", "sch", "ij",
+        "\xc3\xa9", "\xc3\xa4", "\xc3\xb6", "\xc3\xa7", "\xd0\xb8", "\xd0\xbd", "\xce\xb1", "\xe3\x81\xae"
+    };
+    const unsigned n_syl = sizeof(syllables) / sizeof(syllables[0]);
+    unsigned long long seed = 88172645463325252ULL;
+    size_t pos = 0, sl;
+    unsigned words = 0;
+    char *text;
+
+    if ((text = (char *) malloc(len + 16)) == 0) exit(-1);
+    while (pos < len) {
+        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+        sl = strlen(syllables[seed % n_syl]);
+        memcpy(text + pos, syllables[seed % n_syl], sl);
+        pos += sl;
+        if ((seed >> 20) % 3 == 0) {
+            /* end of a word, and now and then of a line */
+            text[pos++] = ++words % 12 == 0 ? '\n' : ' ';
+        }
+    }
+    return text;
+}
+
+static char *read_corpus(const char *path, size_t *len){
+    FILE *fp;
+    char *text = NULL;
+    size_t size = 0, n;
+
+    if ((fp = fopen(path, "rb")) == NULL) {
+        fprintf(stderr, "unable to open: %s\n", path);
+        exit(-1);
+    }
+    *len = 0;
+    do {
+        if (*len == size) {
+            size = size ? 2 * size : 1 << 20;
+            if ((text = (char *) realloc(text, size)) == 0) exit(-1);
+        }
+        n = fread(text + *len, 1, size - *len, fp);
+        *len += n;
+    } while (n > 0);
+    fclose(fp);
+    return text;
+}
+
+/* Run one call of a stage on docs[0], or on all BATCH_SIZE docs for
+ * STAGE_BATCH, repeated reps times */
+static void run_stage(const LanguageIdentifier *lid, Workspace *ws, Stage stage, const char *docs[], size_t len, unsigned reps){
+    const char *out[BATCH_SIZE];
+    int lens[BATCH_SIZE];
+    volatile int sink;
+    unsigned r;
+
+    for (r = 0; r < BATCH_SIZE; r++) lens[r] = len;
+    for (r = 0; r < reps; r++) {
+        switch (stage) {
+        case STAGE_TEXT_TO_FV: text_to_fv(lid, docs[0], len, ws->sv, ws->fv); break;
+        case STAGE_FV_TO_LOGPROB: fv_to_logprob(lid, ws->fv, ws->lp); break;
+        case STAGE_LOGPROB_TO_PRED: sink = logprob_to_pred(lid, ws->lp); break;
+        case STAGE_IDENTIFY: sink = identify_r(lid, ws, docs[0], len) != NULL; break;
+        case STAGE_BATCH: identify_batch_r(lid, ws, docs, lens, BATCH_SIZE, out); sink = out[0] != NULL; break;
+        }
+    }
+    (void) sink;
+}
+
+static void bench_stage(const LanguageIdentifier *lid, Workspace *ws, Stage stage, const char *model,
+                        const char *corpus, size_t corpus_len, size_t len, double seconds){
+    static double samples[MAX_SAMPLES];
+    double start, t, total = 0.0, deadline;
+    const char *docs[BATCH_SIZE];
+    unsigned reps = 1, n = 0, per_call = stage == STAGE_BATCH ? BATCH_SIZE : 1, j;
+    size_t i = 0;
+
+    /* documents are taken from spread out positions of the corpus */
+#define DOC(i) (corpus + ((i) * 7919 * len) % (corpus_len - len + 1))
+
+    for (j = 0; j < per_call; j++) docs[j] = DOC(j);
+
+    /* the later stages start from the features of their document */
+    if (stage == STAGE_FV_TO_LOGPROB || stage == STAGE_LOGPROB_TO_PRED) {
+        text_to_fv(lid, DOC(0), len, ws->sv, ws->fv);
+        fv_to_logprob(lid, ws->fv, ws->lp);
+    }
+    for (;;) {
+        start = now_ns();
+        run_stage(lid, ws, stage, docs, len, reps);
+        if (now_ns() - start >= MIN_SAMPLE_NS || reps >= 1u << 20) break;
+        reps *= 2;
+    }
+
+    deadline = now_ns() + seconds * 1e9;
+    while (n < MAX_SAMPLES && (n < 10 || now_ns() < deadline)) {
+        for (j = 0; j < per_call; j++) docs[j] = DOC(i++);
+        if (stage == STAGE_FV_TO_LOGPROB || stage == STAGE_LOGPROB_TO_PRED) {
+            text_to_fv(lid, docs[0], len, ws->sv, ws->fv);
+            if (stage == STAGE_LOGPROB_TO_PRED) fv_to_logprob(lid, ws->fv, ws->lp);
+        }
+        start = now_ns();
+        run_stage(lid, ws, stage, docs, len, reps);
+        /* a batch is reported per document, as identify_r is */
+        t = (now_ns() - start) / reps / per_call;
+        samples[n++] = t;
+        total += t;
+    }
+#undef DOC
+
+    qsort(samples, n, sizeof(double), cmp_double);
+    printf("{\"bench\": \"%s\", \"model\": \"%s\", \"kernels\": \"%s\", \"len\": %zu, \"samples\": %u, \"reps\": %u, "
+           "\"docs_per_s\": %.1f, \"mb_per_s\": %.2f, \"p50_ns\": %.1f, \"p99_ns\": %.1f}\n",
+           stage_names[stage], model, lid->kernels->name, len, n, reps,
+           1e9 * n / total, 1e3 * len * n / total, samples[n / 2], samples[(size_t) (n * 0.99)]);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv){
+    const char *model_path = NULL, *corpus_path = NULL;
+    char model_name[4096];
+    long fuse = -1;
+    double seconds = DEFAULT_SECONDS;
+    size_t corpus_len, gen = 0, l;
+    LanguageIdentifier *lid;
+    Workspace *ws;
+    char *corpus;
+    int c, s;
+
+    while ((c = getopt(argc, argv, "m:c:t:g:F:")) != -1)
+      switch (c) {
+        case 'm': model_path = optarg; break;
+        case 'c': corpus_path = optarg; break;
+        case 't': seconds = atof(optarg); break;
+        case 'g': gen = strtoull(optarg, NULL, 10); break;
+        case 'F': fuse = atol(optarg); break;
+        default:
+          fprintf(stderr, "usage: langid_bench [-m MODEL] [-c CORPUS] [-t SECONDS] [-F MB] | -g BYTES\n");
+          return 1;
+      }
+
+    if (gen) {
+        corpus = generate_text(gen);
+        fwrite(corpus, 1, gen, stdout);
+        free(corpus);
+        return 0;
+    }
+
+    if (corpus_path) corpus = read_corpus(corpus_path, &corpus_len);
+    else corpus = generate_text(corpus_len = 4 * lengths[NUM_LENGTHS-1]);
+    if (corpus_len < lengths[NUM_LENGTHS-1]) {
+        fprintf(stderr, "corpus must hold at least %zu bytes\n", lengths[NUM_LENGTHS-1]);
+        return 1;
+    }
+
+    lid = model_path ? load_identifier((char *) model_path) : get_default_identifier();
+    if (fuse >= 0) fuse_identifier(lid, (size_t) fuse << 20);
+    ws = alloc_workspace(lid);
+    snprintf(model_name, sizeof(model_name), "%s%s", model_path ? model_path : "builtin", fuse >= 0 ? "+fused" : "");
+
+    for (s = STAGE_TEXT_TO_FV; s <= STAGE_BATCH; s++)
+        for (l = 0; l < NUM_LENGTHS; l++)
+            bench_stage(lid, ws, s, model_name, corpus, corpus_len, lengths[l], seconds);
+
+    free_workspace(ws);
+    destroy_identifier(lid);
+    free(corpus);
+    return 0;
+}
@@ -0,0 +1,97 @@
+#!/bin/sh
+#
+# Benchmarks for langid.c, written to stdout as one JSON object per line:
+# the stage microbenchmarks of langid_bench, followed by end-to-end runs
+# of the command line modes. Each end-to-end run is repeated and reported
+# with docs/s and MB/s of the median run, and the median and slowest
+# wall-clock times.
+#
+# Environment:
+#   CORPUS   newline-delimited text to use; generated text if unset
+#   PMODEL   model file for the loaded-model runs (ldpy.pmodel if present)
+#   THREADS  worker threads for the -j runs (all CPUs by default)
+#   REPEAT   runs of each end-to-end benchmark (5)
+#   BENCH_SECONDS  time per stage microbenchmark (0.25)
+#
+# On a host with several NUMA nodes and a langid built with NUMA=1, the
+# multi-threaded runs are repeated on one node's share of the threads and
+# on all of them, with and without --numa.
+#
+set -e
+
+LANGID=${LANGID:-./langid}
+BENCH=${BENCH:-./langid_bench}
+THREADS=${THREADS:-$(getconf _NPROCESSORS_ONLN)}
+REPEAT=${REPEAT:-5}
+BENCH_SECONDS=${BENCH_SECONDS:-0.25}
+if [ -z "${PMODEL+set}" ] && [ -f ldpy.pmodel ]; then PMODEL=ldpy.pmodel; fi
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# the corpus, as lines, as one file, and split into files for batch mode
+if [ -n "$CORPUS" ]; then
+  cp "$CORPUS" "$WORK/lines.txt"
+else
+  "$BENCH" -g 33554432 > "$WORK/lines.txt"
+fi
+mkdir "$WORK/files"
+(cd "$WORK/files" && split -l 40 -a 5 ../lines.txt doc.)
+ls "$WORK"/files/* > "$WORK/paths.txt"
+LINES=$(wc -l < "$WORK/lines.txt")
+BYTES=$(wc -c < "$WORK/lines.txt")
+FILES=$(wc -l < "$WORK/paths.txt")
+
+now() { date +%s.%N; }
+
+# e2e NAME MODEL DOCS INPUT ARGS...
+e2e() {
+  name=$1 model=$2 docs=$3 input=$4
+  shift 4
+  if [ "$model" != builtin ]; then set -- -m "$model" "$@"; fi
+  : > "$WORK/times"
+  i=0
+  while [ $i -lt "$REPEAT" ]; do
+    start=$(now)
+    "$LANGID" "$@" < "$input" > /dev/null
+    end=$(now)
+    echo "$start $end" | awk '{ printf "%.6f\n", $2 - $1 }' >> "$WORK/times"
+    i=$((i + 1))
+  done
+  sort -n "$WORK/times" | awk -v name="$name" -v model="$model" -v docs="$docs" -v bytes="$BYTES" \
+      -v args="$*" '
+    { t[NR] = $1 }
+    END {
+      p50 = t[int((NR + 1) / 2)]
+      printf "{\"bench\": \"cli\", \"mode\": \"%s\", \"model\": \"%s\", \"args\": \"%s\", \"docs\": %d, \"bytes\": %d, ", name, model, args, docs, bytes
+      printf "\"runs\": %d, \"docs_per_s\": %.1f, \"mb_per_s\": %.2f, \"p50_s\": %.4f, \"max_s\": %.4f}\n", NR, docs / p50, bytes / p50 / 1e6, p50, t[NR]
+    }'
+}
+
+MODELS=builtin
+if [ -n "$PMODEL" ]; then MODELS="builtin $PMODEL"; fi
+
+for model in $MODELS; do
+  if [ "$model" = builtin ]; then set --; else set -- -m "$model"; fi
+  "$BENCH" -t "$BENCH_SECONDS" "$@"
+  "$BENCH" -t "$BENCH_SECONDS" -F 16 "$@" | grep '"identify_r"'
+done
+for model in $MODELS; do
+  e2e file "$model" 1 "$WORK/lines.txt"
+  e2e line "$model" "$LINES" "$WORK/lines.txt" -l
+  e2e line "$model" "$LINES" "$WORK/lines.txt" -l -j "$THREADS"
+  e2e batch "$model" "$FILES" "$WORK/paths.txt" -b
+  e2e batch "$model" "$FILES" "$WORK/paths.txt" -b -j "$THREADS"
+done
+
+# scaling across NUMA nodes, on the threads of one node and of all of
+# them, with one shared model and with a replica per node (make NUMA=1)
+NODES=$(ls -d /sys/devices/system/node/node[0-9]* 2>/dev/null | wc -l)
+if [ "$NODES" -gt 1 ] && "$LANGID" --numa -l < /dev/null > /dev/null 2>&1; then
+  for t in $((THREADS / NODES)) "$THREADS"; do
+    e2e line builtin "$LINES" "$WORK/lines.txt" -l -j "$t"
+    e2e line builtin "$LINES" "$WORK/lines.txt" -l -j "$t" --numa
+    e2e batch builtin "$FILES" "$WORK/paths.txt" -b -j "$t"
+    e2e batch builtin "$FILES" "$WORK/paths.txt" -b -j "$t" --numa
+  done
+fi
@@ -0,0 +1,244 @@
+#!/bin/sh
+#
+# Regression checks for langid.c. Each check prints one line, "ok NAME" or
+# "FAIL NAME: why", and the script exits non-zero if any failed.
+#
+# Environment:
+#   LANGID   the langid binary to check (./langid)
+#   MODEL    a native model file for the reload checks (model.bin)
+#   PYTHON   python with the _langid extension on its path (python3); the
+#            checks that need the extension are skipped without it
+#   PAIRS    line pairs for the filter memory check (3000000)
+#   MAX_RSS  peak resident set, in kB, allowed for it (81920)
+#
+set -e
+
+LANGID=${LANGID:-./langid}
+MODEL=${MODEL:-model.bin}
+PYTHON=${PYTHON:-python3}
+PAIRS=${PAIRS:-3000000}
+MAX_RSS=${MAX_RSS:-81920}
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+failed=0
+
+ok() { echo "ok $1"; }
+fail() { echo "FAIL $1: $2"; failed=1; }
+skip() { echo "skip $1: $2"; }
+
+# Send the line $2 to the server on the Unix socket $1, printing the answer
+ask() {
+    "$PYTHON" -c '
+import socket, sys
+s = socket.socket(socket.AF_UNIX)
+s.connect(sys.argv[1])
+s.sendall(sys.argv[2].encode() + b"\n")
+s.shutdown(socket.SHUT_WR)
+print(s.makefile("rb").read().decode(), end="")' "$1" "$2"
+}
+
+# The number of lines of file $1 that contain $2
+count() {
+    grep -c "$2" "$1" 2>/dev/null || true
+}
+
+# Write to $2 the native model $1 with N more bytes on each class name,
+# "_xx...", as another section of class names at the end of the file.
+long_names() {
+    "$PYTHON" - "$1" "$2" "$3" <<'EOF'
+import struct, sys
+src, dst, extra = sys.argv[1], sys.argv[2], int(sys.argv[3])
+m = bytearray(open(src, "rb").read())
+header = "<8sIIIIIIIId"
+num_langs = struct.unpack_from(header, m)[4]
+sec = struct.calcsize(header) + 7 * 16      # NATIVE_NB_CLASSES
+off = struct.unpack_from("<QQ", m, sec)[0]
+names = [bytes(m[off + o:m.index(0, off + o)]) for o in struct.unpack_from("<%dI" % num_langs, m, off)]
+table, blob = [], b""
+for name in names:
+    table.append(4 * num_langs + len(blob))
+    blob += name + b"_" + b"x" * extra + b"\0"
+data = struct.pack("<%dI" % num_langs, *table) + blob
+m += b"\0" * (-len(m) % 64)                  # NATIVE_ALIGN
+struct.pack_into("<QQ", m, sec, len(m), len(data))
+open(dst, "wb").write(bytes(m + data))
+EOF
+}
+
+# The peak resident set of process $1 in kB, polled until it exits (and
+# no longer reports one); empty without /proc.
+peak_rss() {
+    peak=
+    while hwm=$(awk '/^VmHWM:/ { print $2 }' "/proc/$1/status" 2>/dev/null) && [ -n "$hwm" ]; do
+        peak=$hwm
+        sleep 0.1
+    done
+    echo "$peak"
+}
+
+# Filter mode on sides that are read rather than mapped, one with short
+# lines and one with long ones: the short side's block holds far more
+# lines than the long side's, and what is left over is carried into the
+# next block, which should not keep growing.
+check_filter_carry() {
+    mkfifo "$WORK/pair.en" "$WORK/pair.de"
+    awk -v n="$PAIRS" 'BEGIN { for (i = 0; i < n; i++) print "the house" }' > "$WORK/pair.en" &
+    awk -v n="$PAIRS" 'BEGIN {
+        s = "Der schnelle braune Fuchs springt ueber den faulen Hund, und die Katze schlaeft im Garten. ";
+        s = s s s;
+        s = substr(s, 1, 204);
+        for (i = 0; i < n; i++) print s
+    }' > "$WORK/pair.de" &
+    "$LANGID" -f "$WORK/pair" en de "$WORK/kept" > "$WORK/filter.out" &
+    pid=$!
+    rss=$(peak_rss $pid)
+    status=0
+    wait $pid || status=$?
+    wait
+    total=$(sed -n 's/^kept [0-9]* of \([0-9]*\) line pairs\.$/\1/p' "$WORK/filter.out")
+    if [ $status -ne 0 ]; then
+        fail filter_carry "langid exited with $status"
+    elif [ "$total" != "$PAIRS" ]; then
+        fail filter_carry "read ${total:-no} pairs of $PAIRS"
+    elif [ "$(wc -l < "$WORK/kept.en")" -ne "$(wc -l < "$WORK/kept.de")" ]; then
+        fail filter_carry "kept sides differ in length"
+    elif [ -n "$rss" ] && [ "$rss" -gt "$MAX_RSS" ]; then
+        fail filter_carry "peak RSS ${rss} kB over ${MAX_RSS} kB"
+    else
+        ok filter_carry
+    fi
+}
+
+# Batch mode on a zstd file between two plain ones: in a build without
+# zstd that file is UNSUPPORTED, and the others are still classified.
+check_batch_codec() {
+    echo "the house is on the hill" > "$WORK/a.txt"
+    printf '\050\265\057\375 not really zstd' > "$WORK/z.txt"
+    echo "das Haus steht auf dem Berg" > "$WORK/c.txt"
+    printf '%s\n' "$WORK/a.txt" "$WORK/z.txt" "$WORK/c.txt" > "$WORK/paths"
+    status=0
+    "$LANGID" -b < "$WORK/paths" > "$WORK/batch.out" 2> "$WORK/batch.err" || status=$?
+    if [ $status -ne 0 ]; then
+        fail batch_codec "langid exited with $status"
+    elif [ "$(cut -d, -f1 "$WORK/batch.out" | tr '\n' ' ')" != "$WORK/a.txt $WORK/z.txt $WORK/c.txt " ]; then
+        fail batch_codec "not one result per file"
+    elif grep -q "^$WORK/z.txt,0,UNSUPPORTED\$" "$WORK/batch.out" && [ "$(wc -l < "$WORK/batch.err")" -ne 1 ]; then
+        fail batch_codec "not reported exactly once"
+    else
+        ok batch_codec
+    fi
+}
+
+# -l -n 3 with class names longer than any fixed room for them, and longer
+# than the output buffer: the same rankings, with the longer names.
+check_rank_long_names() {
+    printf 'This is a test\nDas ist ein Test\nCeci est un test\n' > "$WORK/rank.txt"
+    "$LANGID" -l -n 3 < "$WORK/rank.txt" > "$WORK/rank.ref"
+    for extra in 100 1500000; do
+        long_names "$MODEL" "$WORK/long.nmodel" $extra
+        status=0
+        "$LANGID" -m "$WORK/long.nmodel" -l -n 3 < "$WORK/rank.txt" > "$WORK/rank.out" || status=$?
+        if [ $status -ne 0 ]; then
+            fail rank_long_names "langid exited with $status for names of $extra more bytes"
+            return
+        fi
+        if ! sed 's/_x*:/:/g' "$WORK/rank.out" | cmp -s - "$WORK/rank.ref"; then
+            fail rank_long_names "different rankings for names of $extra more bytes"
+            return
+        fi
+    done
+    ok rank_long_names
+}
+
+# --serve with class names longer than any fixed room for them: the same
+# answers as -l gives with that model, plain and with -n 3.
+check_serve_long_names() {
+    long_names "$MODEL" "$WORK/long.nmodel" 100
+    text="This is a test of the language identifier"
+    why=
+    for opts in "" "-n 3"; do
+        rm -f "$WORK/long.sock"
+        "$LANGID" --serve="unix:$WORK/long.sock" -j 1 $opts -m "$WORK/long.nmodel" 2> /dev/null &
+        pid=$!
+        i=0
+        while [ ! -S "$WORK/long.sock" ] && [ $i -lt 50 ]; do i=$((i + 1)); sleep 0.1; done
+        want=$(echo "$text" | "$LANGID" -l $opts -m "$WORK/long.nmodel")
+        got=$(ask "$WORK/long.sock" "$text" || true)
+        kill $pid 2>/dev/null || true
+        wait $pid 2>/dev/null || true
+        if [ "$got" != "$want" ]; then why="a different answer with '$opts'"; break; fi
+    done
+    if [ -n "$why" ]; then fail serve_long_names "$why"; else ok serve_long_names; fi
+}
+
+# SIGHUP with the model file replaced by an empty and then a truncated one:
+# both reloads fail, and the server keeps answering with the model it has.
+check_serve_reload() {
+    cp "$MODEL" "$WORK/serve.nmodel"
+    "$LANGID" --serve="unix:$WORK/sock" -j 1 -m "$WORK/serve.nmodel" 2> "$WORK/serve.err" &
+    pid=$!
+    i=0
+    while [ ! -S "$WORK/sock" ] && [ $i -lt 50 ]; do i=$((i + 1)); sleep 0.1; done
+    text="This is a test of the language identifier"
+    before=$(ask "$WORK/sock" "$text" || true)
+    why=
+    [ -n "$before" ] || why="no answer before the reloads"
+    for bad in empty truncated; do
+        [ -z "$why" ] || break
+        if [ $bad = empty ]; then : > "$WORK/bad.nmodel"
+        else head -c 100000 "$MODEL" > "$WORK/bad.nmodel"; fi
+        mv "$WORK/bad.nmodel" "$WORK/serve.nmodel"
+        kept=$(count "$WORK/serve.err" "keeping the current model")
+        kill -HUP $pid
+        i=0
+        while [ "$(count "$WORK/serve.err" "keeping the current model")" -eq "$kept" ] \
+              && kill -0 $pid 2>/dev/null && [ $i -lt 50 ]; do
+            i=$((i + 1)); sleep 0.1
+        done
+        if ! kill -0 $pid 2>/dev/null; then
+            why="the server exited on the $bad model"
+        elif [ "$(ask "$WORK/sock" "$text" || true)" != "$before" ]; then
+            why="a different answer after the $bad model"
+        fi
+    done
+    kill $pid 2>/dev/null || true
+    wait $pid 2>/dev/null || true
+    if [ -n "$why" ]; then fail serve_reload "$why"; else ok serve_reload; fi
+}
+
+# Identifier.reload with a truncated model raises ValueError, and the old
+# model goes on answering.
+check_py_reload() {
+    if ! "$PYTHON" -c "import _langid" 2>/dev/null; then
+        skip py_reload "no _langid for $PYTHON"
+        return
+    fi
+    head -c 100000 "$MODEL" > "$WORK/short.nmodel"
+    if "$PYTHON" - "$MODEL" "$WORK/short.nmodel" > "$WORK/py.out" 2>&1 <<'EOF'
+import sys, _langid
+text = "This is a test of the language identifier"
+lid = _langid.load_model(sys.argv[1])
+before = lid.identify(text)
+try:
+    lid.reload(sys.argv[2])
+except ValueError:
+    pass
+else:
+    sys.exit("reload did not raise")
+if lid.identify(text) != before:
+    sys.exit("a different answer after the reload")
+EOF
+    then ok py_reload
+    else fail py_reload "$(tail -n 1 "$WORK/py.out")"
+    fi
+}
+
+check_filter_carry
+check_batch_codec
+check_rank_long_names
+check_serve_long_names
+check_serve_reload
+check_py_reload
+
+exit $failed
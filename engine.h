@@ -0,0 +1,193 @@
+/*
+ * The per-document stages of the classifier, written once and compiled
+ * once per engine by liblangid.c. Before each inclusion it defines
+ *
+ *   ENGINE(name)     the name of a function of this engine
+ *   E_NUM_BYTECLS    number of byte classes of the tokenizer
+ *   E_NUM_LANGS      number of languages
+ *   E_NB_STRIDE      length of a row of nb_ptc
+ *   E_F64_ONLY       if defined, nb_ptc is known to hold doubles
+ *
+ * each either read from the LanguageIdentifier lid or a constant. All of
+ * them are undefined again at the end of this file.
+ */
+
+/* Run the tokenizer over text from state s, adding each state entered
+ * to sv, and return the state it ends in.
+ */
+static unsigned ENGINE(tokenize)(const LanguageIdentifier *lid, const char *text, size_t textlen, unsigned s, Set *sv){
+  size_t i;
+  const unsigned char *bytecls = *lid->tk_bytecls;
+  const uint16_t *nextmove = *lid->tk_nextmove;
+  const unsigned num_bytecls = E_NUM_BYTECLS;
+
+  uint16_t *sparse = sv->sparse16;
+  SetEntry *dense = sv->dense;
+  unsigned index, members = sv->members;
+
+  if (sparse == NULL) {
+      for (i=0; i < textlen; i++){
+          s = nextmove[s * num_bytecls + bytecls[(unsigned char) text[i]]];
+          add(sv, s, 1);
+      }
+      return s;
+  }
+
+  /* add() written out for 16-bit indices, keeping the member count in a
+   * register across the walk */
+  for (i=0; i < textlen; i++){
+      s = nextmove[s * num_bytecls + bytecls[(unsigned char) text[i]]];
+      index = sparse[s];
+      if (index < members && dense[index].key == s) {
+          dense[index].count++;
+      }
+      else {
+          sparse[s] = members;
+          dense[members].key = s;
+          dense[members].count = 1;
+          members++;
+      }
+  }
+  sv->members = members;
+  return s;
+}
+
+/* Run the tokenizer from state 0 over n <= TOKENIZE_GROUP texts together,
+ * adding the states entered by text g to sv[g]. Each walk is a chain of
+ * loads that depend on one another, and most of them miss the cache;
+ * stepping the walks in lockstep keeps the misses of n texts in flight at
+ * once. The next entry of each walk is prefetched as soon as its row is
+ * known, ahead of the update of the state counts.
+ */
+static void ENGINE(tokenize_group)(const LanguageIdentifier *lid, const char *texts[], const int lens[], unsigned n,
+                                   Set *sv[]){
+  const unsigned char *bytecls = *lid->tk_bytecls;
+  const uint16_t *nextmove = *lid->tk_nextmove;
+  const unsigned num_bytecls = E_NUM_BYTECLS;
+  const unsigned char *text[TOKENIZE_GROUP];
+  uint16_t *sparse[TOKENIZE_GROUP];
+  SetEntry *dense[TOKENIZE_GROUP];
+  Set *set[TOKENIZE_GROUP];
+  size_t left[TOKENIZE_GROUP], i, step;
+  unsigned s[TOKENIZE_GROUP], members[TOKENIZE_GROUP], g, m = 0, index, st;
+
+  for (g=0; g < n; g++) {
+      clear(sv[g]);
+      if (lens[g] <= 0) continue;
+      if (sv[g]->sparse16 == NULL) { /* sets too large for 16-bit indices */
+          ENGINE(tokenize)(lid, texts[g], lens[g], 0, sv[g]);
+          continue;
+      }
+      text[m] = (const unsigned char *) texts[g];
+      left[m] = lens[g];
+      set[m] = sv[g];
+      sparse[m] = sv[g]->sparse16;
+      dense[m] = sv[g]->dense;
+      members[m] = 0;
+      s[m++] = 0;
+  }
+
+  while (m > 0) {
+      /* step the walks still going as far as the shortest of them */
+      step = left[0];
+      for (g=1; g < m; g++) if (left[g] < step) step = left[g];
+      for (i=0; i < step; i++) {
+          for (g=0; g < m; g++) {
+              st = s[g] = nextmove[s[g] * num_bytecls + bytecls[text[g][i]]];
+              if (i + 1 < step) __builtin_prefetch(&nextmove[st * num_bytecls + bytecls[text[g][i+1]]]);
+              index = sparse[g][st];
+              if (index < members[g] && dense[g][index].key == st) {
+                  dense[g][index].count++;
+              }
+              else {
+                  sparse[g][st] = members[g];
+                  dense[g][members[g]].key = st;
+                  dense[g][members[g]].count = 1;
+                  members[g]++;
+              }
+          }
+      }
+
+      /* and drop those that ended */
+      for (g=0; g < m; ) {
+          text[g] += step;
+          left[g] -= step;
+          if (left[g] > 0) {
+              g++;
+              continue;
+          }
+          set[g]->members = members[g];
+          m--;
+          text[g] = text[m];
+          left[g] = left[m];
+          set[g] = set[m];
+          sparse[g] = sparse[m];
+          dense[g] = dense[m];
+          members[g] = members[m];
+          s[g] = s[m];
+      }
+  }
+}
+
+/* convert the SV into the FV */
+static void ENGINE(sv_to_fv)(const LanguageIdentifier *lid, Set *sv, Set *fv){
+  unsigned i, j, m;
+
+  clear(fv);
+  for (i=0; i < sv->members; i++) {
+  		m = sv->dense[i].key;
+  		for (j=0; j<(*lid->tk_output_c)[m]; j++){
+				  add(fv, (*lid->tk_output)[(*lid->tk_output_s)[m]+j], sv->dense[i].count);
+			}
+	}
+}
+
+static void ENGINE(init_logprob)(const LanguageIdentifier *lid, double logprob[]){
+    unsigned i;
+
+    for (i=0; i < E_NUM_LANGS; i++){
+        logprob[i] = (*lid->nb_pc)[i];
+    }
+    for (; i < E_NB_STRIDE; i++){
+        logprob[i] = -HUGE_VAL;
+    }
+}
+
+/* Add the weights of the features in fv to logprob */
+static void ENGINE(accumulate_fv)(const LanguageIdentifier *lid, Set *fv, double logprob[]){
+    unsigned i;
+    const unsigned stride = E_NB_STRIDE;
+    const Kernels *k = lid->kernels;
+
+#ifdef E_F64_ONLY
+    for (i=0; i< fv->members; i++){
+        k->acc_f64(logprob, &(*lid->nb_ptc)[fv->dense[i].key * stride], fv->dense[i].count, stride);
+    }
+#else
+    /* Compute posterior for each class. rows are NUM_FEATS * nb_stride */
+    switch (lid->nb_ptc_type) {
+    case NB_PTC_F64:
+        for (i=0; i< fv->members; i++){
+            k->acc_f64(logprob, &(*lid->nb_ptc)[fv->dense[i].key * stride], fv->dense[i].count, stride);
+        }
+        break;
+    case NB_PTC_F32:
+        for (i=0; i< fv->members; i++){
+            k->acc_f32(logprob, &(*lid->nb_ptc_f32)[fv->dense[i].key * stride], fv->dense[i].count, stride);
+        }
+        break;
+    case NB_PTC_I16:
+        for (i=0; i< fv->members; i++){
+            /* fold the dequantization scale into the count */
+            k->acc_i16(logprob, &(*lid->nb_ptc_i16)[fv->dense[i].key * stride], fv->dense[i].count * lid->nb_ptc_scale, stride);
+        }
+        break;
+    }
+#endif
+}
+
+#undef ENGINE
+#undef E_NUM_BYTECLS
+#undef E_NUM_LANGS
+#undef E_NB_STRIDE
+#undef E_F64_ONLY
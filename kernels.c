@@ -0,0 +1,311 @@
+/*
+ * Vectorized scoring kernels with runtime CPU dispatch.
+ *
+ * The x86 variants are compiled with per-function target attributes, so
+ * the library as a whole still runs on any x86-64; select_kernels() picks
+ * the widest variant the CPU supports. They are called from code compiled
+ * for plain SSE, so each one clears the upper vector state before it
+ * returns. On aarch64 NEON is always present.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNELS
+#endif
+
+static void acc_f64_scalar(double *logprob, const double *w, double count, unsigned n){
+    unsigned j;
+    for (j=0; j < n; j++) logprob[j] += count * w[j];
+}
+
+static void acc_f32_scalar(double *logprob, const float *w, double count, unsigned n){
+    unsigned j;
+    for (j=0; j < n; j++) logprob[j] += count * (double) w[j];
+}
+
+static void acc_i16_scalar(double *logprob, const int16_t *w, double count, unsigned n){
+    unsigned j;
+    for (j=0; j < n; j++) logprob[j] += count * w[j];
+}
+
+static unsigned argmax_scalar(const double *logprob, unsigned n){
+    unsigned m = 0, j;
+    for (j=1; j < n; j++) if (logprob[m] < logprob[j]) m = j;
+    return m;
+}
+
+static double sumexp_scalar(const double *logprob, unsigned n, double max){
+    double sum = 0.0;
+    unsigned j;
+    for (j=0; j < n; j++) sum += exp(logprob[j] - max);
+    return sum;
+}
+
+static const Kernels scalar_kernels = {
+    "scalar", acc_f64_scalar, acc_f32_scalar, acc_i16_scalar, argmax_scalar, sumexp_scalar
+};
+
+#ifdef HAVE_X86_KERNELS
+
+/* The vector sumexp kernels evaluate exp(x) for x <= 0 as 2^k * exp(r),
+ * with k = round(x / ln 2) and |r| <= ln 2 / 2, using a degree 13 Taylor
+ * polynomial for exp(r); this is accurate to a few ulp. 2^k is built
+ * directly in the exponent field. Arguments below EXP_MIN, where 2^k would
+ * be subnormal, are flushed to zero; next to the exp(0) = 1 of the
+ * maximum they are far below rounding error.
+ */
+#define EXP_MIN -708.0
+#define EXP_LOG2E 1.4426950408889634
+#define EXP_LN2_HI 0x1.62e42fefa3800p-1
+#define EXP_LN2_LO 0x1.ef35793c76730p-45
+/* adding this puts an integer-valued k + 1023 in the low mantissa bits */
+#define EXP_BIAS (1023.0 + 0x1p52)
+
+static const double exp_coef[14] = {
+    1.0, 1.0, 1.0/2, 1.0/6, 1.0/24, 1.0/120, 1.0/720, 1.0/5040, 1.0/40320,
+    1.0/362880, 1.0/3628800, 1.0/39916800, 1.0/479001600, 1.0/6227020800
+};
+
+__attribute__((target("avx2,fma")))
+static void acc_f64_avx2(double *logprob, const double *w, double count, unsigned n){
+    __m256d c = _mm256_set1_pd(count);
+    unsigned j;
+    for (j=0; j < n; j += 8) {
+        _mm256_storeu_pd(logprob+j, _mm256_fmadd_pd(c, _mm256_loadu_pd(w+j), _mm256_loadu_pd(logprob+j)));
+        _mm256_storeu_pd(logprob+j+4, _mm256_fmadd_pd(c, _mm256_loadu_pd(w+j+4), _mm256_loadu_pd(logprob+j+4)));
+    }
+    _mm256_zeroupper();
+}
+
+__attribute__((target("avx2,fma")))
+static void acc_f32_avx2(double *logprob, const float *w, double count, unsigned n){
+    __m256d c = _mm256_set1_pd(count);
+    __m256 v;
+    unsigned j;
+    for (j=0; j < n; j += 8) {
+        v = _mm256_loadu_ps(w+j);
+        _mm256_storeu_pd(logprob+j, _mm256_fmadd_pd(c, _mm256_cvtps_pd(_mm256_castps256_ps128(v)), _mm256_loadu_pd(logprob+j)));
+        _mm256_storeu_pd(logprob+j+4, _mm256_fmadd_pd(c, _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)), _mm256_loadu_pd(logprob+j+4)));
+    }
+    _mm256_zeroupper();
+}
+
+__attribute__((target("avx2,fma")))
+static void acc_i16_avx2(double *logprob, const int16_t *w, double count, unsigned n){
+    __m256d c = _mm256_set1_pd(count);
+    __m256i v;
+    unsigned j;
+    for (j=0; j < n; j += 8) {
+        v = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *) (w+j)));
+        _mm256_storeu_pd(logprob+j, _mm256_fmadd_pd(c, _mm256_cvtepi32_pd(_mm256_castsi256_si128(v)), _mm256_loadu_pd(logprob+j)));
+        _mm256_storeu_pd(logprob+j+4, _mm256_fmadd_pd(c, _mm256_cvtepi32_pd(_mm256_extracti128_si256(v, 1)), _mm256_loadu_pd(logprob+j+4)));
+    }
+    _mm256_zeroupper();
+}
+
+__attribute__((target("avx2,fma")))
+static unsigned argmax_avx2(const double *logprob, unsigned n){
+    __m256d m = _mm256_loadu_pd(logprob), eq;
+    __m128d h;
+    unsigned j;
+    int mask;
+
+    for (j=4; j < n; j += 4) m = _mm256_max_pd(m, _mm256_loadu_pd(logprob+j));
+    h = _mm_max_pd(_mm256_castpd256_pd128(m), _mm256_extractf128_pd(m, 1));
+    h = _mm_max_sd(h, _mm_unpackhi_pd(h, h));
+    m = _mm256_broadcastsd_pd(h);
+
+    /* the first lane holding the maximum, as in the scalar version */
+    for (j=0; j < n; j += 4) {
+        eq = _mm256_cmp_pd(_mm256_loadu_pd(logprob+j), m, _CMP_EQ_OQ);
+        if ((mask = _mm256_movemask_pd(eq))) break;
+    }
+    _mm256_zeroupper();
+    return j < n ? j + __builtin_ctz(mask) : 0;
+}
+
+__attribute__((target("avx2,fma")))
+static double sumexp_avx2(const double *logprob, unsigned n, double max){
+    const __m256d m = _mm256_set1_pd(max), lo = _mm256_set1_pd(EXP_MIN);
+    __m256d sum = _mm256_setzero_pd(), x, keep, k, r, p;
+    __m128d h;
+    unsigned j;
+    int c;
+
+    for (j=0; j < n; j += 4) {
+        x = _mm256_sub_pd(_mm256_loadu_pd(logprob+j), m);
+        keep = _mm256_cmp_pd(x, lo, _CMP_GE_OQ);
+        x = _mm256_max_pd(x, lo);
+        k = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(EXP_LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        r = _mm256_fnmadd_pd(k, _mm256_set1_pd(EXP_LN2_HI), x);
+        r = _mm256_fnmadd_pd(k, _mm256_set1_pd(EXP_LN2_LO), r);
+        p = _mm256_set1_pd(exp_coef[13]);
+        for (c=12; c >= 0; c--) p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(exp_coef[c]));
+        k = _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_castpd_si256(_mm256_add_pd(k, _mm256_set1_pd(EXP_BIAS))), 52));
+        sum = _mm256_add_pd(sum, _mm256_and_pd(_mm256_mul_pd(p, k), keep));
+    }
+    h = _mm_add_pd(_mm256_castpd256_pd128(sum), _mm256_extractf128_pd(sum, 1));
+    h = _mm_add_sd(h, _mm_unpackhi_pd(h, h));
+    _mm256_zeroupper();
+    return _mm_cvtsd_f64(h);
+}
+
+static const Kernels avx2_kernels = {
+    "avx2", acc_f64_avx2, acc_f32_avx2, acc_i16_avx2, argmax_avx2, sumexp_avx2
+};
+
+__attribute__((target("avx512f")))
+static void acc_f64_avx512(double *logprob, const double *w, double count, unsigned n){
+    __m512d c = _mm512_set1_pd(count);
+    unsigned j;
+    for (j=0; j < n; j += 8)
+        _mm512_storeu_pd(logprob+j, _mm512_fmadd_pd(c, _mm512_loadu_pd(w+j), _mm512_loadu_pd(logprob+j)));
+    _mm256_zeroupper();
+}
+
+__attribute__((target("avx512f")))
+static void acc_f32_avx512(double *logprob, const float *w, double count, unsigned n){
+    __m512d c = _mm512_set1_pd(count);
+    unsigned j;
+    for (j=0; j < n; j += 8)
+        _mm512_storeu_pd(logprob+j, _mm512_fmadd_pd(c, _mm512_cvtps_pd(_mm256_loadu_ps(w+j)), _mm512_loadu_pd(logprob+j)));
+    _mm256_zeroupper();
+}
+
+__attribute__((target("avx512f")))
+static void acc_i16_avx512(double *logprob, const int16_t *w, double count, unsigned n){
+    __m512d c = _mm512_set1_pd(count);
+    __m256i v;
+    unsigned j;
+    for (j=0; j < n; j += 8) {
+        v = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *) (w+j)));
+        _mm512_storeu_pd(logprob+j, _mm512_fmadd_pd(c, _mm512_cvtepi32_pd(v), _mm512_loadu_pd(logprob+j)));
+    }
+    _mm256_zeroupper();
+}
+
+__attribute__((target("avx512f")))
+static unsigned argmax_avx512(const double *logprob, unsigned n){
+    __m512d m = _mm512_loadu_pd(logprob);
+    __mmask8 mask;
+    unsigned j;
+
+    for (j=8; j < n; j += 8) m = _mm512_max_pd(m, _mm512_loadu_pd(logprob+j));
+    m = _mm512_set1_pd(_mm512_reduce_max_pd(m));
+
+    for (j=0; j < n; j += 8) {
+        if ((mask = _mm512_cmp_pd_mask(_mm512_loadu_pd(logprob+j), m, _CMP_EQ_OQ))) break;
+    }
+    _mm256_zeroupper();
+    return j < n ? j + __builtin_ctz(mask) : 0;
+}
+
+__attribute__((target("avx512f")))
+static double sumexp_avx512(const double *logprob, unsigned n, double max){
+    const __m512d m = _mm512_set1_pd(max), lo = _mm512_set1_pd(EXP_MIN);
+    __m512d sum = _mm512_setzero_pd(), x, k, r, p;
+    __mmask8 keep;
+    double total;
+    unsigned j;
+    int c;
+
+    for (j=0; j < n; j += 8) {
+        x = _mm512_sub_pd(_mm512_loadu_pd(logprob+j), m);
+        keep = _mm512_cmp_pd_mask(x, lo, _CMP_GE_OQ);
+        x = _mm512_max_pd(x, lo);
+        k = _mm512_roundscale_pd(_mm512_mul_pd(x, _mm512_set1_pd(EXP_LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        r = _mm512_fnmadd_pd(k, _mm512_set1_pd(EXP_LN2_HI), x);
+        r = _mm512_fnmadd_pd(k, _mm512_set1_pd(EXP_LN2_LO), r);
+        p = _mm512_set1_pd(exp_coef[13]);
+        for (c=12; c >= 0; c--) p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(exp_coef[c]));
+        k = _mm512_castsi512_pd(_mm512_slli_epi64(_mm512_castpd_si512(_mm512_add_pd(k, _mm512_set1_pd(EXP_BIAS))), 52));
+        sum = _mm512_mask_add_pd(sum, keep, sum, _mm512_mul_pd(p, k));
+    }
+    total = _mm512_reduce_add_pd(sum);
+    _mm256_zeroupper();
+    return total;
+}
+
+static const Kernels avx512_kernels = {
+    "avx512", acc_f64_avx512, acc_f32_avx512, acc_i16_avx512, argmax_avx512, sumexp_avx512
+};
+
+#endif /* HAVE_X86_KERNELS */
+
+#ifdef HAVE_NEON_KERNELS
+
+static void acc_f64_neon(double *logprob, const double *w, double count, unsigned n){
+    float64x2_t c = vdupq_n_f64(count);
+    unsigned j;
+    for (j=0; j < n; j += 2)
+        vst1q_f64(logprob+j, vfmaq_f64(vld1q_f64(logprob+j), c, vld1q_f64(w+j)));
+}
+
+static void acc_f32_neon(double *logprob, const float *w, double count, unsigned n){
+    float64x2_t c = vdupq_n_f64(count);
+    float32x4_t v;
+    unsigned j;
+    for (j=0; j < n; j += 4) {
+        v = vld1q_f32(w+j);
+        vst1q_f64(logprob+j, vfmaq_f64(vld1q_f64(logprob+j), c, vcvt_f64_f32(vget_low_f32(v))));
+        vst1q_f64(logprob+j+2, vfmaq_f64(vld1q_f64(logprob+j+2), c, vcvt_high_f64_f32(v)));
+    }
+}
+
+static void acc_i16_neon(double *logprob, const int16_t *w, double count, unsigned n){
+    float64x2_t c = vdupq_n_f64(count);
+    int32x4_t v;
+    unsigned j;
+    for (j=0; j < n; j += 4) {
+        v = vmovl_s16(vld1_s16(w+j));
+        vst1q_f64(logprob+j, vfmaq_f64(vld1q_f64(logprob+j), c, vcvtq_f64_s64(vmovl_s32(vget_low_s32(v)))));
+        vst1q_f64(logprob+j+2, vfmaq_f64(vld1q_f64(logprob+j+2), c, vcvtq_f64_s64(vmovl_high_s32(v))));
+    }
+}
+
+static unsigned argmax_neon(const double *logprob, unsigned n){
+    float64x2_t m = vld1q_f64(logprob);
+    double best;
+    unsigned j;
+
+    for (j=2; j < n; j += 2) m = vmaxq_f64(m, vld1q_f64(logprob+j));
+    best = vmaxvq_f64(m);
+    for (j=0; j < n; j++) if (logprob[j] == best) return j;
+    return 0;
+}
+
+/* there is no vector exp for NEON yet, so sumexp is the scalar loop */
+static const Kernels neon_kernels = {
+    "neon", acc_f64_neon, acc_f32_neon, acc_i16_neon, argmax_neon, sumexp_scalar
+};
+
+#endif /* HAVE_NEON_KERNELS */
+
+const Kernels *select_kernels(void){
+    const Kernels *available[4];
+    const char *want = getenv("LANGID_KERNELS");
+    unsigned n = 0, i;
+
+    /* most capable first */
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) available[n++] = &avx512_kernels;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) available[n++] = &avx2_kernels;
+#endif
+#ifdef HAVE_NEON_KERNELS
+    available[n++] = &neon_kernels;
+#endif
+    available[n++] = &scalar_kernels;
+
+    if (want != NULL) {
+        for (i=0; i < n; i++) if (strcmp(available[i]->name, want) == 0) return available[i];
+    }
+    return available[0];
+}
@@ -0,0 +1,33 @@
+#ifndef _KERNELS_H
+#define _KERNELS_H
+
+#include <stdint.h>
+
+/* Rows of nb_ptc and the logprob vector are padded to a multiple of this
+ * many elements, so that the kernels never need a scalar tail loop.
+ */
+#define NB_ALIGN 8
+
+/* Inner loops of the classifier, in variants for the instruction sets
+ * available on the running CPU. The acc_* kernels compute
+ * logprob[j] += count * w[j] for j < n, argmax returns the index of the
+ * first largest of logprob[0..n), and sumexp returns the sum of
+ * exp(logprob[j] - max) for j < n, where max is at least every logprob[j]
+ * and padding lanes of -HUGE_VAL contribute nothing. n is always a
+ * multiple of NB_ALIGN.
+ */
+typedef struct {
+    const char *name;
+    void (*acc_f64)(double *logprob, const double *w, double count, unsigned n);
+    void (*acc_f32)(double *logprob, const float *w, double count, unsigned n);
+    void (*acc_i16)(double *logprob, const int16_t *w, double count, unsigned n);
+    unsigned (*argmax)(const double *logprob, unsigned n);
+    double (*sumexp)(const double *logprob, unsigned n, double max);
+} Kernels;
+
+/* The best kernels for this CPU. Setting LANGID_KERNELS to the name of a
+ * less capable variant ("scalar", "avx2", ...) selects that one instead.
+ */
+extern const Kernels *select_kernels(void);
+
+#endif
@@ -5,33 +5,172 @@
  * Marco Lui <saffsd@gmail.com>, September 2014
  */
 #include <unistd.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <inttypes.h>
+#include <time.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <errno.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "liblangid.h"
+#include "threadpool.h"
+#include "modelref.h"
+#include "server.h"
+#include "zinput.h"
 
 const char* no_file = "NOSUCHFILE";
 const char* not_file = "NOTAFILE";
+const char* no_codec = "UNSUPPORTED";
+
+/* size of the blocks read by the multi-threaded modes. a block grows
+ * beyond this if it has to hold a single longer line.
+ */
+#define BLOCK_SIZE (4 * 1024 * 1024)
+
+/* size of the pieces in which file mode streams stdin */
+#define STREAM_CHUNK (64 * 1024)
+
+/* size of the buffer in which line mode collects its output */
+#define OUT_SIZE (1024 * 1024)
+
+/* long options without a short form */
+enum { OPT_STATS = 256, OPT_FUSE, OPT_HUGEPAGES, OPT_PREFAULT, OPT_MLOCK, OPT_NUMA,
+       OPT_SERVE, OPT_FRAMING, OPT_MAX_BATCH, OPT_MAX_DELAY, OPT_CACHE, OPT_CASCADE };
 
-void rstrip_ln(char *str);
+static const struct option long_options[] = {
+    {"stats", optional_argument, NULL, OPT_STATS},
+    {"fuse", optional_argument, NULL, OPT_FUSE},
+    {"hugepages", optional_argument, NULL, OPT_HUGEPAGES},
+    {"prefault", no_argument, NULL, OPT_PREFAULT},
+    {"mlock", no_argument, NULL, OPT_MLOCK},
+    {"numa", no_argument, NULL, OPT_NUMA},
+    {"serve", required_argument, NULL, OPT_SERVE},
+    {"framing", required_argument, NULL, OPT_FRAMING},
+    {"max-batch", required_argument, NULL, OPT_MAX_BATCH},
+    {"max-delay", required_argument, NULL, OPT_MAX_DELAY},
+    {"cache", required_argument, NULL, OPT_CACHE},
+    {"cascade", required_argument, NULL, OPT_CASCADE},
+    {NULL, 0, NULL, 0}
+};
+
+/* set by --numa: the worker pools keep a replica of the model per node */
+static int numa_replicas = 0;
+
+/* A block of complete lines read from a stream, together with the
+ * classification result for each line.
+ */
+typedef struct {
+    char *buf;          /* mem, or the part of a mapped input in this block */
+    char *mem;
+    size_t size, len;   /* allocated size of mem and filled size of buf */
+    size_t *start;      /* line i is buf[start[i]] .. buf[start[i+1]] */
+    size_t nlines, maxlines;
+    size_t tail;        /* offset of the first byte after the last line */
+    const char **lang;
+    unsigned nbest;     /* if set, the nbest top languages of line i are */
+    LangScore *scores;  /* scores[i*nbest] .. scores[(i+1)*nbest] */
+} LineBlock;
+
+/* Where blocks of lines come from. A regular file may be mapped as a
+ * whole, and blocks then point into the mapping; anything else is read
+ * into the buffer of each block. Compressed input is never mapped, but
+ * decompressed on a thread of its own as it is read.
+ */
+typedef struct {
+    int fd;
+    const char *map;    /* NULL unless the input is mapped */
+    size_t map_len;
+    size_t pos;         /* offset of the first byte not yet in a block */
+    ZInput *z;          /* set if the input is compressed */
+    char head[ZINPUT_MAGIC];    /* read from fd to tell if it is */
+    size_t head_len, head_pos;
+} LineSource;
+
+/* What the model is built from, kept so that --serve can build it again
+ * on SIGHUP */
+typedef struct {
+    char *model_path;       /* NULL for the in-built model */
+    char *cascade_path;
+    double cascade_margin;
+    const char **langs;     /* -L, if n_langs */
+    unsigned n_langs;
+    long fuse;
+    unsigned place;
+    size_t cache_entries, cache_max_len;
+    unsigned min_langs;     /* what -n needs of it */
+} ModelSpec;
+
+/* A model built from a ModelSpec, along with the models it is made of */
+typedef struct {
+    LanguageIdentifier *lid;
+    LanguageIdentifier *full_lid;   /* the parent of a language subset */
+    LanguageIdentifier *fallback;   /* the main model behind a cascade */
+} Model;
+
+/* Output collected in a large buffer and written with write(2) */
+typedef struct {
+    int fd;
+    char *buf;
+    size_t len;
+} OutBuf;
+
+void line_mode(LanguageIdentifier *lid, unsigned nthreads, unsigned nbest);
+void batch_mode_parallel(LanguageIdentifier *lid, unsigned nthreads, int ordered, unsigned nbest, const EarlyExit *early);
+const char *identify_path(const LanguageIdentifier *lid, Workspace *ws, const char *path, ssize_t *textlen,
+                          LangScore *scores, unsigned nbest, const EarlyExit *early, size_t *consumed);
+static void print_ranking(const LangScore *scores, unsigned n);
+static void print_stats(double wall, unsigned nthreads, int json);
+static void print_cache_stats(const LanguageIdentifier *lid);
+static void print_cascade_stats(const LanguageIdentifier *lid);
+static void print_path_result(const char *path, ssize_t textlen, const char *lang, const LangScore *scores, unsigned nbest,
+                              const EarlyExit *early, size_t consumed);
+int filter_mode(LanguageIdentifier *lid, unsigned nthreads, const char *prefix, const char *src, const char *tgt,
+                const char *dest_prefix, double src_threshold, double tgt_threshold);
+static int build_model(const ModelSpec *spec, Model *m);
+static void destroy_model(Model *m);
+static void release_model(void *owner);
+static LanguageIdentifier *reload_model(void *arg, void **owner);
+static void open_source(LineSource *src, int fd, int map);
+static size_t read_source(LineSource *src, char *buf, size_t n);
+static void close_source(LineSource *src);
 
 int main(int argc, char **argv){
     const char* lang;
     size_t path_size = 4096, text_size=4096;
     ssize_t pathlen, textlen;
+    size_t consumed;
     char *path = NULL, *text = NULL; /* NULL init required for use with getline/getdelim*/
-    LanguageIdentifier *lid;
-
-    /* for use while accessing files through mmap*/
-    int fd;
+    LanguageIdentifier *lid, *fallback;
+    ModelSpec spec;
+    Model model, *owner;
+    ModelRef *ref;
 
     /* for use with getopt */
-    char *model_path = NULL;
-    int c, l_flag = 0, b_flag = 0, f_flag = 0;
+    char *model_path = NULL, *f_prefix = NULL, *langs = NULL, *cascade_path = NULL, *endptr, *comma;
+    int c, l_flag = 0, b_flag = 0, f_flag = 0, k_flag = 0;
+    unsigned n_threads = 0; /* 0 leaves the choice to the mode */
+    unsigned n_best = 0;    /* 0 writes just the top language */
+    LangScore *scores = NULL;
+    double src_threshold = 0.0, tgt_threshold = 0.0;
+    EarlyExit early_opts = {0.0, 0, 4, 0}, *early = NULL;
+    int stats = 0;          /* 1 for a text report, 2 for JSON */
+    long fuse = -1;         /* MB for fused rows, -1 to not fuse */
+    unsigned place = 0;     /* PLACE_* flags for the model */
+    unsigned workers = 1;
+    int status;
+    ServeOptions serve_opts = {NULL, SERVE_LINES, SERVE_BATCH, SERVE_DELAY_US, 0, 0, 0, NULL, NULL};
+    size_t cache_entries = 0, cache_max_len = CACHE_MAX_LEN;
+    double cascade_margin = CASCADE_MARGIN, margin;
+    long value;
+    struct timespec start, end;
     opterr = 0;
 
 #ifdef DEBUG
@@ -42,9 +181,26 @@ int main(int argc, char **argv){
      * l: line-mode
      * b: batch-mode
      * m: load a model file
+     * L: comma-separated list of languages to consider
+     * n: write the top N languages with their probabilities
+     * j: number of worker threads
+     * k: keep input order in multi-threaded batch-mode
+     * f: filter a parallel corpus
+     * t: minimum language probability when filtering
+     * e: stop reading a file once the best language leads by this margin
+     * B: read at most this many bytes of a file, from this many positions
+     * --stats[=json]: report where the time went on stderr at exit
+     * --fuse[=MB]: score straight from the tokenizer states
+     * --hugepages[=explicit], --prefault, --mlock: placement of the model
+     * --numa: with -j, a copy of the model per NUMA node
+     * --serve=ADDR: answer requests on a socket, see server.h
+     * --framing=line|length, --max-batch=N, --max-delay=US: for --serve
+     * --cache=N[M][,LEN]: remember the results of texts of up to LEN bytes
+     * --cascade=MODEL[,MARGIN]: classify with MODEL first, and with the
+     *   main model only when MODEL is unsure
      */
 
-    while ((c = getopt (argc, argv, "lbmf:")) != -1)
+    while ((c = getopt_long (argc, argv, "lbkm:L:n:f:j:t:e:B:", long_options, NULL)) != -1)
       switch (c) {
         case 'l':
           l_flag = 1;
@@ -52,14 +208,163 @@ int main(int argc, char **argv){
         case 'b':
           b_flag = 1;
           break;
+        case 'k':
+          k_flag = 1;
+          break;
         case 'm':
           model_path = optarg;
           break;
+        case 'L':
+          langs = optarg;
+          break;
         case 'f':
           f_flag = 1;
+          f_prefix = optarg;
+          break;
+        case 't':
+          /* P applies to both sides, P,Q to source and target */
+          src_threshold = tgt_threshold = strtod(optarg, &endptr);
+          if (*endptr == ',') tgt_threshold = strtod(endptr + 1, &endptr);
+          if (*endptr != '\0') {
+            fprintf(stderr, "Invalid threshold: %s\n", optarg);
+            return 1;
+          }
+          break;
+        case 'e':
+          early_opts.margin = strtod(optarg, &endptr);
+          if (*endptr != '\0' || early_opts.margin <= 0.0) {
+            fprintf(stderr, "Invalid margin: %s\n", optarg);
+            return 1;
+          }
+          early = &early_opts;
+          break;
+        case 'B':
+          /* BYTES or BYTES,POSITIONS */
+          early_opts.budget = strtoull(optarg, &endptr, 10);
+          if (*endptr == ',') early_opts.positions = strtoul(endptr + 1, &endptr, 10);
+          if (*endptr != '\0' || early_opts.budget == 0 || early_opts.positions < 1
+              || early_opts.positions > EARLY_MAX_POSITIONS) {
+            fprintf(stderr, "Invalid byte budget: %s\n", optarg);
+            return 1;
+          }
+          early = &early_opts;
+          break;
+        case 'n':
+          n_best = atoi(optarg);
+          if (atoi(optarg) < 1) {
+            fprintf(stderr, "Invalid number of languages: %s\n", optarg);
+            return 1;
+          }
+          break;
+        case 'j':
+          n_threads = atoi(optarg);
+          if (atoi(optarg) < 1) {
+            fprintf(stderr, "Invalid number of threads: %s\n", optarg);
+            return 1;
+          }
+          break;
+        case OPT_STATS:
+          if (optarg == NULL) stats = 1;
+          else if (strcmp(optarg, "json") == 0) stats = 2;
+          else {
+            fprintf(stderr, "Invalid stats format: %s\n", optarg);
+            return 1;
+          }
+          if (!stats_enabled()) {
+            fprintf(stderr, "--stats needs liblangid built with -DLANGID_STATS (make STATS=1).\n");
+            return 1;
+          }
+          break;
+        case OPT_FUSE:
+          fuse = optarg ? strtol(optarg, &endptr, 10) : FUSED_BUDGET >> 20;
+          if ((optarg && *endptr != '\0') || fuse < 0) {
+            fprintf(stderr, "Invalid fused memory budget: %s\n", optarg);
+            return 1;
+          }
+          break;
+        case OPT_HUGEPAGES:
+          if (optarg == NULL) place |= PLACE_HUGEPAGES;
+          else if (strcmp(optarg, "explicit") == 0) place |= PLACE_HUGETLB;
+          else {
+            fprintf(stderr, "Invalid huge page type: %s\n", optarg);
+            return 1;
+          }
+          break;
+        case OPT_PREFAULT:
+          place |= PLACE_PREFAULT;
+          break;
+        case OPT_MLOCK:
+          place |= PLACE_MLOCK;
+          break;
+        case OPT_NUMA:
+#ifndef LANGID_NUMA
+          fprintf(stderr, "--numa needs langid built with -DLANGID_NUMA (make NUMA=1).\n");
+          return 1;
+#endif
+          numa_replicas = 1;
+          break;
+        case OPT_SERVE:
+          serve_opts.addr = optarg;
+          break;
+        case OPT_FRAMING:
+          if (strcmp(optarg, "line") == 0) serve_opts.framing = SERVE_LINES;
+          else if (strcmp(optarg, "length") == 0) serve_opts.framing = SERVE_LENGTH;
+          else {
+            fprintf(stderr, "Invalid framing: %s\n", optarg);
+            return 1;
+          }
+          break;
+        case OPT_MAX_BATCH:
+          value = strtol(optarg, &endptr, 10);
+          if (*endptr != '\0' || value < 1) {
+            fprintf(stderr, "Invalid batch size: %s\n", optarg);
+            return 1;
+          }
+          serve_opts.max_batch = value;
+          break;
+        case OPT_MAX_DELAY:
+          value = strtol(optarg, &endptr, 10);
+          if (*endptr != '\0' || value < 0 || value > 10000000) {
+            fprintf(stderr, "Invalid batch delay: %s\n", optarg);
+            return 1;
+          }
+          serve_opts.max_delay_us = value;
+          break;
+        case OPT_CACHE:
+          /* ENTRIES or MB followed by M, then optionally the length cutoff */
+          cache_entries = strtoull(optarg, &endptr, 10);
+          if (*endptr == 'M') {
+            endptr++;
+            value = cache_entries;
+            cache_entries = 0;
+          }
+          else value = -1;
+          if (*endptr == ',') cache_max_len = strtoull(endptr + 1, &endptr, 10);
+          if (value >= 0) cache_entries = ((size_t) value << 20) / (CACHE_ENTRY_OVERHEAD + cache_max_len);
+          if (*endptr != '\0' || cache_entries == 0 || cache_max_len == 0) {
+            fprintf(stderr, "Invalid cache size: %s\n", optarg);
+            return 1;
+          }
+          break;
+        case OPT_CASCADE:
+          /* MODEL, then ,MARGIN if what follows the last comma is a number */
+          cascade_path = optarg;
+          if ((comma = strrchr(optarg, ',')) != NULL) {
+            margin = strtod(comma + 1, &endptr);
+            if (endptr != comma + 1 && *endptr == '\0') {
+              if (margin < 0.0) {
+                fprintf(stderr, "Invalid cascade margin: %s\n", comma + 1);
+                return 1;
+              }
+              cascade_margin = margin;
+              *comma = '\0';
+            }
+          }
           break;
         case '?':
-          if (optopt == 'm')
+          if (optopt == 0)
+            fprintf (stderr, "Unknown option `%s'.\n", argv[optind-1]);
+          else if (optopt == 'm' || optopt == 'L' || optopt == 'n' || optopt == 'f' || optopt == 'j' || optopt == 't' || optopt == 'e' || optopt == 'B')
             fprintf (stderr, "Option -%c requires an argument.\n", optopt);
           else if (isprint (optopt))
             fprintf (stderr, "Unknown option `-%c'.\n", optopt);
@@ -77,108 +382,97 @@ int main(int argc, char **argv){
       fprintf(stderr, "Cannot specify both -l and -b and -f.\n");
       exit(-1);
     }
+    if (serve_opts.addr && (l_flag || b_flag || f_flag)) {
+      fprintf(stderr, "Cannot combine --serve with -l, -b or -f.\n");
+      exit(-1);
+    }
+    if (cascade_path && (langs != NULL || early != NULL)) {
+      fprintf(stderr, "Cannot combine --cascade with -L, -e or -B.\n");
+      exit(-1);
+    }
+    /* file mode streams its document, which only the first model would see */
+    if (cascade_path && !(l_flag || b_flag || f_flag || serve_opts.addr) && !isatty(fileno(stdin))) {
+      fprintf(stderr, "--cascade needs -l, -b, -f or --serve.\n");
+      exit(-1);
+    }
     
-    /* load an identifier */
-    lid = model_path ? load_identifier(model_path) : get_default_identifier();
+    memset(&spec, 0, sizeof(spec));
+    spec.model_path = model_path;
+    spec.cascade_path = cascade_path;
+    spec.cascade_margin = cascade_margin;
+    spec.fuse = fuse;
+    spec.place = place;
+    spec.cache_entries = cache_entries;
+    spec.cache_max_len = cache_max_len;
+
+    /* the languages of -L, pointing into langs */
+    if (langs != NULL) {
+      char *tok;
+
+      spec.n_langs = 1;
+      for (tok = langs; *tok; tok++) spec.n_langs += *tok == ',';
+      if ((spec.langs = (const char **) malloc(spec.n_langs * sizeof(char *))) == 0) exit(-1);
+      spec.n_langs = 0;
+      for (tok = strtok(langs, ","); tok != NULL; tok = strtok(NULL, ","))
+        spec.langs[spec.n_langs++] = tok;
+    }
+
+    if (build_model(&spec, &model) != 0) {
+      free(spec.langs);
+      return 1;
+    }
+    lid = model.lid;
+    fallback = model.fallback;
+
+    if (n_best > lid->num_langs) n_best = lid->num_langs;
+    if (fallback && n_best > fallback->num_langs) n_best = fallback->num_langs;
+    if (n_best && (scores = (LangScore *) malloc(n_best * sizeof(LangScore))) == 0) exit(-1);
+
+    /* classification runs on this many threads, besides reading input */
+    if (serve_opts.addr) workers = n_threads ? n_threads : sysconf(_SC_NPROCESSORS_ONLN);
+    else if (f_flag) workers = n_threads ? n_threads : 2;
+    else if ((l_flag || b_flag) && n_threads > 1) workers = n_threads;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
     /* enter appropriate operating mode.
      * we have an interactive mode determined by isatty, and then
      * the three modes are file-mode (default), line-mode and batch-mode
      */
 
-    if (f_flag) { /*filter mode*/
+    if (serve_opts.addr) { /*server mode*/
+      serve_opts.nbest = n_best;
+      serve_opts.nthreads = workers;
+      serve_opts.numa = numa_replicas;
+      /* a model built again on SIGHUP must offer at least as many languages */
+      spec.min_langs = n_best;
+      serve_opts.reload = reload_model;
+      serve_opts.reload_arg = &spec;
+      if ((owner = (Model *) malloc(sizeof(Model))) == 0) exit(-1);
+      *owner = model;
+      ref = alloc_model_ref(lid, owner, release_model);
+      status = serve(ref, &serve_opts);
+      /* which releases the model it ended with, whichever that is, and
+       * reports on it already */
+      free_model_ref(ref);
+      memset(&model, 0, sizeof(model));
+      if (status != 0) {
+        free(scores);
+        free(spec.langs);
+        return 1;
+      }
+    }
+    else if (f_flag) { /*filter mode*/
+      if (argc - optind != 3) {
+        fprintf(stderr, "usage: langid [-j N] [-t P[,P]] -f PREFIX SRC TGT DEST_PREFIX\n");
+        exit(-1);
+      }
       printf("langid.c filtering mode.\n");
-      const char *src_lang, *tgt_lang;
-      FILE *fp_src_file, *fp_tgt_file, *fp_src_dest, *fp_tgt_dest, *fp_src_lid, *fp_tgt_lid;
-      size_t src_size = 16 * 1024, tgt_size = 16 * 1024;
-      char src_file[path_size], tgt_file[path_size];
-      char src_dest[path_size], tgt_dest[path_size];
-      char src_lid[path_size], tgt_lid[path_size];
-      ssize_t src_len, tgt_len;
-      char *src_text = NULL, *tgt_text = NULL, *src_l = NULL, *tgt_l = NULL; /* NULL init required for use with getline/getdelim*/
-      char *prefix = argv[2];
-      char *src = argv[3];
-      char *tgt = argv[4];
-      char *dest_prefix = argv[5];
-
-      sprintf(src_file, "%s.%s", prefix, src);
-      sprintf(tgt_file, "%s.%s", prefix, tgt);
-      sprintf(src_dest, "%s.%s", dest_prefix, src);
-      sprintf(tgt_dest, "%s.%s", dest_prefix, tgt);
-      sprintf(src_lid, "%s.lid.%s", prefix, src);
-      sprintf(tgt_lid, "%s.lid.%s", prefix, tgt);
-
-      fp_src_file = fopen(src_file, "r");
-      fp_tgt_file = fopen(tgt_file, "r");
-      fp_src_dest = fopen(src_dest, "w");
-      fp_tgt_dest = fopen(tgt_dest, "w");
-      fp_src_lid = fopen(src_lid, "w+");
-      fp_tgt_lid = fopen(tgt_lid, "w+");
-
-      if (fp_src_file == NULL || fp_tgt_file == NULL ||
-          fp_src_dest == NULL || fp_tgt_dest == NULL ||
-          fp_src_lid == NULL || fp_tgt_lid == NULL) {
-        fprintf(stderr, "file open error.");
-        goto cleanup;
+      if (filter_mode(lid, n_threads ? n_threads : 2, f_prefix, argv[optind], argv[optind+1], argv[optind+2],
+                      src_threshold, tgt_threshold) != 0) {
+        destroy_model(&model);
+        free(spec.langs);
         return -1;
       }
-      else {
-        int status = 0;
-        pid_t wait_pid;
-        pid_t pid = fork();
-        if (pid < 0) {
-          fprintf(stderr, "fork error.");
-          return -1;
-        }
-        else if (pid == 0) {
-          while ((src_len = getline(&src_text, &src_size, fp_src_file)) != -1) {
-            src_lang = identify(lid, src_text, src_len);
-            fprintf(fp_src_lid, "%s\n", src_lang);
-          }
-          exit(0);
-        }
-        while ((tgt_len = getline(&tgt_text, &tgt_size, fp_tgt_file)) != -1){
-          tgt_lang = identify(lid, tgt_text, tgt_len);
-          fprintf(fp_tgt_lid, "%s\n", tgt_lang);
-        }
-        wait_pid = wait(&status);
-        if (wait_pid < 0) {
-          fprintf(stderr, "wait error.");
-          return -1;
-        }
-        fseek(fp_src_file, 0L, SEEK_SET);
-        fseek(fp_tgt_file, 0L, SEEK_SET);
-        fseek(fp_src_lid, 0L, SEEK_SET);
-        fseek(fp_tgt_lid, 0L, SEEK_SET);
-        while ((src_len = getline(&src_text, &src_size, fp_src_file)) != -1 &&
-               (tgt_len = getline(&tgt_text, &tgt_size, fp_tgt_file)) != -1 &&
-               (src_len = getline(&src_l, &path_size, fp_src_lid)) != -1 &&
-               (tgt_len = getline(&tgt_l, &path_size, fp_tgt_lid)) != -1) {
-          rstrip_ln(src_l);
-          rstrip_ln(tgt_l);
-          if ((strcmp(src_l, src) == 0) && (strcmp(tgt_l, tgt) == 0)) {
-            fprintf(fp_src_dest, "%s", src_text);
-            fprintf(fp_tgt_dest, "%s", tgt_text);
-          }
-        }
-        goto cleanup;
-        free(src_text);
-        free(tgt_text);
-        free(src_l);
-        free(tgt_l);
-        unlink(src_lid);
-        unlink(tgt_lid);
-        return 0;
-      }
-
-    cleanup:
-      if (fp_src_file != NULL) fclose(fp_src_file);
-      if (fp_tgt_file != NULL) fclose(fp_tgt_file);
-      if (fp_src_dest != NULL) fclose(fp_src_dest);
-      if (fp_tgt_dest != NULL) fclose(fp_tgt_dest);
-      if (fp_src_lid != NULL) fclose(fp_src_lid);
-      if (fp_tgt_lid != NULL) fclose(fp_tgt_lid);
-
     }
     else if (isatty(fileno(stdin))){
       printf("langid.c interactive mode.\n");
@@ -194,61 +488,925 @@ int main(int argc, char **argv){
       printf("Bye!\n");
 
     }
-    else if (l_flag) { /*line mode*/
+    else if (l_flag) { /*line mode, single- or multi-threaded*/
 
-      while ((textlen = getline(&text, &text_size, stdin)) != -1){
-        lang = identify(lid, text, textlen);
-        printf("%s,%zd\n", lang, textlen);
-      }
+      line_mode(lid, n_threads, n_best);
+
+    }
+    else if (b_flag && n_threads > 1) { /*multi-threaded batch mode*/
+
+      batch_mode_parallel(lid, n_threads, k_flag, n_best, early);
 
     }
     else if (b_flag) { /*batch mode*/
 
       /* loop on stdin, interpreting each line as a path */
       while ((pathlen = getline(&path, &path_size, stdin)) != -1){
-        path[pathlen-1] = '\0';
-        /* TODO: ensure that path is a real file. 
-         * the main issue is with directories I think, no problem reading from a pipe or socket
-         * presumably. Anything that returns data should be fair game.*/
-        if ((fd = open(path, O_RDONLY))==-1) {
-          lang = no_file;
+        if (path[pathlen-1] == '\n') path[pathlen-1] = '\0';
+        lang = identify_path(lid, lid->ws, path, &textlen, scores, n_best, early, &consumed);
+        print_path_result(path, textlen, lang, scores, n_best, early, consumed);
+      }
+
+    }
+    else { /*file mode*/
+      LineSource src;
+
+      /* stream all of stdin through as a single file, decompressed if
+       * need be */
+      if ((text = (char *) malloc(STREAM_CHUNK)) == 0) exit(-1);
+      open_source(&src, STDIN_FILENO, 0);
+      identify_begin_r(lid, lid->ws);
+      while ((textlen = read_source(&src, text, STREAM_CHUNK)) > 0)
+        identify_feed_r(lid, lid->ws, text, textlen);
+      if (n_best) print_ranking(scores, rank_finish_r(lid, lid->ws, scores, n_best));
+      else printf("%s", identify_finish_r(lid, lid->ws));
+      printf(",%zu\n", lid->ws->stream_len);
+      close_source(&src);
+      free(text);
+
+    }
+
+    free(scores);
+    if (model.lid != NULL) {
+      if (cache_entries) print_cache_stats(lid);
+      if (fallback) print_cascade_stats(lid);
+      destroy_model(&model);
+    }
+    free(spec.langs);
+
+    /* every workspace is freed by now, so the totals are complete */
+    if (stats) {
+      fflush(stdout);
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      print_stats(end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9, workers, stats == 2);
+    }
+    return 0;
+}
+
+/* Build the model spec describes. Returns -1, having said why, if it cannot
+ * be built, including when a model file fails to load.
+ */
+static int build_model(const ModelSpec *spec, Model *m){
+    memset(m, 0, sizeof(Model));
+    if (!spec->model_path) m->lid = get_default_identifier();
+    else if ((m->lid = try_load_identifier(spec->model_path)) == NULL) return -1;
+
+    /* restrict it to a subset of its languages */
+    if (spec->n_langs) {
+      m->full_lid = m->lid;
+      if ((m->lid = subset_identifier(m->full_lid, spec->langs, spec->n_langs)) == NULL) {
+        destroy_identifier(m->full_lid);
+        return -1;
+      }
+    }
+
+    if (spec->fuse >= 0) fuse_identifier(m->lid, (size_t) spec->fuse << 20);
+
+    /* the loaded model becomes the second stage, behind the cascade's */
+    if (spec->cascade_path) {
+      m->fallback = m->lid;
+      if ((m->lid = try_load_identifier(spec->cascade_path)) == NULL) {
+        m->lid = m->fallback;
+        m->fallback = NULL;
+        destroy_model(m);
+        return -1;
+      }
+      if (spec->fuse >= 0) fuse_identifier(m->lid, (size_t) spec->fuse << 20);
+      cascade_identifier(m->lid, m->fallback, spec->cascade_margin);
+    }
+
+    if (spec->cache_entries) cache_identifier(m->lid, spec->cache_entries, spec->cache_max_len);
+    if (spec->place && (place_identifier(m->lid, spec->place) != 0
+                        || (m->fallback && place_identifier(m->fallback, spec->place) != 0))) {
+      destroy_model(m);
+      return -1;
+    }
+
+    if (m->lid->num_langs < spec->min_langs || (m->fallback && m->fallback->num_langs < spec->min_langs)) {
+      fprintf(stderr, "the model has fewer than the %u languages asked for with -n\n", spec->min_langs);
+      destroy_model(m);
+      return -1;
+    }
+    return 0;
+}
+
+static void destroy_model(Model *m){
+    destroy_identifier(m->lid);
+    if (m->fallback != NULL) destroy_identifier(m->fallback);
+    if (m->full_lid != NULL) destroy_identifier(m->full_lid);
+}
+
+/* model_release for a Model of its own */
+static void release_model(void *owner){
+    destroy_model((Model *) owner);
+    free(owner);
+}
+
+/* Build the model of the ModelSpec at arg again, for a reload of --serve.
+ * A model file that is missing or malformed fails the reload, leaving the
+ * server on the model it has. */
+static LanguageIdentifier *reload_model(void *arg, void **owner){
+    const ModelSpec *spec = (const ModelSpec *) arg;
+    Model *m;
+
+    if ((m = (Model *) malloc(sizeof(Model))) == 0) exit(-1);
+    if (build_model(spec, m) != 0) {
+      free(m);
+      return NULL;
+    }
+    *owner = m;
+    return m->lid;
+}
+
+/* Report the counters of liblangid on stderr. Stage times are summed over
+ * all threads; with a single one, wall time less the stages is the time
+ * that went to reading input and writing output.
+ */
+static void print_stats(double wall, unsigned nthreads, int json){
+    IdentifyStats st;
+    double docs, bytes, stage;
+    unsigned i;
+    const char *names[] = {"tokenize", "expand", "score", "pred"};
+    uint64_t ns[4];
+
+    memset(&st, 0, sizeof(st));
+    add_retired_stats(&st);
+    ns[0] = st.tokenize_ns; ns[1] = st.expand_ns; ns[2] = st.score_ns; ns[3] = st.pred_ns;
+    stage = (ns[0] + ns[1] + ns[2] + ns[3]) / 1e9;
+
+    if (json) {
+      fprintf(stderr, "{\"docs\": %" PRIu64 ", \"bytes\": %" PRIu64 ", \"states\": %" PRIu64 ", \"max_states\": %" PRIu64
+              ", \"feats\": %" PRIu64 ", \"max_feats\": %" PRIu64, st.docs, st.bytes, st.states, st.max_states,
+              st.feats, st.max_feats);
+      for (i = 0; i < 4; i++) fprintf(stderr, ", \"%s_ns\": %" PRIu64, names[i], ns[i]);
+      fprintf(stderr, ", \"wall_ns\": %.0f, \"threads\": %u}\n", wall * 1e9, nthreads);
+      return;
+    }
+
+    docs = st.docs ? st.docs : 1;
+    bytes = st.bytes ? st.bytes : 1;
+    fprintf(stderr, "langid stats: %" PRIu64 " docs, %" PRIu64 " bytes, %.1f bytes/doc, %.3f s wall, %u thread%s\n",
+            st.docs, st.bytes, st.bytes / docs, wall, nthreads, nthreads == 1 ? "" : "s");
+    fprintf(stderr, "  states/doc   %12.1f avg %10" PRIu64 " max\n", st.states / docs, st.max_states);
+    fprintf(stderr, "  features/doc %12.1f avg %10" PRIu64 " max\n", st.feats / docs, st.max_feats);
+    for (i = 0; i < 4; i++)
+      fprintf(stderr, "  %-12s %12.3f ms %5.1f%% %10.1f ns/doc %8.3f ns/byte\n", names[i], ns[i] / 1e6,
+              stage > 0 ? ns[i] / 1e7 / stage : 0.0, ns[i] / docs, ns[i] / bytes);
+    if (nthreads == 1 && wall > stage)
+      fprintf(stderr, "  %-12s %12.3f ms\n", "i/o", (wall - stage) * 1e3);
+}
+
+/* Report the hit rate of the result cache on stderr */
+static void print_cache_stats(const LanguageIdentifier *lid){
+    CacheStats st;
+
+    if (!get_cache_stats(lid, &st)) return;
+    fprintf(stderr, "langid cache: %" PRIu64 " lookups, %" PRIu64 " hits (%.1f%%), %" PRIu64 " stores, %" PRIu64
+            " evictions, %" PRIu64 " longer than %zu bytes; %zu entries, %.1f MB\n", st.lookups, st.hits,
+            st.lookups ? 100.0 * st.hits / st.lookups : 0.0, st.stores, st.evictions, st.too_long, st.max_len,
+            st.entries, st.bytes / 1048576.0);
+}
+
+/* Report how often the cascade fell back to the main model on stderr */
+static void print_cascade_stats(const LanguageIdentifier *lid){
+    CascadeStats st;
+
+    if (!get_cascade_stats(lid, &st)) return;
+    fprintf(stderr, "langid cascade: %" PRIu64 " texts, %" PRIu64 " scored again by the main model (%.1f%%)\n",
+            st.docs, st.fallbacks, st.docs ? 100.0 * st.fallbacks / st.docs : 0.0);
+}
+
+/* Write a ranking as space-separated lang:prob pairs */
+static void print_ranking(const LangScore *scores, unsigned n){
+    unsigned i;
+
+    for (i = 0; i < n; i++)
+        printf(i ? " %s:%.6g" : "%s:%.6g", scores[i].lang, scores[i].prob);
+}
+
+static void reserve_lines(LineBlock *b, size_t n){
+    if (n <= b->maxlines) return;
+    while (b->maxlines < n) b->maxlines = b->maxlines ? 2 * b->maxlines : 4096;
+    if ((b->start = (size_t *) realloc(b->start, b->maxlines * sizeof(size_t))) == 0) exit(-1);
+    if ((b->lang = (const char **) realloc(b->lang, b->maxlines * sizeof(char *))) == 0) exit(-1);
+    if (b->nbest && (b->scores = (LangScore *) realloc(b->scores, b->maxlines * b->nbest * sizeof(LangScore))) == 0) exit(-1);
+}
+
+/* Record a line starting at pos. One slot is always kept spare for the
+ * end offset of the last line.
+ */
+static void push_line(LineBlock *b, size_t pos){
+    reserve_lines(b, b->nlines + 2);
+    b->start[b->nlines++] = pos;
+}
+
+/* Record a line for each newline in buf[pos] .. buf[len], which starts at
+ * pos or just after the previous one. Returns the offset after the last
+ * newline, or pos if there is none. Lines are short enough that calling
+ * memchr for each one costs more than comparing 16 bytes at a time.
+ */
+static size_t split_lines(LineBlock *b, size_t pos){
+    const char *buf = b->buf, *p;
+    size_t i = pos, len = b->len;
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n');
+    unsigned mask;
+
+    for (; i + 16 <= len; i += 16) {
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (buf + i)), nl));
+        while (mask) {
+            push_line(b, pos);
+            pos = i + __builtin_ctz(mask) + 1;
+            mask &= mask - 1;
         }
-        else {
-          textlen = lseek(fd, 0, SEEK_END);
-          text = (char *) mmap(NULL, textlen, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-          lang = identify(lid, text, textlen);
-
-          /* no need to munmap if textlen is 0 */
-          if (textlen && (munmap(text, textlen) == -1)) {
-            fprintf(stderr, "failed to munmap %s of length %zd \n", path, textlen);
+    }
+#endif
+    while (i < len && (p = memchr(buf + i, '\n', len - i)) != NULL) {
+        push_line(b, pos);
+        pos = i = p - buf + 1;
+    }
+    return pos;
+}
+
+/* Read from fd into buf, up to n bytes, retrying if interrupted. Read
+ * errors are reported and taken as the end of the input.
+ */
+static size_t read_some(int fd, char *buf, size_t n){
+    ssize_t got;
+
+    while ((got = read(fd, buf, n)) == -1 && errno == EINTR);
+    if (got == -1) {
+        fprintf(stderr, "read error: %s\n", strerror(errno));
+        return 0;
+    }
+    return got;
+}
+
+/* Map fd into src if it is a non-empty regular file. Returns non-zero if
+ * it was mapped.
+ */
+static int map_source(LineSource *src, int fd){
+    struct stat st;
+    void *p;
+
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) return 0;
+
+    /* a file opened by the shell may have been read from already */
+    src->pos = lseek(fd, 0, SEEK_CUR);
+    if ((off_t) src->pos == -1 || (off_t) src->pos >= st.st_size) {
+        src->pos = 0;
+        return 0;
+    }
+    if ((p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        src->pos = 0;
+        return 0; /* read it instead */
+    }
+    posix_madvise(p, st.st_size, POSIX_MADV_SEQUENTIAL);
+    src->map = (const char *) p;
+    src->map_len = st.st_size;
+    return 1;
+}
+
+/* Set up src to read lines from fd. If map is set and fd is a non-empty
+ * regular file, the file is mapped read-only, so the lines of its blocks
+ * must not be written to. Input that starts like gzip or zstd data is
+ * decompressed instead.
+ */
+static void open_source(LineSource *src, int fd, int map){
+    int format;
+    size_t n;
+
+    memset(src, 0, sizeof(LineSource));
+    src->fd = fd;
+    if (map && map_source(src, fd)) {
+        if (zinput_format(src->map + src->pos, src->map_len - src->pos) == ZINPUT_NONE) return;
+        /* mapping did not move the file offset, so it is read from there */
+        munmap((void *) src->map, src->map_len);
+        src->map = NULL;
+        src->pos = 0;
+    }
+
+    while (src->head_len < ZINPUT_MAGIC
+           && (n = read_some(fd, src->head + src->head_len, ZINPUT_MAGIC - src->head_len)) > 0)
+        src->head_len += n;
+    if ((format = zinput_format(src->head, src->head_len)) != ZINPUT_NONE) {
+        src->z = alloc_zinput(fd, format, src->head, src->head_len);
+        src->head_len = 0;
+    }
+}
+
+/* Read up to n bytes of the input from src, as read_some: the bytes
+ * open_source looked at first, then whatever follows them, decompressed
+ * if the input is compressed.
+ */
+static size_t read_source(LineSource *src, char *buf, size_t n){
+    size_t k;
+
+    if (src->head_pos < src->head_len) {
+        k = src->head_len - src->head_pos < n ? src->head_len - src->head_pos : n;
+        memcpy(buf, src->head + src->head_pos, k);
+        src->head_pos += k;
+        return k;
+    }
+    if (src->z != NULL) return zinput_read(src->z, buf, n);
+    return read_some(src->fd, buf, n);
+}
+
+static void close_source(LineSource *src){
+    if (src->map != NULL) munmap((void *) src->map, src->map_len);
+    if (src->z != NULL) free_zinput(src->z);
+}
+
+/* Point b at the lines of the next BLOCK_SIZE bytes or so of a mapped
+ * input, extended to the end of the line they stop in. As read_block does,
+ * it starts with the lines of prev that were dropped (see truncate_block).
+ */
+static size_t map_block(LineSource *src, LineBlock *b, const LineBlock *prev){
+    size_t first = src->pos - (prev ? prev->len - prev->tail : 0), end;
+    const char *p;
+
+    end = src->map_len - first > BLOCK_SIZE ? first + BLOCK_SIZE : src->map_len;
+    if (end < src->map_len && (p = memchr(src->map + end - 1, '\n', src->map_len - end + 1)) != NULL)
+        end = p - src->map + 1;
+    else end = src->map_len;
+
+    b->buf = (char *) src->map + first;
+    b->len = end - first;
+    b->nlines = 0;
+    reserve_lines(b, 1);
+
+    b->tail = split_lines(b, 0);
+    if (b->tail < b->len) { /* the last line has no newline */
+        push_line(b, b->tail);
+        b->tail = b->len;
+    }
+    b->start[b->nlines] = b->tail;
+    src->pos = end;
+
+    return b->nlines;
+}
+
+/* Fill b with the complete lines available from src, starting with the
+ * unprocessed bytes left over at the end of prev (if any). At EOF a final
+ * line without a trailing newline is included, as getline would return it;
+ * unless src is mapped, one spare byte is kept after the data so that it
+ * can be NUL-terminated. Returns the number of lines read, 0 at EOF.
+ *
+ * New input only tops the carried bytes up to BLOCK_SIZE, so that lines
+ * dropped by truncate_block, block after block, do not pile up.
+ */
+static size_t fill_block(LineSource *src, LineBlock *b, const LineBlock *prev){
+    size_t carry = prev ? prev->len - prev->tail : 0, pos = 0, n;
+    size_t limit = carry < BLOCK_SIZE ? BLOCK_SIZE : carry;
+    int eof = 0;
+
+    if (src->map != NULL) return map_block(src, b, prev);
+
+    if (b->size < limit) {
+        b->size = limit;
+        if ((b->mem = (char *) realloc(b->mem, b->size + 1)) == 0) exit(-1);
+    }
+    b->buf = b->mem;
+    if (carry) memcpy(b->buf, prev->buf + prev->tail, carry);
+    b->len = carry;
+    b->nlines = 0;
+    reserve_lines(b, 1);
+
+    for (;;) {
+        /* split whatever is buffered into lines */
+        pos = split_lines(b, pos);
+        if (eof || (b->nlines && b->len >= limit)) break;
+
+        /* grow the block if a single line fills it */
+        if (b->len == limit) {
+            limit *= 2;
+            if (b->size < limit) {
+                b->size = limit;
+                if ((b->mem = (char *) realloc(b->mem, b->size + 1)) == 0) exit(-1);
+                b->buf = b->mem;
+            }
+        }
+        n = read_source(src, b->buf + b->len, limit - b->len);
+        if (n == 0) eof = 1;
+        b->len += n;
+    }
+
+    if (eof && pos < b->len) {
+        push_line(b, pos);
+        pos = b->len;
+    }
+    b->start[b->nlines] = pos;
+    b->tail = pos;
+
+    return b->nlines;
+}
+
+static void free_block(LineBlock *b){
+    free(b->mem);
+    free(b->start);
+    free(b->lang);
+    free(b->scores);
+}
+
+static void out_flush(OutBuf *out){
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < out->len) {
+        if ((n = write(out->fd, out->buf + done, out->len - done)) == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "write error: %s\n", strerror(errno));
             exit(-1);
-          }
+        }
+        done += n;
+    }
+    out->len = 0;
+}
+
+/* Make room for at least n more bytes */
+static inline char *out_reserve(OutBuf *out, size_t n){
+    if (OUT_SIZE - out->len < n) out_flush(out);
+    return out->buf + out->len;
+}
+
+/* Write s, in pieces should it be longer than the buffer */
+static void out_str(OutBuf *out, const char *s){
+    size_t n = strlen(s), k;
+
+    while (n) {
+        k = n < OUT_SIZE ? n : OUT_SIZE;
+        memcpy(out_reserve(out, k), s, k);
+        out->len += k;
+        s += k;
+        n -= k;
+    }
+}
+
+/* Write ",N\n", as printf(",%zu\n") would */
+static void out_len(OutBuf *out, size_t n){
+    char digits[24], *p = digits + sizeof(digits), *q;
+
+    *--p = '\n';
+    do *--p = '0' + n % 10; while (n /= 10);
+    *--p = ',';
+    q = out_reserve(out, digits + sizeof(digits) - p);
+    memcpy(q, p, digits + sizeof(digits) - p);
+    out->len += digits + sizeof(digits) - p;
+}
+
+/* As print_ranking. Class names come from the model and may be of any
+ * length, so only the probability is formatted in place, into room that
+ * always fits ":%.6g". */
+static void out_ranking(OutBuf *out, const LangScore *scores, unsigned n){
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        if (i) out_str(out, " ");
+        out_str(out, scores[i].lang);
+        out_reserve(out, 32);
+        out->len += snprintf(out->buf + out->len, 32, ":%.6g", scores[i].prob);
+    }
+}
+
+/* Classify the i-th group of BATCH_SIZE lines of a block */
+static void identify_lines(void *arg, const LanguageIdentifier *lid, Workspace *ws, size_t i){
+    LineBlock *b = (LineBlock *) arg;
+    const char *texts[BATCH_SIZE];
+    int lens[BATCH_SIZE];
+    size_t first = i * BATCH_SIZE, n = b->nlines - first < BATCH_SIZE ? b->nlines - first : BATCH_SIZE, j;
+
+    for (j = 0; j < n; j++) {
+        texts[j] = b->buf + b->start[first+j];
+        lens[j] = b->start[first+j+1] - b->start[first+j];
+    }
+    if (b->nbest) { /* rankings need each document's own logprob vector */
+        for (j = 0; j < n; j++) rank_r(lid, ws, texts[j], lens[j], b->scores + (first+j) * b->nbest, b->nbest);
+        return;
+    }
+    identify_batch_r(lid, ws, texts, lens, n, b->lang + first);
+}
+
+#define NUM_BATCHES(n) (((n) + BATCH_SIZE - 1) / BATCH_SIZE)
+
+/* Classify the lines of b on the pool, or right away without one */
+static void submit_lines(ThreadPool *pool, LanguageIdentifier *lid, LineBlock *b){
+    size_t i;
+
+    if (pool != NULL) pool_submit(pool, identify_lines, b, NUM_BATCHES(b->nlines));
+    else for (i = 0; i < NUM_BATCHES(b->nlines); i++) identify_lines(b, lid, lid->ws, i);
+}
+
+/* Line mode, on a pool of worker threads if nthreads > 1. stdin is mapped
+ * if it is a regular file, so that lines are classified where they lie.
+ * With a pool, the next block is read while the workers classify the
+ * current one in batches, and results are written in input order once a
+ * block is complete.
+ */
+void line_mode(LanguageIdentifier *lid, unsigned nthreads, unsigned nbest){
+    LineBlock blocks[2], *cur = &blocks[0], *next = &blocks[1], *tmp;
+    LineSource src;
+    OutBuf out = {STDOUT_FILENO, NULL, 0};
+    ThreadPool *pool = NULL;
+    size_t i;
+
+    memset(blocks, 0, sizeof(blocks));
+    blocks[0].nbest = blocks[1].nbest = nbest;
+    if ((out.buf = (char *) malloc(OUT_SIZE)) == 0) exit(-1);
+    open_source(&src, STDIN_FILENO, 1);
+    if (nthreads > 1) pool = numa_replicas ? alloc_numa_pool(lid, nthreads) : alloc_pool(lid, nthreads);
+
+    if (fill_block(&src, cur, NULL)) {
+        submit_lines(pool, lid, cur);
+        for (;;) {
+            fill_block(&src, next, cur);
+            if (pool != NULL) pool_wait(pool);
+            if (next->nlines) submit_lines(pool, lid, next);
+
+            for (i = 0; i < cur->nlines; i++) {
+                if (nbest) out_ranking(&out, cur->scores + i * nbest, nbest);
+                else out_str(&out, cur->lang[i]);
+                out_len(&out, cur->start[i+1] - cur->start[i]);
+            }
 
-          close(fd);
+            if (!next->nlines) break;
+            tmp = cur; cur = next; next = tmp;
         }
+    }
+    out_flush(&out);
+
+    if (pool != NULL) free_pool(pool);
+    close_source(&src);
+    free_block(&blocks[0]);
+    free_block(&blocks[1]);
+    free(out.buf);
+}
+
+/* Classify a document, reading only part of it if early is set */
+static const char *identify_text(const LanguageIdentifier *lid, Workspace *ws, const char *text, size_t textlen,
+                                 LangScore *scores, unsigned nbest, const EarlyExit *early, size_t *consumed){
+    *consumed = textlen;
+    if (early && nbest) {
+        rank_early_r(lid, ws, text, textlen, early, consumed, scores, nbest);
+        return scores[0].lang;
+    }
+    if (early) return identify_early_r(lid, ws, text, textlen, early, consumed);
+    if (nbest) {
+        rank_r(lid, ws, text, textlen, scores, nbest);
+        return scores[0].lang;
+    }
+    return identify_r(lid, ws, text, textlen);
+}
+
+/* Classify the file at path, setting textlen to its size and consumed to
+ * the number of bytes read. Only regular files are mapped; anything else
+ * is reported as NOTAFILE. A gzip or zstd file is decompressed, and its
+ * size is that of the decompressed text; one this build cannot decompress
+ * is reported as UNSUPPORTED, of size 0. If nbest is set, the top nbest
+ * languages of a file that was read are stored in scores.
+ */
+const char *identify_path(const LanguageIdentifier *lid, Workspace *ws, const char *path, ssize_t *textlen,
+                          LangScore *scores, unsigned nbest, const EarlyExit *early, size_t *consumed){
+    const char *lang;
+    struct stat st;
+    char *text, *plain = NULL;
+    size_t plain_len;
+    int fd, format;
+
+    *textlen = 0;
+    *consumed = 0;
+    if ((fd = open(path, O_RDONLY)) == -1) return no_file;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return not_file;
+    }
+
+    *textlen = st.st_size;
+    if (*textlen == 0) { /* mmap cannot map an empty file */
+        close(fd);
+        return identify_text(lid, ws, "", 0, scores, nbest, early, consumed);
+    }
+
+    /* the text is only ever read, so share the page cache copy and fault
+     * it all in up front rather than a page at a time, unless only part
+     * of it may be read */
+#ifdef MAP_POPULATE
+    text = (char *) mmap(NULL, *textlen, PROT_READ, early ? MAP_SHARED : MAP_SHARED | MAP_POPULATE, fd, 0);
+#else
+    text = (char *) mmap(NULL, *textlen, PROT_READ, MAP_SHARED, fd, 0);
+#endif
+    close(fd);
+    if (text == MAP_FAILED) {
+        fprintf(stderr, "failed to mmap %s of length %zd \n", path, *textlen);
+        exit(-1);
+    }
+
+    /* on the calling worker, so that files decompress in parallel */
+    if ((format = zinput_format(text, *textlen)) != ZINPUT_NONE) {
+        if (!zinput_supported(format)) {
+            munmap(text, *textlen);
+            *textlen = 0;
+            return no_codec;
+        }
+        plain = zinput_decompress(format, text, *textlen, &plain_len);
+    }
+
+    if (plain != NULL) lang = identify_text(lid, ws, plain, plain_len, scores, nbest, early, consumed);
+    else lang = identify_text(lid, ws, text, *textlen, scores, nbest, early, consumed);
+
+    if (munmap(text, *textlen) == -1) {
+        fprintf(stderr, "failed to munmap %s of length %zd \n", path, *textlen);
+        exit(-1);
+    }
+
+    if (plain != NULL) {
+        *textlen = plain_len;
+        free(plain);
+    }
+    return lang;
+}
+
+/* Hint to the kernel that path will be read soon, so that its I/O overlaps
+ * with the classification of the files before it.
+ */
+static void prefetch_path(const char *path){
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+}
+
+/* Write the result for one path in batch mode */
+static void print_path_result(const char *path, ssize_t textlen, const char *lang, const LangScore *scores, unsigned nbest,
+                              const EarlyExit *early, size_t consumed){
+    printf("%s,%zd,", path, textlen);
+    if (early) printf("%zu,", consumed);
+    if (nbest && lang != no_file && lang != not_file && lang != no_codec) print_ranking(scores, nbest);
+    else printf("%s", lang);
+    printf("\n");
+}
+
+typedef struct {
+    LineBlock *block;
+    ssize_t *textlen;      /* per-path sizes, when keeping input order */
+    size_t *consumed;      /* and bytes read */
+    const EarlyExit *early;
+    size_t lookahead;
+    int ordered;
+} BatchJob;
+
+static void identify_file(void *arg, const LanguageIdentifier *lid, Workspace *ws, size_t i){
+    BatchJob *job = (BatchJob *) arg;
+    LineBlock *b = job->block;
+    const char *path = b->buf + b->start[i], *lang;
+    LangScore *scores = b->nbest ? b->scores + i * b->nbest : NULL;
+    ssize_t textlen;
+    size_t consumed;
+
+    if (i + job->lookahead < b->nlines)
+        prefetch_path(b->buf + b->start[i + job->lookahead]);
+
+    lang = identify_path(lid, ws, path, &textlen, scores, b->nbest, job->early, &consumed);
+
+    if (job->ordered) {
+        b->lang[i] = lang;
+        job->textlen[i] = textlen;
+        job->consumed[i] = consumed;
+    }
+    else if (b->nbest || job->early) {
+        /* hold the stream so that lines from different workers never
+         * interleave */
+        flockfile(stdout);
+        print_path_result(path, textlen, lang, scores, b->nbest, job->early, consumed);
+        funlockfile(stdout);
+    }
+    else {
+        /* a single stdio call is atomic, so lines from different workers
+         * never interleave */
         printf("%s,%zd,%s\n", path, textlen, lang);
-      }
+    }
+}
 
+/* Turn the lines of b into NUL-terminated paths, and hint the first few of
+ * them to the kernel; identify_file hints the rest as it goes.
+ */
+static void prepare_paths(BatchJob *job){
+    LineBlock *b = job->block;
+    size_t i, end;
+
+    for (i = 0; i < b->nlines; i++) {
+        end = b->start[i+1];
+        if (end > b->start[i] && b->buf[end-1] == '\n') end--;
+        b->buf[end] = '\0';
     }
-    else { /*file mode*/
+    for (i = 0; i < job->lookahead && i < b->nlines; i++)
+        prefetch_path(b->buf + b->start[i]);
 
-      /* read all of stdin and process as a single file */
-      textlen = getdelim(&text, &text_size, EOF, stdin);
-      lang = identify(lid, text, textlen);
-      printf("%s,%zd\n", lang, textlen);
-      free(text);
+    if (job->ordered) {
+        if ((job->textlen = (ssize_t *) realloc(job->textlen, (b->nlines + 1) * sizeof(ssize_t))) == 0) exit(-1);
+        if ((job->consumed = (size_t *) realloc(job->consumed, (b->nlines + 1) * sizeof(size_t))) == 0) exit(-1);
+    }
+}
+
+/* Batch mode with a pool of worker threads pulling paths from a shared
+ * queue. Output lines are written as files complete, or in input order
+ * if ordered is set.
+ */
+void batch_mode_parallel(LanguageIdentifier *lid, unsigned nthreads, int ordered, unsigned nbest, const EarlyExit *early){
+    LineBlock blocks[2];
+    BatchJob jobs[2], *cur = &jobs[0], *next = &jobs[1], *tmp;
+    LineSource src;
+    ThreadPool *pool;
+    size_t i;
 
+    memset(blocks, 0, sizeof(blocks));
+    memset(jobs, 0, sizeof(jobs));
+    for (i = 0; i < 2; i++) {
+        jobs[i].block = &blocks[i];
+        blocks[i].nbest = nbest;
+        jobs[i].lookahead = nthreads;
+        jobs[i].ordered = ordered;
+        jobs[i].early = early;
     }
+    /* not mapped, as prepare_paths writes to the lines */
+    open_source(&src, STDIN_FILENO, 0);
+    pool = numa_replicas ? alloc_numa_pool(lid, nthreads) : alloc_pool(lid, nthreads);
 
-    destroy_identifier(lid);
-    return 0;
+    if (fill_block(&src, cur->block, NULL)) {
+        prepare_paths(cur);
+        pool_submit(pool, identify_file, cur, cur->block->nlines);
+        for (;;) {
+            if (fill_block(&src, next->block, cur->block)) prepare_paths(next);
+            pool_wait(pool);
+            if (next->block->nlines) pool_submit(pool, identify_file, next, next->block->nlines);
+
+            if (ordered) {
+                for (i = 0; i < cur->block->nlines; i++)
+                    print_path_result(cur->block->buf + cur->block->start[i], cur->textlen[i], cur->block->lang[i],
+                                      nbest ? cur->block->scores + i * nbest : NULL, nbest, early, cur->consumed[i]);
+            }
+
+            if (!next->block->nlines) break;
+            tmp = cur; cur = next; next = tmp;
+        }
+    }
+
+    free_pool(pool);
+    for (i = 0; i < 2; i++) {
+        free_block(&blocks[i]);
+        free(jobs[i].textlen);
+        free(jobs[i].consumed);
+    }
 }
 
-void rstrip_ln(char *str)
-{
-    char *p;
-    p = strchr(str, '\n');
-    if (p != NULL) {
-        *p = '\0';
+/* Drop trailing lines of b beyond n; they are carried into the next block */
+static void truncate_block(LineBlock *b, size_t n){
+    if (n < b->nlines) {
+        b->nlines = n;
+        b->tail = b->start[n];
     }
 }
+
+typedef struct {
+    LineBlock *src, *tgt;
+    const char *src_lang, *tgt_lang;
+    double src_threshold, tgt_threshold;
+    char *keep;
+    size_t maxkeep;
+} FilterJob;
+
+/* Returns non-zero if line i of b is in lang with at least the given
+ * probability. The probability is only computed when a threshold is set.
+ */
+static int line_matches(const LanguageIdentifier *lid, Workspace *ws, LineBlock *b, size_t i,
+                        const char *lang, double threshold){
+    const char *text = b->buf + b->start[i];
+    int textlen = b->start[i+1] - b->start[i];
+    double prob;
+
+    if (threshold <= 0.0) return strcmp(identify_r(lid, ws, text, textlen), lang) == 0;
+    return strcmp(identify_prob_r(lid, ws, text, textlen, &prob), lang) == 0 && prob >= threshold;
+}
+
+static void filter_pair(void *arg, const LanguageIdentifier *lid, Workspace *ws, size_t i){
+    FilterJob *job = (FilterJob *) arg;
+
+    /* the target side is only classified if the source side passes */
+    job->keep[i] = line_matches(lid, ws, job->src, i, job->src_lang, job->src_threshold)
+                && line_matches(lid, ws, job->tgt, i, job->tgt_lang, job->tgt_threshold);
+}
+
+/* Read the two sides of the next block in lockstep, keeping only as many
+ * lines as both sides have. Returns the number of line pairs.
+ */
+static size_t fill_pairs(LineSource *in_src, LineSource *in_tgt, FilterJob *job, const FilterJob *prev){
+    size_t n_src, n_tgt, n;
+
+    n_src = fill_block(in_src, job->src, prev ? prev->src : NULL);
+    n_tgt = fill_block(in_tgt, job->tgt, prev ? prev->tgt : NULL);
+    n = n_src < n_tgt ? n_src : n_tgt;
+    if (n == 0 && n_src != n_tgt)
+        fprintf(stderr, "warning: source and target have different numbers of lines\n");
+
+    truncate_block(job->src, n);
+    truncate_block(job->tgt, n);
+    if (n > job->maxkeep) {
+        job->maxkeep = n;
+        if ((job->keep = (char *) realloc(job->keep, n)) == 0) exit(-1);
+    }
+
+    return n;
+}
+
+static void write_pairs(const FilterJob *job, size_t n, FILE *fp_src, FILE *fp_tgt, size_t *kept){
+    const LineBlock *src = job->src, *tgt = job->tgt;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (!job->keep[i]) continue;
+        fwrite(src->buf + src->start[i], 1, src->start[i+1] - src->start[i], fp_src);
+        fwrite(tgt->buf + tgt->start[i], 1, tgt->start[i+1] - tgt->start[i], fp_tgt);
+        (*kept)++;
+    }
+}
+
+/* Filter the parallel corpus PREFIX.SRC / PREFIX.TGT down to the line pairs
+ * where each side is identified as its own language, writing them to
+ * DEST_PREFIX.SRC / DEST_PREFIX.TGT. Both sides are mapped if they can be
+ * and read once, in blocks that are classified on a pool of workers while
+ * the next block is read and the previous one is written out.
+ */
+int filter_mode(LanguageIdentifier *lid, unsigned nthreads, const char *prefix, const char *src, const char *tgt,
+                const char *dest_prefix, double src_threshold, double tgt_threshold){
+    char src_file[4096], tgt_file[4096], src_dest[4096], tgt_dest[4096];
+    int fd_src_file, fd_tgt_file;
+    FILE *fp_src_dest, *fp_tgt_dest;
+    LineSource in_src, in_tgt;
+    LineBlock blocks[4];
+    FilterJob jobs[2], *cur = &jobs[0], *next = &jobs[1], *tmp;
+    ThreadPool *pool;
+    size_t i, n_cur, n_next, total = 0, kept = 0;
+    int status = 0;
+
+    snprintf(src_file, sizeof(src_file), "%s.%s", prefix, src);
+    snprintf(tgt_file, sizeof(tgt_file), "%s.%s", prefix, tgt);
+    snprintf(src_dest, sizeof(src_dest), "%s.%s", dest_prefix, src);
+    snprintf(tgt_dest, sizeof(tgt_dest), "%s.%s", dest_prefix, tgt);
+
+    fd_src_file = open(src_file, O_RDONLY);
+    fd_tgt_file = open(tgt_file, O_RDONLY);
+    fp_src_dest = fopen(src_dest, "w");
+    fp_tgt_dest = fopen(tgt_dest, "w");
+
+    if (fd_src_file == -1 || fd_tgt_file == -1 ||
+        fp_src_dest == NULL || fp_tgt_dest == NULL) {
+      fprintf(stderr, "file open error.");
+      status = -1;
+      goto cleanup;
+    }
+
+    memset(blocks, 0, sizeof(blocks));
+    memset(jobs, 0, sizeof(jobs));
+    for (i = 0; i < 2; i++) {
+        jobs[i].src = &blocks[2*i];
+        jobs[i].tgt = &blocks[2*i+1];
+        jobs[i].src_lang = src;
+        jobs[i].tgt_lang = tgt;
+        jobs[i].src_threshold = src_threshold;
+        jobs[i].tgt_threshold = tgt_threshold;
+    }
+    pool = numa_replicas ? alloc_numa_pool(lid, nthreads) : alloc_pool(lid, nthreads);
+
+    open_source(&in_src, fd_src_file, 1);
+    open_source(&in_tgt, fd_tgt_file, 1);
+    if ((n_cur = fill_pairs(&in_src, &in_tgt, cur, NULL))) {
+        pool_submit(pool, filter_pair, cur, n_cur);
+        for (;;) {
+            n_next = fill_pairs(&in_src, &in_tgt, next, cur);
+            pool_wait(pool);
+            if (n_next) pool_submit(pool, filter_pair, next, n_next);
+
+            write_pairs(cur, n_cur, fp_src_dest, fp_tgt_dest, &kept);
+            total += n_cur;
+
+            if (!n_next) break;
+            tmp = cur; cur = next; next = tmp;
+            n_cur = n_next;
+        }
+    }
+
+    free_pool(pool);
+    close_source(&in_src);
+    close_source(&in_tgt);
+    for (i = 0; i < 4; i++) free_block(&blocks[i]);
+    for (i = 0; i < 2; i++) free(jobs[i].keep);
+    printf("kept %zu of %zu line pairs.\n", kept, total);
+
+  cleanup:
+    if (fd_src_file != -1) close(fd_src_file);
+    if (fd_tgt_file != -1) close(fd_tgt_file);
+    if (fp_src_dest != NULL) fclose(fp_src_dest);
+    if (fp_tgt_dest != NULL) fclose(fp_tgt_dest);
+
+    return status;
+}
@@ -7,36 +7,40 @@ Marco Lui, July 2014
 import argparse
 import langid.langid as langid
 import array
+import os
+import struct
 import sys
 from itertools import islice
 
-model_template = """\
-#include "model.h"
+# rows of nb_ptc are padded to a multiple of this many elements, to match
+# NB_ALIGN in kernels.h
+NB_ALIGN = 8
 
-unsigned tk_nextmove[NUM_STATES][256] = {tk_nextmove};
-unsigned tk_output_c[NUM_STATES] = {tk_output_c};
-unsigned tk_output_s[NUM_STATES] = {tk_output_s};
-unsigned tk_output[] = {tk_output};
-double nb_pc[NUM_LANGS] = {nb_pc};
-double nb_ptc[{nb_ptc_size}] = {nb_ptc};
-char *nb_classes[NUM_LANGS] = {nb_classes};
-"""
+# the native model format, see nativemodel.h
+NATIVE_MAGIC = 'LANGIDNM'
+NATIVE_VERSION = 1
+NATIVE_BYTEORDER = 0x01020304
+NATIVE_ALIGN = 64
+NATIVE_HEADER = '<8sIIIIIIIId'
+NATIVE_SECTION = '<QQ'
+NATIVE_NUM_SECTIONS = 8
+# values of nb_ptc_type, and the array typecode for each
+NB_PTC_TYPES = {None: (0, 'd'), 'float32': (1, 'f'), 'int16': (2, 'h')}
 
 header_template = """\
 #ifndef _MODEL_H
 #define _MODEL_H
 
+#include <stdint.h>
+
 #define NUM_FEATS {num_feats}
 #define NUM_LANGS {num_langs}
 #define NUM_STATES {num_states}
+#define NUM_BYTECLS {num_bytecls}
+#define NB_STRIDE {nb_stride}
 
-extern unsigned tk_nextmove[NUM_STATES][256];
-extern unsigned tk_output_c[NUM_STATES];
-extern unsigned tk_output_s[NUM_STATES];
-extern unsigned tk_output[];
-extern double nb_pc[NUM_LANGS];
-extern double nb_ptc[{nb_ptc_size}];
-extern char *nb_classes[NUM_LANGS];
+/* the in-built model in the native format, from model.S */
+extern const unsigned char langid_model[], langid_model_end[];
 
 #endif
 """
@@ -63,8 +67,347 @@ def pack_tk_output(ident):
     tk_output.extend(feats)
   return tk_output_c, tk_output_s, tk_output
 
-def as_c_array_init(seq):
-  return "{" + ",".join(map(str, seq)) + "}"
+def compact_tk_nextmove(tk_nextmove):
+  """
+  Most bytes drive the tokenizer identically from every state, so the 256
+  columns of the transition table collapse to a much smaller number of byte
+  classes. Returns the 256-entry byte->class map, the number of classes and
+  the transition table indexed by [state][class].
+  """
+  num_states = len(tk_nextmove) >> 8
+  if num_states > 65536:
+    raise ValueError("tokenizer has {} states, at most 65536 are supported".format(num_states))
+
+  classes = {}
+  tk_bytecls = []
+  for b in range(256):
+    column = tuple(tk_nextmove[b::256])
+    tk_bytecls.append(classes.setdefault(column, len(classes)))
+  num_bytecls = len(classes)
+
+  # one representative byte per class, in class order
+  reps = [tk_bytecls.index(c) for c in range(num_bytecls)]
+  compact = []
+  for s in range(num_states):
+    row = tk_nextmove[s*256:(s+1)*256]
+    compact.extend(row[b] for b in reps)
+  return tk_bytecls, num_bytecls, compact
+
+def quantize_nb_ptc(nb_ptc, mode):
+  """
+  Reduce the precision of the naive Bayes weights. float32 is a plain cast;
+  int16 uses a single per-model scale chosen so that the largest magnitude
+  weight maps to 32767. Returns the quantized weights, the scale (None for
+  float32) and the weights as seen by langid.c after dequantization.
+  """
+  import numpy as np
+  if mode == 'float32':
+    q = nb_ptc.astype(np.float32)
+    return q, None, q.astype(np.float64)
+  scale = float(np.abs(nb_ptc).max()) / 32767
+  q = np.rint(nb_ptc / scale).astype(np.int16)
+  return q, scale, q.astype(np.float64) * scale
+
+def check_quantized(ident, nb_ptc_deq, path):
+  """
+  Classify each line of path with the original double-precision weights and
+  with the dequantized weights, and report how often the predictions agree
+  and the largest deviation of any class log-probability.
+  """
+  import numpy as np
+  total = agree = 0
+  max_err = 0.0
+  with open(path) as f:
+    for line in f:
+      fv = ident.instance2fv(line)
+      pd = ident.nb_classprobs(fv)
+      pq = np.dot(fv, nb_ptc_deq) + ident.nb_pc
+      total += 1
+      agree += int(pd.argmax() == pq.argmax())
+      max_err = max(max_err, float(np.abs(pd - pq).max()))
+  print >>sys.stderr, "CHECK lines: {} agreement: {:.6f} max logprob error: {:g}".format(total, float(agree) / max(total, 1), max_err)
+
+def feature_scores(ident):
+  """
+  The information gain of each feature: its term of the mutual information
+  between the language and a token drawn from the model,
+  sum_c P(c) P(t|c) log(P(t|c) / P(t)), in nats. Features that are rare, or
+  equally likely in every language, score close to 0. nb_pc holds the log
+  of each language's training document count, so is normalized here.
+  """
+  import numpy as np
+  prior = np.exp(ident.nb_pc - ident.nb_pc.max())
+  prior /= prior.sum()
+  ptc = np.exp(ident.nb_ptc)
+  pt = np.dot(ptc, prior)
+  return np.dot(ptc * (ident.nb_ptc - np.log(pt)[:, None]), prior)
+
+def select_features(scores, num_feats, min_score):
+  """
+  Indices of the features kept, in their original order: the num_feats
+  highest scoring, and of those the ones scoring at least min_score.
+  """
+  order = sorted(range(len(scores)), key=lambda f: -scores[f])
+  if num_feats is not None:
+    order = order[:num_feats]
+  if min_score is not None:
+    order = [f for f in order if scores[f] >= min_score]
+  return sorted(order)
+
+def feature_strings(ident):
+  """
+  Recover the byte string of each feature from the tokenizer. Its states are
+  the nodes of an Aho-Corasick trie, so the shortest input reaching a state
+  spells its node, and a feature is spelled by the shortest of the states it
+  is output on. Strings are tuples of byte values.
+  """
+  num_states = len(ident.tk_nextmove) >> 8
+  spelling = [None] * num_states
+  spelling[0] = ()
+  queue = [0]
+  for s in queue:
+    for b in range(256):
+      t = ident.tk_nextmove[(s << 8) + b]
+      if spelling[t] is None:
+        spelling[t] = spelling[s] + (b,)
+        queue.append(t)
+
+  feats = [None] * ident.nb_ptc.shape[0]
+  for s in ident.tk_output:
+    for f in ident.tk_output[s]:
+      if feats[f] is None or len(spelling[s]) < len(feats[f]):
+        feats[f] = spelling[s]
+  return feats
+
+def build_tokenizer(feats):
+  """
+  Build the automaton that outputs feature i on entering a state that ends
+  an occurrence of feats[i], as langid.py's tokenizer does: an Aho-Corasick
+  trie of the features, with the failure links folded into a 256-column
+  transition table. Returns the table and the features output by each state.
+  """
+  goto = [{}]
+  output = [[]]
+  for i, feat in enumerate(feats):
+    s = 0
+    for b in feat:
+      if b not in goto[s]:
+        goto[s][b] = len(goto)
+        goto.append({})
+        output.append([])
+      s = goto[s][b]
+    output[s].append(i)
+
+  # breadth first, so that the row and outputs of a state's failure state,
+  # which is shallower, are complete before they are copied
+  nextmove = [0] * (len(goto) << 8)
+  fail = [0] * len(goto)
+  queue = []
+  for b in range(256):
+    t = nextmove[b] = goto[0].get(b, 0)
+    if t: queue.append(t)
+  for s in queue:
+    output[s].extend(output[fail[s]])
+    for b in range(256):
+      t = goto[s].get(b)
+      if t is None:
+        nextmove[(s << 8) + b] = nextmove[(fail[s] << 8) + b]
+      else:
+        nextmove[(s << 8) + b] = t
+        fail[t] = nextmove[(fail[s] << 8) + b]
+        queue.append(t)
+  return nextmove, output
+
+def minimize_tokenizer(nextmove, output):
+  """
+  Merge the states that no input can tell apart, by Moore's partition
+  refinement starting from the states grouped by the features they output.
+  Returns the table and outputs of the minimal automaton; its state 0 is
+  the start state.
+  """
+  num_states = len(output)
+  blocks = {}
+  part = [blocks.setdefault(tuple(sorted(o)), len(blocks)) for o in output]
+  num_blocks = len(blocks)
+  while True:
+    blocks = {}
+    part = [blocks.setdefault((part[s],) + tuple(part[t] for t in nextmove[s << 8:(s+1) << 8]), len(blocks))
+            for s in range(num_states)]
+    if len(blocks) == num_blocks: break
+    num_blocks = len(blocks)
+
+  # blocks are numbered in order of their first state, so state 0 stays 0
+  reps = [None] * num_blocks
+  for s in range(num_states):
+    if reps[part[s]] is None: reps[part[s]] = s
+  min_nextmove = []
+  for s in reps:
+    min_nextmove.extend(part[t] for t in nextmove[s << 8:(s+1) << 8])
+  return min_nextmove, [output[s] for s in reps]
+
+def prune_model(ident, keep):
+  """
+  A copy of the model with only the features keep, renumbered in order, and
+  a minimal tokenizer rebuilt for them. Their weights are unchanged, so each
+  language's score loses exactly the terms of the dropped features.
+  """
+  feats = feature_strings(ident)
+  nextmove, output = minimize_tokenizer(*build_tokenizer([feats[f] for f in keep]))
+  tk_nextmove = array.array(ident.tk_nextmove.typecode, nextmove)
+  tk_output = dict((s, tuple(o)) for s, o in enumerate(output) if o)
+  return langid.LanguageIdentifier(ident.nb_ptc[keep], ident.nb_pc, len(keep), ident.nb_classes,
+                                   tk_nextmove, tk_output)
+
+def native_size(ident):
+  """
+  The sizes of a model's tables as langid.c holds them, and of the model
+  in the native format: a dict of byte counts, with its dimensions.
+  """
+  num_feats, num_langs = ident.nb_ptc.shape
+  nb_stride = (num_langs + NB_ALIGN - 1) // NB_ALIGN * NB_ALIGN
+  tk_bytecls, num_bytecls, tk_nextmove = compact_tk_nextmove(ident.tk_nextmove)
+  tk_output_c, tk_output_s, tk_output = pack_tk_output(ident)
+  native = native_model(ident, tk_bytecls, num_bytecls, tk_nextmove, nb_stride, ident.nb_ptc, None, None)
+  return native, [
+    ("features", num_feats),
+    ("states", len(tk_nextmove) // num_bytecls),
+    ("byte classes", num_bytecls),
+    ("tk_nextmove bytes", 2 * len(tk_nextmove)),
+    ("tk_output bytes", 4 * (len(tk_output_c) + len(tk_output_s) + len(tk_output))),
+    ("nb_ptc bytes", 8 * num_feats * nb_stride),
+    ("native model bytes", len(native)),
+  ]
+
+def bench_stages(bench, model, corpus):
+  """
+  Run langid_bench on a native model, and return the median time per call
+  of text_to_fv and fv_to_logprob, keyed by (stage, document length).
+  """
+  import json, subprocess
+  times = {}
+  out = subprocess.check_output([bench, "-m", model, "-c", corpus, "-t", "0.25"])
+  for line in out.splitlines():
+    r = json.loads(line)
+    if r["bench"] in ("text_to_fv", "fv_to_logprob"):
+      times[r["bench"], r["len"]] = r["p50_ns"]
+  return times
+
+def report_pruning(full, pruned, path, bench):
+  """
+  Compare a pruned model with the full one: the sizes of their tables, how
+  often each is right on the lines of path, given as LANG<TAB>TEXT (a line
+  without a tab only counts towards agreement), and, given the path of
+  langid_bench, how much faster text_to_fv and fv_to_logprob run on them.
+  """
+  full_native, full_size = native_size(full)
+  pruned_native, pruned_size = native_size(pruned)
+  print >>sys.stderr, "PRUNE {:20s} {:>10s} {:>10s}".format("", "full", "pruned")
+  for (name, a), (_, b) in zip(full_size, pruned_size):
+    print >>sys.stderr, "PRUNE {:20s} {:10d} {:10d} {:6.1%}".format(name, a, b, float(b) / max(a, 1))
+
+  texts = []
+  total = labelled = right_full = right_pruned = agree = 0
+  with open(path) as f:
+    for line in f:
+      lang, sep, text = line.partition('\t')
+      if not sep: lang, text = None, line
+      texts.append(text)
+      pred_full = full.classify(text)[0]
+      pred_pruned = pruned.classify(text)[0]
+      total += 1
+      agree += int(pred_full == pred_pruned)
+      if lang is not None:
+        labelled += 1
+        right_full += int(pred_full == lang)
+        right_pruned += int(pred_pruned == lang)
+  print >>sys.stderr, "PRUNE lines: {} agreement: {:.6f}".format(total, float(agree) / max(total, 1))
+  if labelled:
+    print >>sys.stderr, "PRUNE labelled: {} accuracy full: {:.6f} pruned: {:.6f} change: {:+.6f}".format(
+        labelled, float(right_full) / labelled, float(right_pruned) / labelled,
+        float(right_pruned - right_full) / labelled)
+
+  if bench is None: return
+  import shutil, tempfile
+  corpus = ''.join(texts)
+  if not corpus:
+    print >>sys.stderr, "PRUNE no text to benchmark on"
+    return
+  # langid_bench needs a corpus of at least 64 KB
+  corpus *= 65536 // len(corpus) + 1
+  work = tempfile.mkdtemp()
+  try:
+    for name, data in (("corpus", corpus), ("full", full_native), ("pruned", pruned_native)):
+      with open(os.path.join(work, name), 'wb') as f:
+        f.write(data)
+    before = bench_stages(bench, os.path.join(work, "full"), os.path.join(work, "corpus"))
+    after = bench_stages(bench, os.path.join(work, "pruned"), os.path.join(work, "corpus"))
+  finally:
+    shutil.rmtree(work)
+  lengths = sorted(set(l for _, l in before))
+  print >>sys.stderr, "PRUNE speedup by length " + " ".join("{:>7d}".format(l) for l in lengths)
+  for stage in ("text_to_fv", "fv_to_logprob"):
+    print >>sys.stderr, "PRUNE {:17s} ".format(stage) + " ".join(
+        "{:7.2f}".format(before[stage, l] / after[stage, l]) for l in lengths)
+
+def pad_rows(seq, row_len, stride):
+  """
+  Lay a flattened table out with rows of stride elements, zero-padded.
+  """
+  padded = []
+  for row in chunk(seq, row_len):
+    padded.extend(row)
+    padded.extend([0] * (stride - row_len))
+  return padded
+
+def native_model(ident, tk_bytecls, num_bytecls, tk_nextmove, nb_stride, nb_ptc, quantize, nb_ptc_scale):
+  """
+  Serialize a model in the native format, which langid.c maps and uses in
+  place. nb_ptc is the (possibly quantized) weight table before padding.
+  """
+  num_feats, num_langs = ident.nb_ptc.shape
+  num_states = len(tk_nextmove) // num_bytecls
+  nb_ptc_type, typecode = NB_PTC_TYPES[quantize]
+  convert = int if typecode == 'h' else float
+  tk_output_c, tk_output_s, tk_output = pack_tk_output(ident)
+
+  # class names are a table of offsets into the section followed by the strings
+  names = ['{}'.format(c) + '\0' for c in ident.nb_classes]
+  offsets = []
+  pos = 4 * num_langs
+  for name in names:
+    offsets.append(pos)
+    pos += len(name)
+
+  sections = [
+    array.array('B', tk_bytecls),
+    array.array('H', tk_nextmove),
+    array.array('I', tk_output_c),
+    array.array('I', tk_output_s),
+    array.array('I', tk_output),
+    array.array('d', map(float, ident.nb_pc)),
+    array.array(typecode, map(convert, pad_rows(nb_ptc.ravel(), num_langs, nb_stride))),
+    array.array('I', offsets),
+  ]
+  if sys.byteorder != 'little':
+    for s in sections: s.byteswap()
+  sections = [s.tostring() for s in sections]
+  sections[-1] += ''.join(names)
+
+  header_size = struct.calcsize(NATIVE_HEADER) + NATIVE_NUM_SECTIONS * struct.calcsize(NATIVE_SECTION)
+  table = []
+  body = []
+  pos = header_size
+  for data in sections:
+    pad = -pos % NATIVE_ALIGN
+    body.append('\0' * pad)
+    pos += pad
+    table.append(struct.pack(NATIVE_SECTION, pos, len(data)))
+    body.append(data)
+    pos += len(data)
+
+  header = struct.pack(NATIVE_HEADER, NATIVE_MAGIC, NATIVE_VERSION, NATIVE_BYTEORDER,
+      num_feats, num_langs, num_states, num_bytecls, nb_stride, nb_ptc_type, nb_ptc_scale or 1.0)
+  return header + ''.join(table) + ''.join(body)
 
 def chunk(seq, chunksize):
   """
@@ -80,16 +423,43 @@ def chunk(seq, chunksize):
 if __name__ == "__main__":
   parser = argparse.ArgumentParser()
   parser.add_argument("--output", "-o", default=sys.stdout, help="write exported model to", type=argparse.FileType('w'))
-  parser.add_argument("--header", action="store_true", help="produce header file")
+  parser.add_argument("--header", action="store_true", help="produce the header file for the in-built model")
   parser.add_argument("--protobuf", action="store_true", help="produce model in protocol buffer format")
+  parser.add_argument("--native", action="store_true", help="produce model in the native format, which is used without unpacking")
+  parser.add_argument("--quantize", choices=["float32", "int16"], help="store nb_ptc at reduced precision (protocol buffer and native formats only)")
+  parser.add_argument("--check", metavar="FILE", help="report agreement of quantized and double-precision predictions on the lines of FILE")
+  parser.add_argument("--prune-feats", metavar="N", type=int, help="keep only the N features with the highest information gain, with a tokenizer rebuilt for them")
+  parser.add_argument("--prune-ig", metavar="NATS", type=float, help="keep only the features with at least this information gain")
+  parser.add_argument("--report", metavar="FILE", help="compare the pruned model with the full one on the lines of FILE, each LANG<TAB>TEXT or TEXT")
+  parser.add_argument("--bench", metavar="PROGRAM", help="with --report, also time both models with this langid_bench")
   parser.add_argument("model", help="read model from")
   args = parser.parse_args()
 
-  if args.protobuf and args.header:
-    parser.error("can only specify one of --protobuf or --header")
+  if args.protobuf + args.header + args.native != 1:
+    parser.error("specify one of --protobuf, --native or --header")
+  if args.quantize and not (args.protobuf or args.native):
+    parser.error("--quantize requires --protobuf or --native")
+  if args.check and not args.quantize:
+    parser.error("--check requires --quantize")
+  prune = args.prune_feats is not None or args.prune_ig is not None
+  if args.report and not prune:
+    parser.error("--report requires --prune-feats or --prune-ig")
+  if args.bench and not args.report:
+    parser.error("--bench requires --report")
 
   ident = langid.LanguageIdentifier.from_modelpath(args.model)
 
+  if prune:
+    scores = feature_scores(ident)
+    keep = select_features(scores, args.prune_feats, args.prune_ig)
+    if not keep:
+      parser.error("no features left after pruning")
+    print >>sys.stderr, "PRUNE kept {} of {} features, information gain >= {:g}".format(
+        len(keep), len(scores), min(scores[f] for f in keep))
+    full, ident = ident, prune_model(ident, keep)
+    if args.report:
+      report_pruning(full, ident, args.report, args.bench)
+
   print "NB_PTC", type(ident.nb_ptc), ident.nb_ptc.shape, ident.nb_ptc.dtype
   print "NB_PC", type(ident.nb_pc), ident.nb_pc.shape, ident.nb_pc.dtype
   print "NB_NUMFEATS", type(ident.nb_numfeats), ident.nb_numfeats
@@ -100,7 +470,8 @@ if __name__ == "__main__":
 
   num_feats, num_langs = ident.nb_ptc.shape
   num_states = len(ident.tk_nextmove) >> 8
-  nb_ptc_size = num_feats * num_langs
+  nb_stride = (num_langs + NB_ALIGN - 1) // NB_ALIGN * NB_ALIGN
+  tk_bytecls, num_bytecls, tk_nextmove = compact_tk_nextmove(ident.tk_nextmove)
 
   if args.protobuf:
     import langid_pb2
@@ -122,27 +493,32 @@ if __name__ == "__main__":
 
     # pack the classifier parameters
     lid.nb_pc.extend(ident.nb_pc.tolist())
-    lid.nb_ptc.extend(ident.nb_ptc.ravel().tolist())
+    if args.quantize:
+      nb_ptc_q, nb_ptc_scale, nb_ptc_deq = quantize_nb_ptc(ident.nb_ptc, args.quantize)
+      if args.check:
+        check_quantized(ident, nb_ptc_deq, args.check)
+      if args.quantize == 'float32':
+        lid.nb_ptc_f32.extend(nb_ptc_q.ravel().tolist())
+      else:
+        lid.nb_ptc_q16.extend(nb_ptc_q.ravel().tolist())
+        lid.nb_ptc_scale = nb_ptc_scale
+    else:
+      lid.nb_ptc.extend(ident.nb_ptc.ravel().tolist())
 
     # pack the class labels
     lid.nb_classes.extend('{}'.format(c) for c in ident.nb_classes)
 
     args.output.write(lid.SerializeToString())
+
+  elif args.native:
+    if args.quantize:
+      nb_ptc, nb_ptc_scale, nb_ptc_deq = quantize_nb_ptc(ident.nb_ptc, args.quantize)
+      if args.check:
+        check_quantized(ident, nb_ptc_deq, args.check)
+    else:
+      nb_ptc, nb_ptc_scale = ident.nb_ptc, None
+    args.output.write(native_model(ident, tk_bytecls, num_bytecls, tk_nextmove, nb_stride,
+                                   nb_ptc, args.quantize, nb_ptc_scale))
     
-  elif args.header:
-    args.output.write(header_template.format(**locals()))
   else:
-    # chunk tk_nextmove back into length-256 array initializers, to avoid C warnings
-    # about initialization mismatches
-    tk_nextmove = as_c_array_init( as_c_array_init(c) for c in chunk(ident.tk_nextmove,256))
-
-    tk_output_c, tk_output_s, tk_output = pack_tk_output(ident)
-    tk_output_c = as_c_array_init(tk_output_c)
-    tk_output_s = as_c_array_init(tk_output_s)
-    tk_output = as_c_array_init(tk_output)
-        
-    nb_pc =  as_c_array_init(ident.nb_pc)
-    nb_ptc = as_c_array_init(ident.nb_ptc.ravel())
-    nb_classes = as_c_array_init('"{}"'.format(c) for c in ident.nb_classes)
-
-    args.output.write(model_template.format(**locals()))
+    args.output.write(header_template.format(**locals()))
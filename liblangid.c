@@ -11,83 +11,248 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <fcntl.h>
+#include <math.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include "langid.pb-c.h"
 #include "liblangid.h"
 #include "sparseset.h"
 #include "model.h"
+#include "nativemodel.h"
+#ifdef LANGID_NUMA
+#include <numa.h>
+#endif
+
+#ifdef LANGID_STATS
+#include <pthread.h>
+#include <time.h>
+
+/* counters of the workspaces freed so far */
+static IdentifyStats retired_stats;
+static pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t stats_clock(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-/* Return a pointer to a LanguageIdentifier based on the in-built default model
+static void count_doc(IdentifyStats *st, size_t bytes, unsigned states, unsigned feats){
+    st->docs++;
+    st->bytes += bytes;
+    st->states += states;
+    st->feats += feats;
+    if (states > st->max_states) st->max_states = states;
+    if (feats > st->max_feats) st->max_feats = feats;
+}
+
+/* STATS_START starts the stage timer t and STATS_LAP charges the time since
+ * to a stage, restarting t; STATS_RESTART restarts it after time that was
+ * counted elsewhere. Without LANGID_STATS all of these vanish.
  */
-LanguageIdentifier *get_default_identifier(void) {
-    LanguageIdentifier *lid;
+#define STATS_START(t) uint64_t t = stats_clock()
+#define STATS_LAP(ws, stage, t) do { uint64_t _now = stats_clock(); (ws)->stats.stage += _now - (t); (t) = _now; } while (0)
+#define STATS_RESTART(t) ((t) = stats_clock())
+#define STATS_DOC(ws, bytes) STATS_DOC_OF(ws, bytes, (ws)->sv)
+#define STATS_DOC_OF(ws, bytes, sv) count_doc(&(ws)->stats, bytes, (sv)->members, (ws)->fv->members)
+#else
+#define STATS_RESTART(t)
+#define STATS_START(t)
+#define STATS_LAP(ws, stage, t)
+#define STATS_DOC(ws, bytes)
+#define STATS_DOC_OF(ws, bytes, sv)
+#endif
 
-    if ((lid = (LanguageIdentifier *) malloc(sizeof(LanguageIdentifier))) == 0) exit(-1);
+/* lid can use the engine compiled for the in-built model if it has the same
+ * dimensions; the tables themselves may live anywhere.
+ */
+static void select_engine(LanguageIdentifier *lid){
+    lid->specialized = lid->num_bytecls == NUM_BYTECLS && lid->num_langs == NUM_LANGS
+                    && lid->nb_stride == NB_STRIDE && lid->nb_ptc_type == NB_PTC_F64;
+}
 
-    lid->sv = alloc_set(NUM_STATES);
-    lid->fv = alloc_set(NUM_FEATS);
+/* Reduce a full [num_states][256] transition table to byte classes and
+ * 16-bit states, as ldpy2ldc.py does for the in-built model. Columns are
+ * hashed so that only columns with equal hashes need to be compared.
+ * Returns 0, or -1 if there are too many states.
+ */
+static int compact_tokenizer(LanguageIdentifier *lid, const int32_t *nextmove){
+    uint64_t hash[256];
+    unsigned reps[256], b, c, s, K = 0;
+    unsigned char cls[256], *bytecls;
+    uint16_t *compact;
 
-    lid->num_feats = NUM_FEATS;
-    lid->num_langs = NUM_LANGS;
-    lid->num_states = NUM_STATES;
-    lid->tk_nextmove = &tk_nextmove;
-    lid->tk_output_c = &tk_output_c;
-    lid->tk_output_s = &tk_output_s;
-    lid->tk_output = &tk_output;
-    lid->nb_pc = &nb_pc;
-    lid->nb_ptc = &nb_ptc;
-    lid->nb_classes = &nb_classes;
+    if (lid->num_states > 65536) {
+        fprintf(stderr, "model has %u states, at most 65536 are supported\n", lid->num_states);
+        return -1;
+    }
 
-    lid->protobuf_model = NULL;
+    for (b=0; b < 256; b++){
+        hash[b] = 14695981039346656037ULL;
+        for (s=0; s < lid->num_states; s++)
+            hash[b] = (hash[b] ^ (uint32_t) nextmove[s*256+b]) * 1099511628211ULL;
+    }
 
-    return lid;
+    for (b=0; b < 256; b++){
+        for (c=0; c < K; c++){
+            if (hash[reps[c]] != hash[b]) continue;
+            for (s=0; s < lid->num_states && nextmove[s*256+b] == nextmove[s*256+reps[c]]; s++);
+            if (s == lid->num_states) break;
+        }
+        if (c == K) reps[K++] = b;
+        cls[b] = c;
+    }
+
+    /* the class map and the compact table share one allocation */
+    if ((bytecls = (unsigned char *) malloc(256 + lid->num_states * K * sizeof(uint16_t))) == 0) exit(-1);
+    memcpy(bytecls, cls, 256);
+    compact = (uint16_t *) (bytecls + 256);
+    for (s=0; s < lid->num_states; s++)
+        for (c=0; c < K; c++)
+            compact[s*K+c] = nextmove[s*256+reps[c]];
+
+    lid->num_bytecls = K;
+    lid->tk_bytecls = (unsigned char (*)[256]) bytecls;
+    lid->tk_nextmove = (uint16_t (*)[]) compact;
+    lid->tk_storage = bytecls;
+    return 0;
 }
 
-LanguageIdentifier *load_identifier(char *model_path) {
+/* Copy num_feats rows of num_langs elements of the given size into a
+ * 64-byte aligned buffer with rows of nb_stride elements, zero-padded.
+ */
+static void *pad_rows(const LanguageIdentifier *lid, const void *src, size_t size){
+    size_t i, row = lid->num_langs * size, stride = lid->nb_stride * size;
+    char *dst;
+
+    if (posix_memalign((void **) &dst, 64, lid->num_feats * stride) != 0) exit(-1);
+    memset(dst, 0, lid->num_feats * stride);
+    for (i=0; i < lid->num_feats; i++)
+        memcpy(dst + i * stride, (const char *) src + i * row, row);
+
+    return dst;
+}
+
+/* Select whichever representation of nb_ptc the model was written with,
+ * and lay it out with padded rows for the scoring kernels. The unpadded
+ * copy is released straight away; protobuf-c's default allocator is
+ * malloc, so this is safe ahead of freeing the rest of the message.
+ * Returns 0, or -1 if the weights do not match the model's dimensions.
+ */
+static int load_nb_ptc(LanguageIdentifier *lid, Langid__LanguageIdentifier *msg, const char *model_path){
+    size_t i, n = (size_t) lid->num_feats * lid->num_langs, have;
+    int16_t *q;
+
+    lid->nb_ptc = NULL;
+    lid->nb_ptc_f32 = NULL;
+    lid->nb_ptc_i16 = NULL;
+    lid->nb_ptc_scale = 1.0;
+
+    if (msg->n_nb_ptc_f32) {
+        if ((have = msg->n_nb_ptc_f32) != n) goto bad_size;
+        lid->nb_ptc_type = NB_PTC_F32;
+        lid->nb_storage = pad_rows(lid, msg->nb_ptc_f32, sizeof(float));
+        lid->nb_ptc_f32 = (float (*)[]) lid->nb_storage;
+        free(msg->nb_ptc_f32);
+        msg->nb_ptc_f32 = NULL;
+        msg->n_nb_ptc_f32 = 0;
+    }
+    else if (msg->n_nb_ptc_q16) {
+        if ((have = msg->n_nb_ptc_q16) != n) goto bad_size;
+        if (!msg->has_nb_ptc_scale) {
+            fprintf(stderr, "quantized model without a scale: %s\n", model_path);
+            return -1;
+        }
+        /* int16 weights are stored as sint32 on the wire */
+        if ((q = (int16_t *) malloc(n * sizeof(int16_t))) == 0) exit(-1);
+        for (i=0; i < n; i++) q[i] = msg->nb_ptc_q16[i];
+        lid->nb_ptc_type = NB_PTC_I16;
+        lid->nb_storage = pad_rows(lid, q, sizeof(int16_t));
+        lid->nb_ptc_i16 = (int16_t (*)[]) lid->nb_storage;
+        lid->nb_ptc_scale = msg->nb_ptc_scale;
+        free(q);
+        free(msg->nb_ptc_q16);
+        msg->nb_ptc_q16 = NULL;
+        msg->n_nb_ptc_q16 = 0;
+    }
+    else {
+        if ((have = msg->n_nb_ptc) != n) goto bad_size;
+        lid->nb_ptc_type = NB_PTC_F64;
+        lid->nb_storage = pad_rows(lid, msg->nb_ptc, sizeof(double));
+        lid->nb_ptc = (double (*)[]) lid->nb_storage;
+        free(msg->nb_ptc);
+        msg->nb_ptc = NULL;
+        msg->n_nb_ptc = 0;
+    }
+    return 0;
+
+  bad_size:
+    fprintf(stderr, "model %s has %zu weights, expected %zu\n", model_path, have, n);
+    return -1;
+}
+
+/* Build a LanguageIdentifier from a protobuf model. All tables either
+ * come from the unpacked message or are converted from it, so the
+ * caller's buffer is not needed afterwards. Returns NULL, after reporting
+ * why, if the model is malformed.
+ */
+static LanguageIdentifier *load_protobuf(const unsigned char *model_buf, size_t model_len, const char *model_path) {
 		Langid__LanguageIdentifier *msg;
-		int fd, model_len;
-		unsigned char *model_buf;
     LanguageIdentifier *lid;
 #ifdef DEBUG
 		int i;
 #endif
 
-#ifdef DEBUG
-		fprintf(stderr, "loading a model from: %s\n", model_path);
-#endif
-
-		/* Use mmap to access the model file */
-		if ((fd = open(model_path, O_RDONLY))==-1) {
-			fprintf(stderr, "unable to open: %s\n", model_path);
-			exit(-1);
-		}
-		model_len = lseek(fd, 0, SEEK_END);
-		model_buf = (unsigned char *) mmap(NULL, model_len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-
 		/*printf("read in a model of size %d\n", model_len);*/
 		msg = langid__language_identifier__unpack(NULL, model_len, model_buf);
 
 		if (msg == NULL) {
 			fprintf(stderr, "error unpacking model from: %s\n", model_path);
-			exit(-1);
+			return NULL;
 		}
+    /* the tables a message cut short may still unpack without */
+    if (msg->num_feats < 0 || msg->num_langs <= 0 || msg->num_states <= 0
+        || msg->n_tk_nextmove != (size_t) msg->num_states * 256
+        || msg->n_tk_output_c != (size_t) msg->num_states || msg->n_tk_output_s != (size_t) msg->num_states
+        || msg->n_nb_pc != (size_t) msg->num_langs || msg->n_nb_classes != (size_t) msg->num_langs) {
+        fprintf(stderr, "model %s has malformed dimensions\n", model_path);
+        langid__language_identifier__free_unpacked(msg, NULL);
+        return NULL;
+    }
 
     if ((lid = (LanguageIdentifier *) malloc(sizeof(LanguageIdentifier))) == 0) exit(-1);
 
-    lid->sv = alloc_set(msg->num_states);
-    lid->fv = alloc_set(msg->num_feats);
-
     lid->num_feats = msg->num_feats;
     lid->num_langs = msg->num_langs;
     lid->num_states = msg->num_states;
 
-    lid->tk_nextmove = (unsigned (*)[][256])msg->tk_nextmove;
+    if (compact_tokenizer(lid, msg->tk_nextmove) != 0) {
+        langid__language_identifier__free_unpacked(msg, NULL);
+        free(lid);
+        return NULL;
+    }
+    /* the full table is no longer needed. protobuf-c's default allocator
+     * is malloc, so it can be released ahead of the rest of the message */
+    free(msg->tk_nextmove);
+    msg->tk_nextmove = NULL;
+    msg->n_tk_nextmove = 0;
     lid->tk_output_c = (unsigned (*)[])msg->tk_output_c;
     lid->tk_output_s = (unsigned (*)[])msg->tk_output_s;
     lid->tk_output = (unsigned (*)[])msg->tk_output;
 
+    lid->nb_stride = (lid->num_langs + NB_ALIGN - 1) / NB_ALIGN * NB_ALIGN;
+    lid->kernels = select_kernels();
+
     lid->nb_pc = (double (*)[]) msg->nb_pc;
-    lid->nb_ptc =(double (*)[]) msg->nb_ptc;
+    if (load_nb_ptc(lid, msg, model_path) != 0) {
+        langid__language_identifier__free_unpacked(msg, NULL);
+        free(lid->tk_storage);
+        free(lid);
+        return NULL;
+    }
     lid->nb_classes = (char *(*)[]) msg->nb_classes;
 
 #ifdef DEBUG
@@ -103,94 +268,1246 @@ LanguageIdentifier *load_identifier(char *model_path) {
 #endif
 
     lid->protobuf_model = msg;
+    lid->cls_storage = NULL;
+    lid->map = NULL;
+    lid->map_len = 0;
+    lid->st_row = NULL;
+    lid->st_ptc = NULL;
+    lid->fused_storage = NULL;
+    lid->place_map = NULL;
+    lid->place_len = 0;
+    lid->cache = NULL;
+    lid->cache_storage = NULL;
+    lid->fallback = NULL;
+    lid->fallback_margin = 0.0;
+    lid->cascade = NULL;
+    lid->cascade_storage = NULL;
+    select_engine(lid);
+    lid->ws = alloc_workspace(lid);
+
+    return lid;
+}
+
+/* Return a pointer to the given section of a native model, after
+ * checking that it lies within the buffer and has the expected length.
+ * A length of zero accepts any multiple of size. Returns NULL, after
+ * reporting it, for a malformed section.
+ */
+static const void *native_section(const unsigned char *buf, size_t len, unsigned sec,
+                                  size_t expect, size_t size, const char *model_path){
+    const NativeHeader *h = (const NativeHeader *) buf;
+    uint64_t offset = h->sections[sec].offset, n = h->sections[sec].size;
+
+    if (offset % NATIVE_ALIGN || offset > len || n > len - offset
+        || (expect ? n != expect * size : n % size)) {
+        fprintf(stderr, "model %s has a malformed section %u\n", model_path, sec);
+        return NULL;
+    }
+    return buf + offset;
+}
+
+/* Build a LanguageIdentifier that points straight into a native model
+ * (see nativemodel.h). Nothing is copied except the table of class
+ * names, so buf must stay mapped for the lifetime of the identifier.
+ * Returns NULL, after reporting why, if the model is malformed.
+ */
+static LanguageIdentifier *load_native(const unsigned char *buf, size_t len, const char *model_path) {
+    const NativeHeader *h = (const NativeHeader *) buf;
+    const uint32_t *cls_offsets;
+    const char *cls;
+    LanguageIdentifier *lid;
+    size_t cls_len, esize, nb_size;
+    unsigned i;
+
+    if (h->byteorder != NATIVE_BYTEORDER || h->version != NATIVE_VERSION) {
+        fprintf(stderr, "unsupported native model version or byte order: %s\n", model_path);
+        return NULL;
+    }
+    if (h->num_bytecls == 0 || h->num_bytecls > 256 || h->num_states > 65536
+        || h->nb_stride < h->num_langs || h->nb_stride % NB_ALIGN) {
+        fprintf(stderr, "model %s has malformed dimensions\n", model_path);
+        return NULL;
+    }
+
+    if ((lid = (LanguageIdentifier *) malloc(sizeof(LanguageIdentifier))) == 0) exit(-1);
+
+    lid->num_feats = h->num_feats;
+    lid->num_langs = h->num_langs;
+    lid->num_states = h->num_states;
+    lid->num_bytecls = h->num_bytecls;
+    lid->nb_stride = h->nb_stride;
+    lid->kernels = select_kernels();
+
+    lid->nb_ptc = NULL;
+    lid->nb_ptc_f32 = NULL;
+    lid->nb_ptc_i16 = NULL;
+    lid->nb_ptc_scale = 1.0;
+    lid->cls_storage = NULL;
+
+    if ((lid->tk_bytecls = (unsigned char (*)[256])
+             native_section(buf, len, NATIVE_TK_BYTECLS, 256, 1, model_path)) == NULL
+        || (lid->tk_nextmove = (uint16_t (*)[])
+             native_section(buf, len, NATIVE_TK_NEXTMOVE, (size_t) h->num_states * h->num_bytecls, sizeof(uint16_t), model_path)) == NULL
+        || (lid->tk_output_c = (unsigned (*)[])
+             native_section(buf, len, NATIVE_TK_OUTPUT_C, h->num_states, sizeof(uint32_t), model_path)) == NULL
+        || (lid->tk_output_s = (unsigned (*)[])
+             native_section(buf, len, NATIVE_TK_OUTPUT_S, h->num_states, sizeof(uint32_t), model_path)) == NULL
+        || (lid->tk_output = (unsigned (*)[])
+             native_section(buf, len, NATIVE_TK_OUTPUT, 0, sizeof(uint32_t), model_path)) == NULL
+        || (lid->nb_pc = (double (*)[])
+             native_section(buf, len, NATIVE_NB_PC, h->num_langs, sizeof(double), model_path)) == NULL)
+        goto malformed;
+
+    nb_size = (size_t) h->num_feats * h->nb_stride;
+    switch (h->nb_ptc_type) {
+      case NB_PTC_F64:
+        esize = sizeof(double);
+        lid->nb_ptc = (double (*)[]) native_section(buf, len, NATIVE_NB_PTC, nb_size, esize, model_path);
+        break;
+      case NB_PTC_F32:
+        esize = sizeof(float);
+        lid->nb_ptc_f32 = (float (*)[]) native_section(buf, len, NATIVE_NB_PTC, nb_size, esize, model_path);
+        break;
+      case NB_PTC_I16:
+        esize = sizeof(int16_t);
+        lid->nb_ptc_i16 = (int16_t (*)[]) native_section(buf, len, NATIVE_NB_PTC, nb_size, esize, model_path);
+        lid->nb_ptc_scale = h->nb_ptc_scale;
+        break;
+      default:
+        fprintf(stderr, "model %s has unknown nb_ptc type %u\n", model_path, h->nb_ptc_type);
+        goto malformed;
+    }
+    if (!lid->nb_ptc && !lid->nb_ptc_f32 && !lid->nb_ptc_i16) goto malformed;
+    lid->nb_ptc_type = h->nb_ptc_type;
+
+    /* class names are stored as offsets into the section, which are
+     * turned into the array of pointers the rest of the code expects */
+    if ((cls = (const char *) native_section(buf, len, NATIVE_NB_CLASSES, 0, 1, model_path)) == NULL)
+        goto malformed;
+    cls_len = h->sections[NATIVE_NB_CLASSES].size;
+    if (cls_len < h->num_langs * sizeof(uint32_t)) {
+        fprintf(stderr, "model %s has a malformed section %u\n", model_path, NATIVE_NB_CLASSES);
+        goto malformed;
+    }
+    cls_offsets = (const uint32_t *) cls;
+    if ((lid->cls_storage = malloc(h->num_langs * sizeof(char *))) == 0) exit(-1);
+    lid->nb_classes = (char *(*)[]) lid->cls_storage;
+    for (i=0; i < h->num_langs; i++) {
+        if (cls_offsets[i] >= cls_len || memchr(cls + cls_offsets[i], 0, cls_len - cls_offsets[i]) == NULL) {
+            fprintf(stderr, "model %s has a malformed class name %u\n", model_path, i);
+            goto malformed;
+        }
+        (*lid->nb_classes)[i] = (char *) cls + cls_offsets[i];
+    }
+
+    lid->protobuf_model = NULL;
+    lid->tk_storage = NULL;
+    lid->nb_storage = NULL;
+    lid->map = NULL;
+    lid->map_len = 0;
+    lid->st_row = NULL;
+    lid->st_ptc = NULL;
+    lid->fused_storage = NULL;
+    lid->place_map = NULL;
+    lid->place_len = 0;
+    lid->cache = NULL;
+    lid->cache_storage = NULL;
+    lid->fallback = NULL;
+    lid->fallback_margin = 0.0;
+    lid->cascade = NULL;
+    lid->cascade_storage = NULL;
+    select_engine(lid);
+    lid->ws = alloc_workspace(lid);
 
     return lid;
+
+  malformed:
+    free(lid->cls_storage);
+    free(lid);
+    return NULL;
+}
+
+/* Return a pointer to a LanguageIdentifier based on the in-built default
+ * model, which is a native model linked into the executable (model.S).
+ */
+LanguageIdentifier *get_default_identifier(void) {
+    LanguageIdentifier *lid;
+
+    if ((lid = load_native(langid_model, langid_model_end - langid_model, "in-built")) == NULL) exit(-1);
+    return lid;
+}
+
+/* Load a model from a file, which may be either a protobuf model or a
+ * native model. A native model is used in place, and stays mapped until
+ * the identifier is destroyed. Returns NULL, after reporting why, if the
+ * file cannot be read or is not a well-formed model, so that a model can
+ * be replaced in a running process without risking it.
+ */
+LanguageIdentifier *try_load_identifier(const char *model_path) {
+		int fd;
+		struct stat st;
+		size_t model_len;
+		unsigned char *model_buf;
+    LanguageIdentifier *lid;
+
+#ifdef DEBUG
+		fprintf(stderr, "loading a model from: %s\n", model_path);
+#endif
+
+		/* Use mmap to access the model file */
+		if ((fd = open(model_path, O_RDONLY))==-1 || fstat(fd, &st) == -1) {
+			fprintf(stderr, "unable to open: %s\n", model_path);
+			if (fd != -1) close(fd);
+			return NULL;
+		}
+		model_len = st.st_size;
+		model_buf = (unsigned char *) mmap(NULL, model_len, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (model_buf == MAP_FAILED) {
+			fprintf(stderr, "unable to map: %s\n", model_path);
+			return NULL;
+		}
+
+    if (model_len >= sizeof(NativeHeader) && memcmp(model_buf, NATIVE_MAGIC, 8) == 0) {
+        if ((lid = load_native(model_buf, model_len, model_path)) == NULL) {
+            munmap(model_buf, model_len);
+            return NULL;
+        }
+        lid->map = model_buf;
+        lid->map_len = model_len;
+    }
+    else {
+        lid = load_protobuf(model_buf, model_len, model_path);
+        munmap(model_buf, model_len);
+    }
+
+    return lid;
+}
+
+/* As try_load_identifier, but exits if the model cannot be loaded */
+LanguageIdentifier *load_identifier(char *model_path) {
+    LanguageIdentifier *lid;
+
+    if ((lid = try_load_identifier(model_path)) == NULL) exit(-1);
+    return lid;
 }
 
 void destroy_identifier(LanguageIdentifier *lid){
     if (lid->protobuf_model != NULL) 
         langid__language_identifier__free_unpacked(lid->protobuf_model, NULL);
-    free_set(lid->sv);
-    free_set(lid->fv);
+    free(lid->tk_storage);
+    free(lid->nb_storage);
+    free(lid->cls_storage);
+    free(lid->fused_storage);
+    if (lid->map != NULL)
+        munmap(lid->map, lid->map_len);
+    if (lid->place_map != NULL)
+        munmap(lid->place_map, lid->place_len);
+    if (lid->cache_storage != NULL)
+        free_cache(lid->cache_storage);
+    free(lid->cascade_storage);
+    free_workspace(lid->ws);
     free(lid);
 }
 
+/* Return a LanguageIdentifier that only considers the n given languages,
+ * like set_languages in langid.py. nb_pc, nb_ptc and nb_classes are copied
+ * with just the columns of those languages, so the cost of scoring and the
+ * size of the weight rows scale with n rather than with the full model.
+ * The tokenizer is shared with lid, which must outlive the subset.
+ * Returns NULL if no languages are given or one is not in the model.
+ */
+LanguageIdentifier *subset_identifier(const LanguageIdentifier *lid, const char *langs[], unsigned n){
+    LanguageIdentifier *sub;
+    unsigned *cols, i, j, k, m = 0;
+    size_t f, esize, row, stride;
+    const char *src;
+    char *dst;
+
+    if (n == 0) {
+        fprintf(stderr, "no languages given\n");
+        return NULL;
+    }
+    if ((cols = (unsigned *) malloc(n * sizeof(unsigned))) == 0) exit(-1);
+    for (i=0; i < n; i++) {
+        for (j=0; j < lid->num_langs && strcmp((*lid->nb_classes)[j], langs[i]) != 0; j++);
+        if (j == lid->num_langs) {
+            fprintf(stderr, "unknown language: %s\n", langs[i]);
+            free(cols);
+            return NULL;
+        }
+        for (k=0; k < m && cols[k] != j; k++);
+        if (k == m) cols[m++] = j;
+    }
+
+    if ((sub = (LanguageIdentifier *) malloc(sizeof(LanguageIdentifier))) == 0) exit(-1);
+    *sub = *lid;
+    sub->num_langs = m;
+    sub->nb_stride = (m + NB_ALIGN - 1) / NB_ALIGN * NB_ALIGN;
+
+    switch (lid->nb_ptc_type) {
+      case NB_PTC_F32: esize = sizeof(float); src = (const char *) lid->nb_ptc_f32; break;
+      case NB_PTC_I16: esize = sizeof(int16_t); src = (const char *) lid->nb_ptc_i16; break;
+      default: esize = sizeof(double); src = (const char *) lid->nb_ptc; break;
+    }
+
+    /* nb_ptc and nb_pc share one allocation; the size of nb_ptc is a
+     * multiple of NB_ALIGN * esize, so nb_pc is suitably aligned */
+    row = lid->nb_stride * esize;
+    stride = sub->nb_stride * esize;
+    if (posix_memalign(&sub->nb_storage, 64, lid->num_feats * stride + m * sizeof(double)) != 0) exit(-1);
+    dst = (char *) sub->nb_storage;
+    memset(dst, 0, lid->num_feats * stride);
+    for (f=0; f < lid->num_feats; f++)
+        for (k=0; k < m; k++)
+            memcpy(dst + f * stride + k * esize, src + f * row + cols[k] * esize, esize);
+
+    sub->nb_ptc = NULL;
+    sub->nb_ptc_f32 = NULL;
+    sub->nb_ptc_i16 = NULL;
+    switch (lid->nb_ptc_type) {
+      case NB_PTC_F32: sub->nb_ptc_f32 = (float (*)[]) dst; break;
+      case NB_PTC_I16: sub->nb_ptc_i16 = (int16_t (*)[]) dst; break;
+      default: sub->nb_ptc = (double (*)[]) dst; break;
+    }
+    sub->nb_pc = (double (*)[]) (dst + lid->num_feats * stride);
+
+    /* class names point into the parent's storage */
+    if ((sub->cls_storage = malloc(m * sizeof(char *))) == 0) exit(-1);
+    sub->nb_classes = (char *(*)[]) sub->cls_storage;
+    for (k=0; k < m; k++) {
+        (*sub->nb_pc)[k] = (*lid->nb_pc)[cols[k]];
+        (*sub->nb_classes)[k] = (*lid->nb_classes)[cols[k]];
+    }
+    free(cols);
+
+    sub->protobuf_model = NULL;
+    sub->tk_storage = NULL;
+    sub->map = NULL;
+    sub->map_len = 0;
+    /* fused rows have the parent's columns */
+    sub->st_row = NULL;
+    sub->st_ptc = NULL;
+    sub->fused_storage = NULL;
+    /* the tokenizer stays wherever the parent placed it */
+    sub->place_map = NULL;
+    sub->place_len = 0;
+    sub->cache = NULL;
+    sub->cache_storage = NULL;
+    /* the fallback would answer in languages outside the subset */
+    sub->fallback = NULL;
+    sub->cascade = NULL;
+    sub->cascade_storage = NULL;
+    select_engine(sub);
+    sub->ws = alloc_workspace(sub);
+
+    return sub;
+}
+
+/* Weight of feature f for language i */
+static double feature_weight(const LanguageIdentifier *lid, size_t f, unsigned i){
+    switch (lid->nb_ptc_type) {
+      case NB_PTC_F32: return (*lid->nb_ptc_f32)[f * lid->nb_stride + i];
+      case NB_PTC_I16: return (*lid->nb_ptc_i16)[f * lid->nb_stride + i] * lid->nb_ptc_scale;
+      default: return (*lid->nb_ptc)[f * lid->nb_stride + i];
+    }
+}
+
+/* Build the tables for fused scoring. A state with c features saves c-1
+ * row accumulations per document it occurs in, so rows are given to the
+ * states with the most features first, until budget bytes are used.
+ * States with a single feature need no row of their own.
+ */
+void fuse_identifier(LanguageIdentifier *lid, size_t budget){
+    const size_t row = lid->nb_stride * sizeof(double);
+    const size_t head = (lid->num_states * sizeof(unsigned) + 63) / 64 * 64;
+    unsigned m, c, i, j, max_c = 0, rows = 0;
+    size_t nrows = 0;
+    const unsigned *out;
+    double *w;
+
+    for (m=0; m < lid->num_states; m++) {
+        c = (*lid->tk_output_c)[m];
+        if (c > max_c) max_c = c;
+        if (c >= 2) nrows++;
+    }
+    if (nrows > budget / row) nrows = budget / row;
+
+    free(lid->fused_storage);
+    if (posix_memalign(&lid->fused_storage, 64, head + nrows * row) != 0) exit(-1);
+    lid->st_row = (unsigned (*)[]) lid->fused_storage;
+    lid->st_ptc = (double (*)[]) ((char *) lid->fused_storage + head);
+
+    for (m=0; m < lid->num_states; m++) (*lid->st_row)[m] = FUSED_NONE;
+    for (c = max_c; c >= 2 && rows < nrows; c--) {
+        for (m=0; m < lid->num_states && rows < nrows; m++) {
+            if ((*lid->tk_output_c)[m] != c) continue;
+            (*lid->st_row)[m] = rows;
+            /* padding lanes stay 0, like those of nb_ptc */
+            w = &(*lid->st_ptc)[(size_t) rows++ * lid->nb_stride];
+            memset(w, 0, row);
+            out = &(*lid->tk_output)[(*lid->tk_output_s)[m]];
+            for (j=0; j < c; j++)
+                for (i=0; i < lid->num_langs; i++) w[i] += feature_weight(lid, out[j], i);
+        }
+    }
+}
+
+typedef struct {
+    void *ptr;
+    size_t size;
+} Table;
+
+/* the tables of a model, in the order model_tables lists them */
+enum {
+    T_NEXTMOVE, T_PTC, T_BYTECLS, T_OUTPUT_C, T_OUTPUT_S, T_OUTPUT, T_PC, T_ST_ROW, T_ST_PTC,
+    MAX_TABLES
+};
+
+/* Store the tables of lid in t, the two large ones first, and return how
+ * many there are; the fused ones are only listed if lid is fused.
+ */
+static unsigned model_tables(const LanguageIdentifier *lid, Table t[]){
+    size_t esize, outputs = 0, rows = 0, m;
+
+    t[T_NEXTMOVE].ptr = lid->tk_nextmove;
+    t[T_NEXTMOVE].size = (size_t) lid->num_states * lid->num_bytecls * sizeof(uint16_t);
+    switch (lid->nb_ptc_type) {
+      case NB_PTC_F32: esize = sizeof(float); t[T_PTC].ptr = lid->nb_ptc_f32; break;
+      case NB_PTC_I16: esize = sizeof(int16_t); t[T_PTC].ptr = lid->nb_ptc_i16; break;
+      default: esize = sizeof(double); t[T_PTC].ptr = lid->nb_ptc; break;
+    }
+    t[T_PTC].size = (size_t) lid->num_feats * lid->nb_stride * esize;
+
+    for (m=0; m < lid->num_states; m++)
+        if ((*lid->tk_output_s)[m] + (*lid->tk_output_c)[m] > outputs)
+            outputs = (*lid->tk_output_s)[m] + (*lid->tk_output_c)[m];
+    t[T_BYTECLS].ptr = lid->tk_bytecls;
+    t[T_BYTECLS].size = 256;
+    t[T_OUTPUT_C].ptr = lid->tk_output_c;
+    t[T_OUTPUT_C].size = lid->num_states * sizeof(unsigned);
+    t[T_OUTPUT_S].ptr = lid->tk_output_s;
+    t[T_OUTPUT_S].size = lid->num_states * sizeof(unsigned);
+    t[T_OUTPUT].ptr = lid->tk_output;
+    t[T_OUTPUT].size = outputs * sizeof(unsigned);
+    t[T_PC].ptr = lid->nb_pc;
+    t[T_PC].size = lid->num_langs * sizeof(double);
+    if (lid->st_row == NULL) return T_ST_ROW;
+
+    for (m=0; m < lid->num_states; m++) rows += (*lid->st_row)[m] != FUSED_NONE;
+    t[T_ST_ROW].ptr = lid->st_row;
+    t[T_ST_ROW].size = lid->num_states * sizeof(unsigned);
+    t[T_ST_PTC].ptr = lid->st_ptc;
+    t[T_ST_PTC].size = rows * lid->nb_stride * sizeof(double);
+    return MAX_TABLES;
+}
+
+/* Map len bytes of anonymous memory in huge pages, explicit ones if asked
+ * for and available, else transparent ones, setting len to the size mapped.
+ */
+static void *map_huge(size_t *len, int hugetlb){
+    size_t size = (*len + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE, head;
+    char *p;
+
+#ifdef MAP_HUGETLB
+    if (hugetlb) {
+        p = (char *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            *len = size;
+            return p;
+        }
+        fprintf(stderr, "no huge pages available, using transparent huge pages\n");
+    }
+#else
+    (void) hugetlb;
+#endif
+
+    /* over-allocate so that the mapping can be trimmed to a huge page boundary */
+    p = (char *) mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "unable to map %zu bytes\n", size);
+        exit(-1);
+    }
+    head = (HUGE_PAGE_SIZE - (uintptr_t) p % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE;
+    if (head) munmap(p, head);
+    munmap(p + head + size, HUGE_PAGE_SIZE - head);
+    p += head;
+#ifdef MADV_HUGEPAGE
+    madvise(p, size, MADV_HUGEPAGE);
+#endif
+    *len = size;
+    return p;
+}
+
+/* Copy the large tables of lid into huge pages, then prefault and lock its
+ * tables as asked; see PLACE_HUGEPAGES and the other flags.
+ */
+int place_identifier(LanguageIdentifier *lid, unsigned flags){
+    Table t[MAX_TABLES];
+    unsigned n = model_tables(lid, t), i;
+    size_t len, off, page = sysconf(_SC_PAGESIZE), pos;
+    volatile unsigned char sink;
+    char *p;
+
+    if ((flags & (PLACE_HUGEPAGES | PLACE_HUGETLB)) && lid->place_map == NULL) {
+        len = t[T_NEXTMOVE].size + NATIVE_ALIGN + t[T_PTC].size;
+        p = (char *) map_huge(&len, flags & PLACE_HUGETLB);
+        off = (t[T_NEXTMOVE].size + NATIVE_ALIGN - 1) / NATIVE_ALIGN * NATIVE_ALIGN;
+        memcpy(p, t[T_NEXTMOVE].ptr, t[T_NEXTMOVE].size);
+        memcpy(p + off, t[T_PTC].ptr, t[T_PTC].size);
+        mprotect(p, len, PROT_READ);
+
+        lid->tk_nextmove = (uint16_t (*)[]) p;
+        switch (lid->nb_ptc_type) {
+          case NB_PTC_F32: lid->nb_ptc_f32 = (float (*)[]) (p + off); break;
+          case NB_PTC_I16: lid->nb_ptc_i16 = (int16_t (*)[]) (p + off); break;
+          default: lid->nb_ptc = (double (*)[]) (p + off); break;
+        }
+        lid->place_map = p;
+        lid->place_len = len;
+        n = model_tables(lid, t);
+    }
+
+    if (flags & PLACE_PREFAULT) {
+        /* a read of each page maps it, from the page cache for a file */
+        for (i=0; i < n; i++)
+            for (pos = 0; pos < t[i].size; pos += page - (uintptr_t) ((char *) t[i].ptr + pos) % page)
+                sink = ((volatile unsigned char *) t[i].ptr)[pos];
+        (void) sink;
+    }
+
+    if (flags & PLACE_MLOCK) {
+        for (i=0; i < n; i++) {
+            if (mlock(t[i].ptr, t[i].size) != 0) {
+                fprintf(stderr, "unable to lock the model in memory, see ulimit -l\n");
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Return a copy of lid with all of its tables in memory bound to the given
+ * NUMA node, for threads running there to read locally. The copy is in
+ * huge pages if lid's large tables are. Like a subset it shares the class
+ * names of lid, which must outlive it. Without LANGID_NUMA the memory is
+ * left to the kernel's default policy.
+ */
+LanguageIdentifier *replicate_identifier(const LanguageIdentifier *lid, int node){
+    Table t[MAX_TABLES];
+    unsigned n = model_tables(lid, t), i;
+    size_t off[MAX_TABLES], len = 0;
+    LanguageIdentifier *rep;
+    char *p;
+
+    for (i=0; i < n; i++) {
+        off[i] = len;
+        len += (t[i].size + NATIVE_ALIGN - 1) / NATIVE_ALIGN * NATIVE_ALIGN;
+    }
+    if (lid->place_map != NULL) p = (char *) map_huge(&len, 0);
+    else if ((p = (char *) mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        fprintf(stderr, "unable to map %zu bytes\n", len);
+        exit(-1);
+    }
+#ifdef LANGID_NUMA
+    /* bind before the copy first touches the pages */
+    numa_tonode_memory(p, len, node);
+#else
+    (void) node;
+#endif
+    for (i=0; i < n; i++) memcpy(p + off[i], t[i].ptr, t[i].size);
+    mprotect(p, len, PROT_READ);
+
+    if ((rep = (LanguageIdentifier *) malloc(sizeof(LanguageIdentifier))) == 0) exit(-1);
+    *rep = *lid;
+    rep->tk_nextmove = (uint16_t (*)[]) (p + off[T_NEXTMOVE]);
+    switch (lid->nb_ptc_type) {
+      case NB_PTC_F32: rep->nb_ptc_f32 = (float (*)[]) (p + off[T_PTC]); break;
+      case NB_PTC_I16: rep->nb_ptc_i16 = (int16_t (*)[]) (p + off[T_PTC]); break;
+      default: rep->nb_ptc = (double (*)[]) (p + off[T_PTC]); break;
+    }
+    rep->tk_bytecls = (unsigned char (*)[256]) (p + off[T_BYTECLS]);
+    rep->tk_output_c = (unsigned (*)[]) (p + off[T_OUTPUT_C]);
+    rep->tk_output_s = (unsigned (*)[]) (p + off[T_OUTPUT_S]);
+    rep->tk_output = (unsigned (*)[]) (p + off[T_OUTPUT]);
+    rep->nb_pc = (double (*)[]) (p + off[T_PC]);
+    if (lid->st_row != NULL) {
+        rep->st_row = (unsigned (*)[]) (p + off[T_ST_ROW]);
+        rep->st_ptc = (double (*)[]) (p + off[T_ST_PTC]);
+    }
+
+    rep->protobuf_model = NULL;
+    rep->tk_storage = NULL;
+    rep->nb_storage = NULL;
+    rep->cls_storage = NULL;
+    rep->fused_storage = NULL;
+    rep->map = NULL;
+    rep->map_len = 0;
+    rep->place_map = p;
+    rep->place_len = len;
+    /* the cache, the fallback and its counters stay shared with lid */
+    rep->cache_storage = NULL;
+    rep->cascade_storage = NULL;
+    rep->ws = alloc_workspace(rep);
+
+    return rep;
+}
+
+/* Give lid a result cache, replacing any it has; see liblangid.h. Its
+ * replicas share it, its subsets need their own.
+ */
+void cache_identifier(LanguageIdentifier *lid, size_t entries, size_t max_len){
+    if (lid->cache_storage != NULL) free_cache(lid->cache_storage);
+    lid->cache = lid->cache_storage = alloc_cache(entries, max_len);
+}
+
+int get_cache_stats(const LanguageIdentifier *lid, CacheStats *st){
+    if (lid->cache == NULL) return 0;
+    cache_stats(lid->cache, st);
+    return 1;
+}
+
+/* counters of a cascade, on a cache line of their own */
+struct CascadeCounts {
+    atomic_uint_fast64_t docs, fallbacks;
+} __attribute__((aligned(64)));
+
+/* Put full behind lid as the second stage of a cascade; see liblangid.h */
+void cascade_identifier(LanguageIdentifier *lid, const LanguageIdentifier *full, double margin){
+    if (lid->cascade_storage == NULL &&
+        posix_memalign((void **) &lid->cascade_storage, 64, sizeof(CascadeCounts)) != 0) exit(-1);
+    atomic_init(&lid->cascade_storage->docs, 0);
+    atomic_init(&lid->cascade_storage->fallbacks, 0);
+    lid->cascade = lid->cascade_storage;
+    lid->fallback = full;
+    lid->fallback_margin = margin;
+    /* the default workspace needs one for full */
+    free_workspace(lid->ws);
+    lid->ws = alloc_workspace(lid);
+}
+
+int get_cascade_stats(const LanguageIdentifier *lid, CascadeStats *st){
+    if (lid->fallback == NULL) return 0;
+    st->docs = atomic_load_explicit(&lid->cascade->docs, memory_order_relaxed);
+    st->fallbacks = atomic_load_explicit(&lid->cascade->fallbacks, memory_order_relaxed);
+    return 1;
+}
+
+/* Allocate the scratch space needed to classify with a given model.
+ */
+Workspace *alloc_workspace(const LanguageIdentifier *lid){
+    Workspace *ws;
+    unsigned i;
+
+    if ((ws = (Workspace *) malloc(sizeof(Workspace))) == 0) exit(-1);
+
+    ws->sv = alloc_set(lid->num_states);
+    ws->fv = alloc_set(lid->num_feats);
+    /* padded and aligned like the rows of nb_ptc */
+    if (posix_memalign((void **) &ws->lp, 64, lid->nb_stride * sizeof(double)) != 0) exit(-1);
+
+    ws->bf = alloc_set(lid->num_feats);
+    for (i=0; i < TOKENIZE_GROUP; i++) ws->group_sv[i] = alloc_set(lid->num_states);
+    if ((ws->bf_head = (unsigned *) malloc(lid->num_feats * sizeof(unsigned))) == 0) exit(-1);
+    ws->post = NULL;
+    ws->post_size = 0;
+    if (posix_memalign((void **) &ws->batch_lp, 64, BATCH_SIZE * lid->nb_stride * sizeof(double)) != 0) exit(-1);
+
+    ws->stream_state = 0;
+    ws->stream_len = 0;
+    ws->fallback = lid->fallback != NULL ? alloc_workspace(lid->fallback) : NULL;
+    memset(&ws->stats, 0, sizeof(IdentifyStats));
+
+    return ws;
+}
+
+static void merge_stats(IdentifyStats *total, const IdentifyStats *st){
+    total->docs += st->docs;
+    total->bytes += st->bytes;
+    total->states += st->states;
+    total->feats += st->feats;
+    if (st->max_states > total->max_states) total->max_states = st->max_states;
+    if (st->max_feats > total->max_feats) total->max_feats = st->max_feats;
+    total->tokenize_ns += st->tokenize_ns;
+    total->expand_ns += st->expand_ns;
+    total->score_ns += st->score_ns;
+    total->pred_ns += st->pred_ns;
+}
+
+void free_workspace(Workspace *ws){
+    unsigned i;
+
+#ifdef LANGID_STATS
+    /* the fallback's own counters are retired with it below */
+    pthread_mutex_lock(&retired_lock);
+    merge_stats(&retired_stats, &ws->stats);
+    pthread_mutex_unlock(&retired_lock);
+#endif
+    free_set(ws->sv);
+    free_set(ws->fv);
+    free(ws->lp);
+    free_set(ws->bf);
+    for (i=0; i < TOKENIZE_GROUP; i++) free_set(ws->group_sv[i]);
+    free(ws->bf_head);
+    free(ws->post);
+    free(ws->batch_lp);
+    if (ws->fallback != NULL) free_workspace(ws->fallback);
+    free(ws);
+}
+
+int stats_enabled(void){
+#ifdef LANGID_STATS
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+void add_workspace_stats(IdentifyStats *total, const Workspace *ws){
+    merge_stats(total, &ws->stats);
+    if (ws->fallback != NULL) merge_stats(total, &ws->fallback->stats);
+}
+
+void add_retired_stats(IdentifyStats *total){
+#ifdef LANGID_STATS
+    pthread_mutex_lock(&retired_lock);
+    merge_stats(total, &retired_stats);
+    pthread_mutex_unlock(&retired_lock);
+#endif
+}
+
+/* The per-document stages are compiled twice from engine.h: for any model,
+ * and with the dimensions of the in-built model as constants, so that the
+ * loops over byte classes, languages and weight rows have fixed bounds and
+ * strides. lid->specialized selects the second.
+ */
+#define ENGINE(name) name##_any
+#define E_NUM_BYTECLS lid->num_bytecls
+#define E_NUM_LANGS lid->num_langs
+#define E_NB_STRIDE lid->nb_stride
+#include "engine.h"
+
+#define ENGINE(name) name##_builtin
+#define E_NUM_BYTECLS NUM_BYTECLS
+#define E_NUM_LANGS NUM_LANGS
+#define E_NB_STRIDE NB_STRIDE
+#define E_F64_ONLY
+#include "engine.h"
+
+static unsigned tokenize(const LanguageIdentifier *lid, const char *text, size_t textlen, unsigned s, Set *sv){
+    return lid->specialized ? tokenize_builtin(lid, text, textlen, s, sv) : tokenize_any(lid, text, textlen, s, sv);
+}
+
+static void tokenize_group(const LanguageIdentifier *lid, const char *texts[], const int lens[], unsigned n, Set *sv[]){
+    if (lid->specialized) tokenize_group_builtin(lid, texts, lens, n, sv);
+    else tokenize_group_any(lid, texts, lens, n, sv);
+}
+
+static void sv_to_fv(const LanguageIdentifier *lid, Set *sv, Set *fv){
+    if (lid->specialized) sv_to_fv_builtin(lid, sv, fv);
+    else sv_to_fv_any(lid, sv, fv);
+}
+
+static void init_logprob(const LanguageIdentifier *lid, double logprob[]){
+    if (lid->specialized) init_logprob_builtin(lid, logprob);
+    else init_logprob_any(lid, logprob);
+}
+
+static void accumulate_fv(const LanguageIdentifier *lid, Set *fv, double logprob[]){
+    if (lid->specialized) accumulate_fv_builtin(lid, fv, logprob);
+    else accumulate_fv_any(lid, fv, logprob);
+}
+
 /* 
  * Convert a text stream into a feature vector. The feature vector counts
  * how many times each sequence is seen.
  */
-void text_to_fv(LanguageIdentifier *lid, char *text, int textlen, Set *sv, Set *fv){
-  unsigned i, j, m, s=0;
-  
+void text_to_fv(const LanguageIdentifier *lid, const char *text, int textlen, Set *sv, Set *fv){
   clear(sv);
-  clear(fv);
-
-  for (i=0; i < textlen; i++){
-      s = (*lid->tk_nextmove)[s][(unsigned char) text[i]];
-      add(sv, s, 1);
-  }
-
-  /* convert the SV into the FV */
-  for (i=0; i < sv->members; i++) {
-  		m = sv->dense[i];
-  		for (j=0; j<(*lid->tk_output_c)[m]; j++){
-				  add(fv, (*lid->tk_output)[(*lid->tk_output_s)[m]+j], sv->counts[i]);
-			}
-	}
-
-  return;
-}
-
-void fv_to_logprob(LanguageIdentifier *lid, Set *fv, double logprob[]){
-    unsigned i, j, m;
-    double *nb_ptc_p;
-    /* Initialize using prior */
-    for (i=0; i < lid->num_langs; i++){
-        logprob[i] = (*lid->nb_pc)[i];
-    }
-
-    /* Compute posterior for each class */
-    for (i=0; i< fv->members; i++){
-				m = fv->dense[i];
-				/* NUM_FEATS * NUM_LANGS */
-				nb_ptc_p = &(*lid->nb_ptc)[m*lid->num_langs];
-    	  for (j=0; j < lid->num_langs; j++){
-						logprob[j] += fv->counts[i] * (*nb_ptc_p);
-						nb_ptc_p += 1;
-				}
-		}
+  tokenize(lid, text, textlen, 0, sv);
+  sv_to_fv(lid, sv, fv);
+}
+
+/* Add the weights of the features of the states in sv to logprob,
+ * without counting the features first; see fuse_identifier.
+ */
+static void accumulate_sv_fused(const LanguageIdentifier *lid, Set *sv, double logprob[]){
+    const unsigned stride = lid->nb_stride;
+    const Kernels *k = lid->kernels;
+    const unsigned *out;
+    unsigned i, j, m, r, count;
+
+    for (i=0; i < sv->members; i++) {
+        m = sv->dense[i].key;
+        count = sv->dense[i].count;
+        if ((r = (*lid->st_row)[m]) != FUSED_NONE) {
+            k->acc_f64(logprob, &(*lid->st_ptc)[(size_t) r * stride], count, stride);
+            continue;
+        }
+        out = &(*lid->tk_output)[(*lid->tk_output_s)[m]];
+        for (j=0; j < (*lid->tk_output_c)[m]; j++) {
+            switch (lid->nb_ptc_type) {
+            case NB_PTC_F64:
+                k->acc_f64(logprob, &(*lid->nb_ptc)[out[j] * stride], count, stride);
+                break;
+            case NB_PTC_F32:
+                k->acc_f32(logprob, &(*lid->nb_ptc_f32)[out[j] * stride], count, stride);
+                break;
+            case NB_PTC_I16:
+                k->acc_i16(logprob, &(*lid->nb_ptc_i16)[out[j] * stride], count * lid->nb_ptc_scale, stride);
+                break;
+            }
+        }
+    }
+}
+
+/* Add the weights of the states counted in ws->sv to logprob, by way of
+ * the feature counts in ws->fv unless lid is fused, in which case fv is
+ * left empty.
+ */
+static void accumulate_sv(const LanguageIdentifier *lid, Workspace *ws, double logprob[]){
+    STATS_START(t);
+
+    if (lid->st_row != NULL) {
+        clear(ws->fv);
+        accumulate_sv_fused(lid, ws->sv, logprob);
+    }
+    else {
+        sv_to_fv(lid, ws->sv, ws->fv);
+        STATS_LAP(ws, expand_ns, t);
+        accumulate_fv(lid, ws->fv, logprob);
+    }
+    STATS_LAP(ws, score_ns, t);
+}
 
-    return;
+void fv_to_logprob(const LanguageIdentifier *lid, Set *fv, double logprob[]){
+    init_logprob(lid, logprob);
+    accumulate_fv(lid, fv, logprob);
 }
 
-int logprob_to_pred(LanguageIdentifier *lid, double logprob[]){
-    int m=0, i;
+int logprob_to_pred(const LanguageIdentifier *lid, double logprob[]){
+    return lid->kernels->argmax(logprob, lid->nb_stride);
+}
+
+/* Tokenize and score text into ws->lp, counted in the stats of ws */
+static void score_text(const LanguageIdentifier *lid, Workspace *ws, const char *text, size_t textlen){
+    STATS_START(t);
+
+    clear(ws->sv);
+    tokenize(lid, text, textlen, 0, ws->sv);
+    STATS_LAP(ws, tokenize_ns, t);
+    init_logprob(lid, ws->lp);
+    STATS_LAP(ws, score_ns, t);
+    accumulate_sv(lid, ws, ws->lp);
+    STATS_DOC(ws, textlen);
+}
+
+/* Return the index of the best language in logprob, setting margin to
+ * its lead over the runner-up.
+ */
+static unsigned lead(const LanguageIdentifier *lid, const double logprob[], double *margin){
+    unsigned i, best = 0;
+    double second = -HUGE_VAL;
 
-    for (i=1; i<lid->num_langs; i++){
-        if (logprob[m] < logprob[i]) m = i;
+    for (i=1; i < lid->num_langs; i++){
+        if (logprob[i] > logprob[best]) {
+            second = logprob[best];
+            best = i;
+        }
+        else if (logprob[i] > second) second = logprob[i];
     }
+    *margin = logprob[best] - second;
+    return best;
+}
 
-    return m;
+/* Score text with lid into ws->lp or, if lid cascades and is unsure of the
+ * text, with its fallback into ws->fallback->lp. Returns the identifier
+ * whose scores stand and sets *used to the workspace holding them.
+ */
+static const LanguageIdentifier *score_cascade(const LanguageIdentifier *lid, Workspace *ws, const char *text,
+                                               size_t textlen, Workspace **used){
+    double margin;
+
+    score_text(lid, ws, text, textlen);
+    *used = ws;
+    if (lid->fallback == NULL) return lid;
+
+    atomic_fetch_add_explicit(&lid->cascade->docs, 1, memory_order_relaxed);
+    lead(lid, ws->lp, &margin);
+    if (margin >= lid->fallback_margin) return lid;
+
+    atomic_fetch_add_explicit(&lid->cascade->fallbacks, 1, memory_order_relaxed);
+    score_text(lid->fallback, ws->fallback, text, textlen);
+    *used = ws->fallback;
+    return lid->fallback;
 }
 
-const char *identify(LanguageIdentifier *lid, char *text, int textlen){
-    double lp[lid->num_langs];
+/* The language of a result as cached and as returned by score_batch: an
+ * index into lid's classes, or for an answer of the fallback its index
+ * into the fallback's classes plus lid->num_langs.
+ */
+static inline const char *result_lang(const LanguageIdentifier *lid, unsigned pred){
+    if (pred < lid->num_langs) return (*lid->nb_classes)[pred];
+    return (*lid->fallback->nb_classes)[pred - lid->num_langs];
+}
+
+/* Classify a text using a caller-supplied Workspace. The model itself is
+ * only read, so this is safe to call from several threads at once provided
+ * that no two of them share a Workspace.
+ */
+const char *identify_r(const LanguageIdentifier *lid, Workspace *ws, const char *text, int textlen){
+    const LanguageIdentifier *by;
+    unsigned cached;
     int pred;
 #ifdef DEBUG
 		int i;
 #endif
 
-    text_to_fv(lid, text, textlen, lid->sv, lid->fv);
-    fv_to_logprob(lid, lid->fv, lp);
-		pred = logprob_to_pred(lid,lp);
+    if (lid->cache != NULL && cache_get(lid->cache, text, textlen, &cached))
+        return result_lang(lid, cached);
+
+    by = score_cascade(lid, ws, text, textlen, &ws);
+    STATS_START(t);
+		pred = logprob_to_pred(by, ws->lp);
+    STATS_LAP(ws, pred_ns, t);
 
 #ifdef DEBUG
-		fprintf(stderr,"pred lang: %s logprob: %lf\n", (*lid->nb_classes)[pred], lp[pred]);
-		for (i=0; i<lid->num_langs; i++){
-			fprintf(stderr,"  lang: %s logprob: %lf\n", (*lid->nb_classes)[i], lp[i]);
+		fprintf(stderr,"pred lang: %s logprob: %lf\n", (*by->nb_classes)[pred], ws->lp[pred]);
+		for (i=0; i<by->num_langs; i++){
+			fprintf(stderr,"  lang: %s logprob: %lf\n", (*by->nb_classes)[i], ws->lp[i]);
 		}
 #endif
 
+    if (lid->cache != NULL) cache_put(lid->cache, text, textlen, by == lid ? pred : lid->num_langs + pred);
+    return (*by->nb_classes)[pred];
+}
+
+/* Posterior probability of class pred, normalised over all classes. The
+ * largest logprob is subtracted before exponentiating to avoid underflow.
+ */
+static double logprob_to_prob(const LanguageIdentifier *lid, double logprob[], int pred){
+    return 1.0 / lid->kernels->sumexp(logprob, lid->nb_stride, logprob[pred]);
+}
+
+/* Select the k largest entries of logprob by insertion into out, which
+ * stays sorted best first; ties keep the earlier language first, as in
+ * logprob_to_pred. Only the k selected entries are normalised individually.
+ */
+static unsigned logprob_to_rank(const LanguageIdentifier *lid, const double logprob[], LangScore out[], unsigned k){
+    unsigned i, j, m = 0;
+    double sum;
+
+    if (k > lid->num_langs) k = lid->num_langs;
+    if (k == 0) return 0;
+
+    for (j=0; j < lid->num_langs; j++){
+        if (m == k && logprob[j] <= out[k-1].logprob) continue;
+        for (i = m < k ? m++ : k-1; i > 0 && out[i-1].logprob < logprob[j]; i--) out[i] = out[i-1];
+        out[i].lang = (*lid->nb_classes)[j];
+        out[i].logprob = logprob[j];
+    }
+
+    sum = lid->kernels->sumexp(logprob, lid->nb_stride, out[0].logprob);
+    for (i=0; i < m; i++) out[i].prob = exp(out[i].logprob - out[0].logprob) / sum;
+
+    return m;
+}
+
+const char *identify_prob_r(const LanguageIdentifier *lid, Workspace *ws, const char *text, int textlen, double *prob){
+    const LanguageIdentifier *by;
+    int pred;
+
+    by = score_cascade(lid, ws, text, textlen, &ws);
+    STATS_START(t);
+    pred = logprob_to_pred(by, ws->lp);
+    *prob = logprob_to_prob(by, ws->lp, pred);
+    STATS_LAP(ws, pred_ns, t);
+
+    return (*by->nb_classes)[pred];
+}
+
+unsigned rank_r(const LanguageIdentifier *lid, Workspace *ws, const char *text, int textlen, LangScore out[], unsigned k){
+    const LanguageIdentifier *by;
+
+    by = score_cascade(lid, ws, text, textlen, &ws);
+    STATS_START(t);
+    k = logprob_to_rank(by, ws->lp, out, k);
+    STATS_LAP(ws, pred_ns, t);
+    return k;
+}
+
+void identify_begin_r(const LanguageIdentifier *lid, Workspace *ws){
+    clear(ws->sv);
+    ws->stream_state = 0;
+    ws->stream_len = 0;
+}
+
+void identify_feed_r(const LanguageIdentifier *lid, Workspace *ws, const char *text, size_t textlen){
+    STATS_START(t);
+
+    ws->stream_state = tokenize(lid, text, textlen, ws->stream_state, ws->sv);
+    ws->stream_len += textlen;
+    STATS_LAP(ws, tokenize_ns, t);
+}
+
+/* score the state counts of a stream; the DFA walk was timed as fed */
+static void finish_stream(const LanguageIdentifier *lid, Workspace *ws){
+    STATS_START(t);
+
+    init_logprob(lid, ws->lp);
+    STATS_LAP(ws, score_ns, t);
+    accumulate_sv(lid, ws, ws->lp);
+    STATS_DOC(ws, ws->stream_len);
+}
+
+const char *identify_finish_r(const LanguageIdentifier *lid, Workspace *ws){
+    int pred;
+
+    finish_stream(lid, ws);
+    STATS_START(t);
+    pred = logprob_to_pred(lid, ws->lp);
+    STATS_LAP(ws, pred_ns, t);
+    return (*lid->nb_classes)[pred];
+}
+
+unsigned rank_finish_r(const LanguageIdentifier *lid, Workspace *ws, LangScore out[], unsigned k){
+    finish_stream(lid, ws);
+    STATS_START(t);
+    k = logprob_to_rank(lid, ws->lp, out, k);
+    STATS_LAP(ws, pred_ns, t);
+    return k;
+}
+
+/* Score text incrementally into ws->lp, returning the number of bytes
+ * read. The text is read in rounds, each giving every region twice as
+ * many bytes as the last, so that the number of rounds and with it the
+ * cost of the checks grows only logarithmically. Each region keeps its own
+ * tokenizer state, and since the state counts of successive rounds simply
+ * add up, a single region read to the end scores exactly like identify_r.
+ */
+static size_t early_logprob(const LanguageIdentifier *lid, Workspace *ws, const char *text, size_t textlen,
+                            const EarlyExit *opts){
+    size_t pos[EARLY_MAX_POSITIONS], end[EARLY_MAX_POSITIONS], step, region, n, progress, consumed = 0;
+    unsigned s[EARLY_MAX_POSITIONS], np = 1, r, best, prev = UINT_MAX;
+    double margin;
+    STATS_START(t);
+
+    if (opts->budget && opts->budget < textlen) {
+        /* equally spaced regions sharing the budget */
+        np = opts->positions < 1 ? 1 : opts->positions > EARLY_MAX_POSITIONS ? EARLY_MAX_POSITIONS : opts->positions;
+        if (np > opts->budget) np = opts->budget;
+        for (r=0; r < np; r++) {
+            region = opts->budget / np + (r < opts->budget % np);
+            pos[r] = textlen / np * r;
+            end[r] = pos[r] + region;
+        }
+    }
+    else {
+        pos[0] = 0;
+        end[0] = textlen;
+    }
+    for (r=0; r < np; r++) s[r] = 0;
+
+    init_logprob(lid, ws->lp);
+    clear(ws->sv);
+    clear(ws->fv);
+    for (step = opts->step ? opts->step : EARLY_STEP; ; step *= 2) {
+        /* stop with the counts of the last round that read anything */
+        for (r=0; r < np && pos[r] == end[r]; r++);
+        if (r == np) break;
+
+        clear(ws->sv);
+        progress = 0;
+        for (r=0; r < np; r++) {
+            n = end[r] - pos[r] < step ? end[r] - pos[r] : step;
+            s[r] = tokenize(lid, text + pos[r], n, s[r], ws->sv);
+            pos[r] += n;
+            progress += n;
+        }
+        STATS_LAP(ws, tokenize_ns, t);
+        consumed += progress;
+        accumulate_sv(lid, ws, ws->lp);
+        STATS_RESTART(t);
+
+        /* stop once the same language has led by the margin twice running */
+        if (opts->margin > 0.0) {
+            best = lead(lid, ws->lp, &margin);
+            if (margin < opts->margin) prev = UINT_MAX;
+            else if (best == prev) break;
+            else prev = best;
+        }
+    }
+    /* the states and features of the last round stand for the document */
+    STATS_DOC(ws, consumed);
+
+    return consumed;
+}
+
+const char *identify_early_r(const LanguageIdentifier *lid, Workspace *ws, const char *text, size_t textlen,
+                             const EarlyExit *opts, size_t *consumed){
+    int pred;
+
+    *consumed = early_logprob(lid, ws, text, textlen, opts);
+    STATS_START(t);
+    pred = logprob_to_pred(lid, ws->lp);
+    STATS_LAP(ws, pred_ns, t);
     return (*lid->nb_classes)[pred];
 }
 
+unsigned rank_early_r(const LanguageIdentifier *lid, Workspace *ws, const char *text, size_t textlen,
+                      const EarlyExit *opts, size_t *consumed, LangScore out[], unsigned k){
+    *consumed = early_logprob(lid, ws, text, textlen, opts);
+    STATS_START(t);
+    k = logprob_to_rank(lid, ws->lp, out, k);
+    STATS_LAP(ws, pred_ns, t);
+    return k;
+}
+
+/* Score up to BATCH_SIZE documents. The documents are tokenized in
+ * groups of TOKENIZE_GROUP, and the feature vectors of all of them are
+ * merged into one set with a list of (document, count) postings per
+ * feature, then each weight row is fetched once and applied to every
+ * document that contains the feature.
+ */
+static void score_batch(const LanguageIdentifier *lid, Workspace *ws, const char *texts[], const int lens[],
+                        size_t n, unsigned pred[]){
+    const unsigned stride = lid->nb_stride;
+    const Kernels *k = lid->kernels;
+    Set *fv = ws->fv, *bf = ws->bf, *sv;
+    unsigned d, i, f, p, np = 0, members;
+    double *lp;
+    STATS_START(t);
+
+    clear(bf);
+    for (d=0; d < n; d++){
+        /* walk the DFA for a group of documents at a time */
+        if (d % TOKENIZE_GROUP == 0) {
+            tokenize_group(lid, texts + d, lens + d, n - d < TOKENIZE_GROUP ? n - d : TOKENIZE_GROUP, ws->group_sv);
+            STATS_LAP(ws, tokenize_ns, t);
+        }
+        sv = ws->group_sv[d % TOKENIZE_GROUP];
+        sv_to_fv(lid, sv, fv);
+        STATS_LAP(ws, expand_ns, t);
+        STATS_DOC_OF(ws, lens[d], sv);
+        init_logprob(lid, ws->batch_lp + d * stride);
+
+        if (np + fv->members > ws->post_size) {
+            ws->post_size = 2 * (np + fv->members);
+            if ((ws->post = (Posting *) realloc(ws->post, ws->post_size * sizeof(Posting))) == 0) exit(-1);
+        }
+        for (i=0; i < fv->members; i++){
+            members = bf->members;
+            f = add_key(bf, fv->dense[i].key);
+            if (bf->members != members) ws->bf_head[f] = (unsigned) -1;
+            ws->post[np].doc = d;
+            ws->post[np].count = fv->dense[i].count;
+            ws->post[np].next = ws->bf_head[f];
+            ws->bf_head[f] = np++;
+        }
+        STATS_LAP(ws, score_ns, t);
+    }
+
+    for (f=0; f < bf->members; f++){
+        i = bf->dense[f].key;
+        for (p = ws->bf_head[f]; p != (unsigned) -1; p = ws->post[p].next){
+            lp = ws->batch_lp + ws->post[p].doc * stride;
+            switch (lid->nb_ptc_type) {
+            case NB_PTC_F64:
+                k->acc_f64(lp, &(*lid->nb_ptc)[i * stride], ws->post[p].count, stride);
+                break;
+            case NB_PTC_F32:
+                k->acc_f32(lp, &(*lid->nb_ptc_f32)[i * stride], ws->post[p].count, stride);
+                break;
+            case NB_PTC_I16:
+                k->acc_i16(lp, &(*lid->nb_ptc_i16)[i * stride], ws->post[p].count * lid->nb_ptc_scale, stride);
+                break;
+            }
+        }
+    }
+    STATS_LAP(ws, score_ns, t);
+
+    for (d=0; d < n; d++){
+        pred[d] = logprob_to_pred(lid, ws->batch_lp + d * stride);
+    }
+    STATS_LAP(ws, pred_ns, t);
+}
+
+/* score_batch, then score again with the fallback the texts lid is unsure
+ * of, for results as in result_lang */
+static void score_batch_cascade(const LanguageIdentifier *lid, Workspace *ws, const char *texts[], const int lens[],
+                                size_t n, unsigned pred[]){
+    const char *re_texts[BATCH_SIZE];
+    int re_lens[BATCH_SIZE];
+    size_t re[BATCH_SIZE], d, m = 0;
+    unsigned re_pred[BATCH_SIZE];
+    double margin;
+
+    score_batch(lid, ws, texts, lens, n, pred);
+    if (lid->fallback == NULL) return;
+
+    for (d=0; d < n; d++){
+        lead(lid, ws->batch_lp + d * lid->nb_stride, &margin);
+        if (margin >= lid->fallback_margin) continue;
+        re_texts[m] = texts[d];
+        re_lens[m] = lens[d];
+        re[m++] = d;
+    }
+    atomic_fetch_add_explicit(&lid->cascade->docs, n, memory_order_relaxed);
+    if (m == 0) return;
+
+    atomic_fetch_add_explicit(&lid->cascade->fallbacks, m, memory_order_relaxed);
+    score_batch(lid->fallback, ws->fallback, re_texts, re_lens, m, re_pred);
+    for (d=0; d < m; d++) pred[re[d]] = lid->num_langs + re_pred[d];
+}
+
+void identify_batch_r(const LanguageIdentifier *lid, Workspace *ws, const char *texts[], const int lens[],
+                      size_t n, const char *out[]){
+    const char *miss_texts[BATCH_SIZE];
+    int miss_lens[BATCH_SIZE];
+    size_t miss[BATCH_SIZE], i, j, m = 0;
+    unsigned pred[BATCH_SIZE], cached;
+
+    if (lid->cache == NULL) {
+        for (i=0; i < n; i += BATCH_SIZE){
+            m = n - i < BATCH_SIZE ? n - i : BATCH_SIZE;
+            score_batch_cascade(lid, ws, texts + i, lens + i, m, pred);
+            for (j=0; j < m; j++) out[i+j] = result_lang(lid, pred[j]);
+        }
+        return;
+    }
+
+    /* answer what the cache can, and score the rest in full batches */
+    for (i=0; i <= n; i++){
+        if (i < n) {
+            if (cache_get(lid->cache, texts[i], lens[i], &cached)) {
+                out[i] = result_lang(lid, cached);
+                continue;
+            }
+            miss_texts[m] = texts[i];
+            miss_lens[m] = lens[i];
+            miss[m++] = i;
+            if (m < BATCH_SIZE) continue;
+        }
+        if (m == 0) continue;
+
+        score_batch_cascade(lid, ws, miss_texts, miss_lens, m, pred);
+        for (j=0; j < m; j++){
+            out[miss[j]] = result_lang(lid, pred[j]);
+            cache_put(lid->cache, miss_texts[j], miss_lens[j], pred[j]);
+        }
+        m = 0;
+    }
+}
+
+void identify_batch(LanguageIdentifier *lid, const char *texts[], const int lens[], size_t n, const char *out[]){
+    identify_batch_r(lid, lid->ws, texts, lens, n, out);
+}
+
+const char *identify(LanguageIdentifier *lid, char *text, int textlen){
+    return identify_r(lid, lid->ws, text, textlen);
+}
+
+unsigned rank(LanguageIdentifier *lid, const char *text, int textlen, LangScore out[], unsigned k){
+    return rank_r(lid, lid->ws, text, textlen, out, k);
+}
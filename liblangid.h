@@ -1,39 +1,299 @@
 #ifndef _LANGID_H
 #define _LANGID_H
 
+#include <stdint.h>
 #include "sparseset.h"
+#include "kernels.h"
+#include "resultcache.h"
 #include "langid.pb-c.h"
 
-/* Structure containing all the state required to
- * implement a language identifier
+/* Number of documents identify_batch scores together. Their logprob rows
+ * are small enough to stay in cache while each weight row is applied to
+ * all of them.
  */
+#define BATCH_SIZE 64
+
+/* Number of documents of a batch whose tokenizer walks are interleaved */
+#define TOKENIZE_GROUP 4
+
+/* one occurrence of a feature in a document of a batch */
 typedef struct {
+    unsigned doc, count, next;
+} Posting;
+
+/* Counters of the work done through a Workspace, kept when liblangid is
+ * built with -DLANGID_STATS and left at zero otherwise. states and feats
+ * sum the distinct tokenizer states and features of each document, and
+ * the times split the nanoseconds spent classifying between the DFA walk,
+ * the expansion of states into features, scoring and picking the result.
+ */
+typedef struct {
+    uint64_t docs, bytes;
+    uint64_t states, max_states;
+    uint64_t feats, max_feats;
+    uint64_t tokenize_ns, expand_ns, score_ns, pred_ns;
+} IdentifyStats;
+
+/* Per-call scratch space. The sparsesets for counting states and features
+ * live here as the clear operation on them is much less costly than
+ * allocating them from scratch. A Workspace is sized for a particular
+ * model and must only be used by one thread at a time.
+ */
+typedef struct Workspace {
+    Set *sv, *fv;
+    double *lp;
+
+    /* batch scoring: the distinct features of the batch, the state counts
+     * of a group of documents, the head of each feature's list of
+     * postings, and a logprob row per document */
+    Set *bf;
+    Set *group_sv[TOKENIZE_GROUP];
+    unsigned *bf_head;
+    Posting *post;
+    size_t post_size;
+    double *batch_lp;
+
+    /* streaming: the tokenizer state and bytes fed so far; the state
+     * counts accumulate in sv */
+    unsigned stream_state;
+    size_t stream_len;
+
+    /* the workspace of the second stage of a cascade, or NULL */
+    struct Workspace *fallback;
+
+    IdentifyStats stats;
+} Workspace;
+
+/* counters of a cascade, see cascade_identifier */
+typedef struct CascadeCounts CascadeCounts;
+
+/* Structure containing the model data required to implement a
+ * language identifier. Once loaded the model is never written to, so a
+ * single LanguageIdentifier can be shared by any number of threads as
+ * long as each of them classifies with its own Workspace.
+ */
+typedef struct LanguageIdentifier {
     unsigned int num_feats;
     unsigned int num_langs;
     unsigned int num_states;
+    unsigned int num_bytecls;
 
-    unsigned (*tk_nextmove)[][256];
+    /* the tokenizer DFA. bytes are first mapped to one of num_bytecls
+     * classes of bytes that behave identically from every state, and
+     * the transition table is indexed by [state * num_bytecls + class]
+     */
+    unsigned char (*tk_bytecls)[256];
+    uint16_t (*tk_nextmove)[];
     unsigned (*tk_output_c)[];
     unsigned (*tk_output_s)[];
     unsigned (*tk_output)[];
 
     double (*nb_pc)[];
+
+    /* nb_ptc is held in one of three representations, only the pointer
+     * for nb_ptc_type is set. int16 weights are scaled by nb_ptc_scale.
+     * Rows are nb_stride elements long, num_langs rounded up to NB_ALIGN,
+     * and the table is 64-byte aligned.
+     */
+    enum { NB_PTC_F64, NB_PTC_F32, NB_PTC_I16 } nb_ptc_type;
     double (*nb_ptc)[];
+    float (*nb_ptc_f32)[];
+    int16_t (*nb_ptc_i16)[];
+    double nb_ptc_scale;
+    unsigned int nb_stride;
 
     char *(*nb_classes)[];
 
+    /* fused scoring, see fuse_identifier. st_row gives for each state the
+     * index of its row of summed weights in st_ptc, or FUSED_NONE if its
+     * features are applied one by one; st_row is NULL when not fused.
+     */
+    unsigned (*st_row)[];
+    double (*st_ptc)[];
+
+    /* scoring kernels selected for the running CPU */
+    const Kernels *kernels;
+    /* set if the model has the dimensions of the in-built one, whose engine
+     * is compiled with them as constants */
+    int specialized;
+
     Langid__LanguageIdentifier *protobuf_model;
+    /* storage for tables converted at load time, if any */
+    void *tk_storage;
+    void *nb_storage;
+    void *cls_storage;
+    void *fused_storage;
+    /* a native model file, mapped for the lifetime of the identifier */
+    void *map;
+    size_t map_len;
+    /* huge-page copy of the large tables, see place_identifier */
+    void *place_map;
+    size_t place_len;
+    /* results of short texts, see cache_identifier; cache_storage is set
+     * if the cache belongs to this identifier rather than one it copies */
+    ResultCache *cache;
+    ResultCache *cache_storage;
+    /* the second stage of a cascade, see cascade_identifier; as with the
+     * cache, cascade_storage is set if the counters belong to this one */
+    const struct LanguageIdentifier *fallback;
+    double fallback_margin;
+    CascadeCounts *cascade;
+    CascadeCounts *cascade_storage;
 
-    /* sparsesets for counting states and features. these are
-     * part of LanguageIdentifier as the clear operation on them
-     * is much less costly than allocating them from scratch
-     */
-		Set *sv, *fv;
+    /* default workspace, used by the non-reentrant identify() */
+    Workspace *ws;
 } LanguageIdentifier;
 
+#define FUSED_NONE UINT32_MAX
+/* default length cutoff of cache_identifier */
+#define CACHE_MAX_LEN 64
+/* default memory for the rows of fuse_identifier */
+#define FUSED_BUDGET (16 * 1024 * 1024)
+
+/* One entry of a ranking: a language, its log-probability under the
+ * model and its probability normalised over all of the model's languages.
+ */
+typedef struct {
+    const char *lang;
+    double logprob;
+    double prob;
+} LangScore;
+
+/* Options for classifying a long document from part of it. Reading stops
+ * once the best language has led the runner-up by at least margin (in
+ * log-probability) at two successive checks, or after budget bytes. A
+ * budget smaller than the document is split between positions equally
+ * spaced regions, so the sample is not just the head. A margin or budget
+ * of 0 disables that limit. Checks are made after step bytes per region,
+ * doubling each time; 0 selects EARLY_STEP.
+ */
+#define EARLY_STEP 4096
+#define EARLY_MAX_POSITIONS 64
+typedef struct {
+    double margin;
+    size_t budget;
+    unsigned positions;
+    size_t step;
+} EarlyExit;
+
 extern LanguageIdentifier *get_default_identifier(void);
 extern LanguageIdentifier *load_identifier(char*);
+extern LanguageIdentifier *try_load_identifier(const char*);
 extern void destroy_identifier(LanguageIdentifier*);
+extern LanguageIdentifier *subset_identifier(const LanguageIdentifier*, const char *[], unsigned);
 extern const char *identify(LanguageIdentifier*, char*, int);
 
+/* Score straight from the tokenizer state counts, skipping the feature
+ * counts: each state adds the weights of its features to the logprob
+ * vector itself. States with several features get a precomputed row of
+ * their summed weights, those with the most features first, using up to
+ * the given number of bytes. Scores may differ from the unfused ones by
+ * rounding. identify_batch is not affected.
+ */
+extern void fuse_identifier(LanguageIdentifier*, size_t);
+
+/* Flags for place_identifier. PLACE_HUGEPAGES copies tk_nextmove and nb_ptc
+ * into transparent huge pages, PLACE_HUGETLB into huge pages reserved with
+ * vm.nr_hugepages, falling back to transparent ones if none are free.
+ * PLACE_PREFAULT faults in every page of the model tables up front, and
+ * PLACE_MLOCK locks them in memory. Tables are handled as they stand at the
+ * call, so fuse before placing. Returns 0, or -1 if the tables could not be
+ * locked.
+ */
+#define PLACE_HUGEPAGES 1
+#define PLACE_HUGETLB 2
+#define PLACE_PREFAULT 4
+#define PLACE_MLOCK 8
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+extern int place_identifier(LanguageIdentifier*, unsigned);
+
+/* A copy of a model with its tables on the given NUMA node, sharing the
+ * class names of the original. */
+extern LanguageIdentifier *replicate_identifier(const LanguageIdentifier*, int);
+
+/* Remember the languages found by identify_r and identify_batch_r (and so
+ * identify and identify_batch) for texts of at most max_len bytes, in a
+ * cache of at most entries entries shared by all threads. Only the best
+ * language is kept, so the ranking and probability calls are not cached.
+ * get_cache_stats returns 0 if lid has no cache.
+ */
+extern void cache_identifier(LanguageIdentifier*, size_t, size_t);
+extern int get_cache_stats(const LanguageIdentifier*, CacheStats*);
+
+/* Make lid the first stage of a cascade: a text whose best language under
+ * lid leads the runner-up by less than margin (in log-probability) is
+ * classified again by full, and gets full's answer. identify_r,
+ * identify_prob_r, rank_r and identify_batch_r (and the calls built on
+ * them) cascade; the streaming and early-exit calls use lid alone. full
+ * must outlive lid, its replicas share it, and subsets of lid do not
+ * cascade. lid->ws is replaced, and other workspaces for lid must be
+ * allocated after the call. get_cascade_stats returns 0 if lid does not
+ * cascade.
+ */
+typedef struct {
+    uint64_t docs;          /* texts scored by the first stage */
+    uint64_t fallbacks;     /* of those, the texts scored again by full */
+} CascadeStats;
+#define CASCADE_MARGIN 10.0
+extern void cascade_identifier(LanguageIdentifier*, const LanguageIdentifier*, double);
+extern int get_cascade_stats(const LanguageIdentifier*, CascadeStats*);
+extern unsigned rank(LanguageIdentifier*, const char*, int, LangScore[], unsigned);
+
+/* Reentrant interface: any number of threads may call identify_r on the
+ * same LanguageIdentifier concurrently, each with its own Workspace.
+ */
+extern Workspace *alloc_workspace(const LanguageIdentifier*);
+extern void free_workspace(Workspace*);
+extern const char *identify_r(const LanguageIdentifier*, Workspace*, const char*, int);
+extern const char *identify_prob_r(const LanguageIdentifier*, Workspace*, const char*, int, double*);
+
+/* Store the k most probable languages, best first, in out and return how
+ * many were stored, which is k capped at the number of languages.
+ */
+extern unsigned rank_r(const LanguageIdentifier*, Workspace*, const char*, int, LangScore[], unsigned);
+
+/* The stages of identify_r, for benchmarking: tokenize text into the
+ * state counts sv and the feature counts fv, score fv into a logprob
+ * vector of nb_stride elements, and pick the index of the best language.
+ */
+extern void text_to_fv(const LanguageIdentifier*, const char*, int, Set*, Set*);
+extern void fv_to_logprob(const LanguageIdentifier*, Set*, double[]);
+extern int logprob_to_pred(const LanguageIdentifier*, double[]);
+
+/* Streaming interface: classify a document that arrives in pieces. After
+ * identify_begin_r, each identify_feed_r continues the tokenizer from where
+ * the previous one stopped, and identify_finish_r or rank_finish_r returns
+ * exactly what identify_r or rank_r would have for the concatenation of the
+ * pieces. Memory use does not depend on the length of the document. The
+ * Workspace holds the stream, so it must not be used for anything else in
+ * between; stream_len gives the number of bytes fed.
+ */
+extern void identify_begin_r(const LanguageIdentifier*, Workspace*);
+extern void identify_feed_r(const LanguageIdentifier*, Workspace*, const char*, size_t);
+extern const char *identify_finish_r(const LanguageIdentifier*, Workspace*);
+extern unsigned rank_finish_r(const LanguageIdentifier*, Workspace*, LangScore[], unsigned);
+
+/* As identify_r and rank_r, reading only as much of the text as opts
+ * requires and setting consumed to the number of bytes read.
+ */
+extern const char *identify_early_r(const LanguageIdentifier*, Workspace*, const char*, size_t, const EarlyExit*, size_t*);
+extern unsigned rank_early_r(const LanguageIdentifier*, Workspace*, const char*, size_t, const EarlyExit*, size_t*,
+                             LangScore[], unsigned);
+
+/* Statistics, see IdentifyStats. stats_enabled returns non-zero if they
+ * were built in. add_workspace_stats adds the counters of a Workspace to
+ * total, and add_retired_stats those of every Workspace freed so far, so
+ * the totals of a program are complete once its identifiers are destroyed.
+ */
+extern int stats_enabled(void);
+extern void add_workspace_stats(IdentifyStats*, const Workspace*);
+extern void add_retired_stats(IdentifyStats*);
+
+/* Classify n documents at once, storing the language of texts[i] in out[i].
+ * Weight rows shared between documents are fetched once per batch rather
+ * than once per document, which pays off for short texts.
+ */
+extern void identify_batch(LanguageIdentifier*, const char *[], const int[], size_t, const char *[]);
+extern void identify_batch_r(const LanguageIdentifier*, Workspace*, const char *[], const int[], size_t, const char *[]);
+
 #endif
@@ -1,16 +1,15 @@
 #ifndef _MODEL_H
 #define _MODEL_H
 
+#include <stdint.h>
+
 #define NUM_FEATS 7480
 #define NUM_LANGS 97
 #define NUM_STATES 9118
+#define NUM_BYTECLS 197
+#define NB_STRIDE 104
 
-extern unsigned tk_nextmove[NUM_STATES][256];
-extern unsigned tk_output_c[NUM_STATES];
-extern unsigned tk_output_s[NUM_STATES];
-extern unsigned tk_output[];
-extern double nb_pc[NUM_LANGS];
-extern double nb_ptc[725560];
-extern char *nb_classes[NUM_LANGS];
+/* the in-built model in the native format, from model.S */
+extern const unsigned char langid_model[], langid_model_end[];
 
 #endif
@@ -0,0 +1,184 @@
+/*
+ * A model that can be swapped while in use, see modelref.h
+ *
+ * The ModelRef keeps a global epoch, bumped by each swap. A reader entering
+ * stores the epoch in its slot and then loads the current model; leaving,
+ * it stores 0. A model replaced at epoch e may still be used by a reader
+ * whose slot holds e or less, and by no other: a reader that stored a later
+ * epoch read it after the swap, and so loaded the new model. All of these
+ * accesses are sequentially consistent, which is what makes a slot found 0
+ * by model_reclaim mean that its reader, should it enter, sees the swap.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "modelref.h"
+
+typedef struct Version Version;
+
+struct Version {
+    LanguageIdentifier *lid;
+    void *owner;
+    unsigned long serial;
+    uint_fast64_t retired;  /* the epoch it was replaced in */
+    Version *next;          /* retired ones */
+};
+
+/* on a cache line of its own, as its reader writes it for every use */
+struct ModelReader {
+    atomic_uint_fast64_t active;    /* epoch entered in, or 0 outside */
+    const Version *v;               /* the version entered, reader only */
+    ModelRef *ref;
+    ModelReader *next;
+} __attribute__((aligned(64)));
+
+struct ModelRef {
+    _Atomic(Version *) current;
+    atomic_uint_fast64_t epoch;
+    model_release release;
+
+    /* for swaps and the lists, never taken by model_enter or model_leave */
+    pthread_mutex_t lock;
+    ModelReader *readers;
+    Version *retired;
+    unsigned long serial;
+};
+
+static Version *new_version(LanguageIdentifier *lid, void *owner, unsigned long serial){
+    Version *v;
+
+    if ((v = (Version *) calloc(1, sizeof(Version))) == 0) exit(-1);
+    v->lid = lid;
+    v->owner = owner;
+    v->serial = serial;
+    return v;
+}
+
+static void release_version(ModelRef *r, Version *v){
+    if (r->release != NULL) r->release(v->owner);
+    else destroy_identifier(v->lid);
+    free(v);
+}
+
+/* Take lid as the current model. owner is what release is called with once
+ * it is no longer used; release may be NULL, see model_release. */
+ModelRef *alloc_model_ref(LanguageIdentifier *lid, void *owner, model_release release){
+    ModelRef *r;
+
+    if ((r = (ModelRef *) calloc(1, sizeof(ModelRef))) == 0) exit(-1);
+    /* epochs start at 1, as 0 marks a reader outside */
+    atomic_init(&r->epoch, 1);
+    atomic_init(&r->current, new_version(lid, owner, ++r->serial));
+    r->release = release;
+    pthread_mutex_init(&r->lock, NULL);
+    return r;
+}
+
+/* Release the current model and any retired one. Every reader must have
+ * been freed. */
+void free_model_ref(ModelRef *r){
+    Version *v;
+
+    while ((v = r->retired) != NULL) {
+        r->retired = v->next;
+        release_version(r, v);
+    }
+    release_version(r, atomic_load(&r->current));
+    pthread_mutex_destroy(&r->lock);
+    free(r);
+}
+
+/* A reader for one thread at a time, which may be handed between threads
+ * while outside model_enter and model_leave */
+ModelReader *alloc_model_reader(ModelRef *r){
+    ModelReader *rd;
+
+    if (posix_memalign((void **) &rd, 64, sizeof(ModelReader)) != 0) exit(-1);
+    atomic_init(&rd->active, 0);
+    rd->v = NULL;
+    rd->ref = r;
+    pthread_mutex_lock(&r->lock);
+    rd->next = r->readers;
+    r->readers = rd;
+    pthread_mutex_unlock(&r->lock);
+    return rd;
+}
+
+void free_model_reader(ModelReader *rd){
+    ModelRef *r = rd->ref;
+    ModelReader **p;
+
+    pthread_mutex_lock(&r->lock);
+    for (p = &r->readers; *p != rd; p = &(*p)->next);
+    *p = rd->next;
+    pthread_mutex_unlock(&r->lock);
+    free(rd);
+}
+
+/* The current model, which stays valid until model_leave */
+const LanguageIdentifier *model_enter(ModelReader *rd){
+    atomic_store(&rd->active, atomic_load(&rd->ref->epoch));
+    rd->v = atomic_load(&rd->ref->current);
+    return rd->v->lid;
+}
+
+void model_leave(ModelReader *rd){
+    atomic_store(&rd->active, 0);
+}
+
+/* The serial number of the model entered, different for every model the
+ * ModelRef has held */
+unsigned long model_version(const ModelReader *rd){
+    return rd->v->serial;
+}
+
+/* Make lid the current model, retiring the one it replaces until
+ * model_reclaim. Returns the version of lid. */
+unsigned long model_swap(ModelRef *r, LanguageIdentifier *lid, void *owner){
+    Version *v, *old;
+    unsigned long serial;
+
+    pthread_mutex_lock(&r->lock);
+    serial = ++r->serial;
+    v = new_version(lid, owner, serial);
+    old = atomic_exchange(&r->current, v);
+    old->retired = atomic_fetch_add(&r->epoch, 1);
+    old->next = r->retired;
+    r->retired = old;
+    pthread_mutex_unlock(&r->lock);
+    return serial;
+}
+
+/* Release the retired models no reader can still be using. Returns the
+ * number left, to try again later. */
+unsigned model_reclaim(ModelRef *r){
+    Version **p, *v, *done = NULL;
+    ModelReader *rd;
+    uint_fast64_t e;
+    unsigned left = 0;
+
+    pthread_mutex_lock(&r->lock);
+    for (p = &r->retired; (v = *p) != NULL; ) {
+        for (rd = r->readers; rd != NULL; rd = rd->next) {
+            e = atomic_load(&rd->active);
+            if (e != 0 && e <= v->retired) break;
+        }
+        if (rd != NULL) {
+            p = &v->next;
+            left++;
+            continue;
+        }
+        *p = v->next;
+        v->next = done;
+        done = v;
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    /* unmapping or freeing a model may take a while, so not under the lock */
+    while ((v = done) != NULL) {
+        done = v->next;
+        release_version(r, v);
+    }
+    return left;
+}
@@ -0,0 +1,41 @@
+#ifndef _MODELREF_H
+#define _MODELREF_H
+
+#include "liblangid.h"
+
+/* A model that can be replaced while threads classify with it.
+ *
+ * Each thread using the model holds a ModelReader, and brackets every use
+ * with model_enter and model_leave. These read the current model and write
+ * a word of the reader's own, so they take no lock and readers do not
+ * contend with each other. model_swap puts a new model in place at once
+ * and retires the old one: readers that entered before the swap finish on
+ * the old model, readers entering after it get the new one. A retired
+ * model is released by model_reclaim once no reader can still be using it,
+ * that is once every reader has left or entered again since (epoch-based
+ * reclamation). Results pointing into a model, such as the language names,
+ * are only valid until then, so the caller chooses when to reclaim.
+ *
+ * A Workspace fits only the model it was allocated for, so a reader holding
+ * one compares model_version after entering, and allocates another when
+ * the version changed.
+ */
+typedef struct ModelRef ModelRef;
+typedef struct ModelReader ModelReader;
+
+/* Called with the owner given for a model once the model is released, to
+ * free it along with whatever it was built from. With none, the model is
+ * freed by destroy_identifier. */
+typedef void (*model_release)(void *owner);
+
+extern ModelRef *alloc_model_ref(LanguageIdentifier *lid, void *owner, model_release release);
+extern void free_model_ref(ModelRef *r);
+extern ModelReader *alloc_model_reader(ModelRef *r);
+extern void free_model_reader(ModelReader *rd);
+extern const LanguageIdentifier *model_enter(ModelReader *rd);
+extern void model_leave(ModelReader *rd);
+extern unsigned long model_version(const ModelReader *rd);
+extern unsigned long model_swap(ModelRef *r, LanguageIdentifier *lid, void *owner);
+extern unsigned model_reclaim(ModelRef *r);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef _NATIVEMODEL_H
+#define _NATIVEMODEL_H
+
+#include <stdint.h>
+
+/* The native model format written by ldpy2ldc.py --native. Unlike the
+ * protobuf model it needs no unpacking: the file is mapped read-only and
+ * the LanguageIdentifier points straight into it. It holds the tables in
+ * exactly the form the classifier uses them; the compacted tokenizer and
+ * nb_ptc with padded rows, in any of the nb_ptc_type representations.
+ *
+ * The file starts with a NativeHeader, all fields little-endian. Each
+ * section is located by its byte offset from the start of the file and
+ * its length in bytes, and starts on a 64-byte boundary:
+ *
+ *   NATIVE_TK_BYTECLS   uint8[256]
+ *   NATIVE_TK_NEXTMOVE  uint16[num_states * num_bytecls]
+ *   NATIVE_TK_OUTPUT_C  uint32[num_states]
+ *   NATIVE_TK_OUTPUT_S  uint32[num_states]
+ *   NATIVE_TK_OUTPUT    uint32[]
+ *   NATIVE_NB_PC        double[num_langs]
+ *   NATIVE_NB_PTC       double, float or int16[num_feats * nb_stride]
+ *   NATIVE_NB_CLASSES   uint32[num_langs] offsets from the start of the
+ *                       section, followed by the NUL-terminated names
+ */
+#define NATIVE_MAGIC "LANGIDNM"
+#define NATIVE_VERSION 1
+#define NATIVE_BYTEORDER 0x01020304
+#define NATIVE_ALIGN 64
+
+enum {
+    NATIVE_TK_BYTECLS,
+    NATIVE_TK_NEXTMOVE,
+    NATIVE_TK_OUTPUT_C,
+    NATIVE_TK_OUTPUT_S,
+    NATIVE_TK_OUTPUT,
+    NATIVE_NB_PC,
+    NATIVE_NB_PTC,
+    NATIVE_NB_CLASSES,
+    NATIVE_NUM_SECTIONS
+};
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteorder;
+    uint32_t num_feats;
+    uint32_t num_langs;
+    uint32_t num_states;
+    uint32_t num_bytecls;
+    uint32_t nb_stride;
+    uint32_t nb_ptc_type;
+    double nb_ptc_scale;
+    struct {
+        uint64_t offset;
+        uint64_t size;
+    } sections[NATIVE_NUM_SECTIONS];
+} NativeHeader;
+
+#endif
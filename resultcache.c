@@ -0,0 +1,183 @@
+/*
+ * Bounded, thread-safe cache of classification results, see resultcache.h
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "resultcache.h"
+
+typedef struct {
+    uint64_t hash;          /* 0 for an empty entry */
+    uint32_t len;
+    uint16_t value;
+    uint16_t used;          /* tick of the last hit or store, within the set */
+} CacheEntry;
+
+/* a lock with the counters it protects, on a cache line of its own */
+typedef struct {
+    pthread_mutex_t lock;
+    uint64_t lookups, hits, stores, evictions;
+} __attribute__((aligned(64))) CacheShard;
+
+struct ResultCache {
+    size_t nsets, max_len;
+    CacheEntry *entries;    /* nsets * CACHE_WAYS */
+    char *keys;             /* max_len bytes per entry */
+    uint16_t *tick;         /* per set */
+    CacheShard shards[CACHE_SHARDS];
+    atomic_uint_fast64_t too_long;
+};
+
+/* 64-bit hash of a short string, eight bytes at a time, with the
+ * finalizer of MurmurHash3. Never 0, which marks an empty entry.
+ */
+static uint64_t hash_key(const char *key, size_t len){
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ (len * 0xff51afd7ed558ccdULL), w;
+    size_t i;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy(&w, key + i, 8);
+        h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    if (i < len) {
+        w = 0;
+        memcpy(&w, key + i, len - i);
+        h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h ? h : 1;
+}
+
+/* A cache of at most entries entries, rounded down to a power of two
+ * number of sets, for keys of at most max_len bytes. Values must fit 16
+ * bits.
+ */
+ResultCache *alloc_cache(size_t entries, size_t max_len){
+    ResultCache *c;
+    size_t nsets = 1;
+    unsigned i;
+
+    while (2 * nsets * CACHE_WAYS <= entries) nsets *= 2;
+    /* aligned, so that each shard has its cache line */
+    if (posix_memalign((void **) &c, 64, sizeof(ResultCache)) != 0) exit(-1);
+    memset(c, 0, sizeof(ResultCache));
+    c->nsets = nsets;
+    c->max_len = max_len;
+    if ((c->entries = (CacheEntry *) calloc(nsets * CACHE_WAYS, sizeof(CacheEntry))) == 0) exit(-1);
+    if ((c->keys = (char *) malloc(nsets * CACHE_WAYS * (max_len ? max_len : 1))) == 0) exit(-1);
+    if ((c->tick = (uint16_t *) calloc(nsets, sizeof(uint16_t))) == 0) exit(-1);
+    for (i = 0; i < CACHE_SHARDS; i++) pthread_mutex_init(&c->shards[i].lock, NULL);
+    return c;
+}
+
+void free_cache(ResultCache *c){
+    unsigned i;
+
+    for (i = 0; i < CACHE_SHARDS; i++) pthread_mutex_destroy(&c->shards[i].lock);
+    free(c->entries);
+    free(c->keys);
+    free(c->tick);
+    free(c);
+}
+
+/* Look key up, setting value on a hit. Returns non-zero on a hit. */
+int cache_get(ResultCache *c, const char *key, size_t len, unsigned *value){
+    uint64_t h;
+    size_t set;
+    CacheShard *sh;
+    CacheEntry *e;
+    unsigned w;
+    int hit = 0;
+
+    if (len > c->max_len) {
+        atomic_fetch_add_explicit(&c->too_long, 1, memory_order_relaxed);
+        return 0;
+    }
+    h = hash_key(key, len);
+    set = h & (c->nsets - 1);
+    sh = &c->shards[set % CACHE_SHARDS];
+    e = c->entries + set * CACHE_WAYS;
+
+    pthread_mutex_lock(&sh->lock);
+    sh->lookups++;
+    for (w = 0; w < CACHE_WAYS; w++) {
+        if (e[w].hash == h && e[w].len == len && memcmp(c->keys + (set * CACHE_WAYS + w) * c->max_len, key, len) == 0) {
+            e[w].used = ++c->tick[set];
+            *value = e[w].value;
+            sh->hits++;
+            hit = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return hit;
+}
+
+/* Store value under key, in place of the least recently used entry of its
+ * set if that is full. Keys longer than max_len are ignored.
+ */
+void cache_put(ResultCache *c, const char *key, size_t len, unsigned value){
+    uint64_t h;
+    size_t set;
+    CacheShard *sh;
+    CacheEntry *e;
+    unsigned w, victim = 0;
+    uint16_t age, oldest = 0;
+
+    if (len > c->max_len) return;
+    h = hash_key(key, len);
+    set = h & (c->nsets - 1);
+    sh = &c->shards[set % CACHE_SHARDS];
+    e = c->entries + set * CACHE_WAYS;
+
+    pthread_mutex_lock(&sh->lock);
+    for (w = 0; w < CACHE_WAYS; w++) {
+        /* another thread may have stored it since the miss */
+        if (e[w].hash == h && e[w].len == len && memcmp(c->keys + (set * CACHE_WAYS + w) * c->max_len, key, len) == 0) {
+            pthread_mutex_unlock(&sh->lock);
+            return;
+        }
+        if (e[w].hash == 0) {
+            victim = w;
+            break;
+        }
+        /* ages are differences of 16-bit ticks, so they survive wrapping */
+        age = c->tick[set] - e[w].used;
+        if (age >= oldest) {
+            oldest = age;
+            victim = w;
+        }
+    }
+    if (e[victim].hash != 0) sh->evictions++;
+    e[victim].hash = h;
+    e[victim].len = len;
+    e[victim].value = value;
+    e[victim].used = ++c->tick[set];
+    memcpy(c->keys + (set * CACHE_WAYS + victim) * c->max_len, key, len);
+    sh->stores++;
+    pthread_mutex_unlock(&sh->lock);
+}
+
+void cache_stats(ResultCache *c, CacheStats *st){
+    unsigned i;
+
+    memset(st, 0, sizeof(CacheStats));
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&c->shards[i].lock);
+        st->lookups += c->shards[i].lookups;
+        st->hits += c->shards[i].hits;
+        st->stores += c->shards[i].stores;
+        st->evictions += c->shards[i].evictions;
+        pthread_mutex_unlock(&c->shards[i].lock);
+    }
+    st->too_long = atomic_load_explicit(&c->too_long, memory_order_relaxed);
+    st->entries = c->nsets * CACHE_WAYS;
+    st->max_len = c->max_len;
+    st->bytes = st->entries * (CACHE_ENTRY_OVERHEAD + c->max_len);
+}
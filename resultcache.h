@@ -0,0 +1,36 @@
+#ifndef _RESULTCACHE_H
+#define _RESULTCACHE_H
+#include <stddef.h>
+#include <stdint.h>
+
+/* A bounded map from short byte strings to small values, shared by any
+ * number of threads. Keys are hashed into sets of CACHE_WAYS entries, and
+ * a full set gives up its least recently used entry. Each entry keeps a
+ * copy of its key, so a hash collision is never mistaken for a hit. The
+ * sets are split between CACHE_SHARDS locks, which also hold the counters
+ * of their shard.
+ */
+typedef struct ResultCache ResultCache;
+
+#define CACHE_WAYS 4
+#define CACHE_SHARDS 64
+
+typedef struct {
+    uint64_t lookups;       /* keys short enough to be cached */
+    uint64_t hits;
+    uint64_t stores;
+    uint64_t evictions;
+    uint64_t too_long;      /* keys longer than max_len, not looked up */
+    size_t entries, max_len, bytes;
+} CacheStats;
+
+/* per-entry memory besides the copy of the key */
+#define CACHE_ENTRY_OVERHEAD 16
+
+extern ResultCache *alloc_cache(size_t entries, size_t max_len);
+extern void free_cache(ResultCache *c);
+extern int cache_get(ResultCache *c, const char *key, size_t len, unsigned *value);
+extern void cache_put(ResultCache *c, const char *key, size_t len, unsigned value);
+extern void cache_stats(ResultCache *c, CacheStats *st);
+
+#endif
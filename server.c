@@ -0,0 +1,800 @@
+/*
+ * langid --serve: a daemon that keeps one model loaded and answers
+ * classification requests over a Unix or TCP socket.
+ *
+ * A single thread runs an epoll loop over the listening socket and the
+ * connections. Complete requests from all connections are copied into a
+ * pending batch, which is handed to a worker pool as a whole, in groups of
+ * BATCH_SIZE for identify_batch_r. As the pool runs one range at a time,
+ * requests arriving while a batch is classified gather in the next one, so
+ * batches grow with the load. A batch is submitted as soon as the pool is
+ * idle and the batch is full or its oldest request has waited max_delay;
+ * if it fills up while the pool is busy, reading stops until the pool is
+ * done. The pool signals completion on an eventfd, and the answers are
+ * appended to each connection's output in request order.
+ *
+ * SIGINT and SIGTERM finish the requests already read and exit; SIGUSR1
+ * writes the request counts and latency histograms to stderr, as does
+ * exiting. SIGHUP loads the model again, on a thread of its own, and swaps
+ * it in once it is ready; see modelref.h for how the workers change over.
+ */
+#define _GNU_SOURCE     /* accept4 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "server.h"
+#include "threadpool.h"
+
+#define MAX_EVENTS 64
+#define READ_CHUNK (64 * 1024)
+/* histograms have power-of-two buckets, the last one open-ended */
+#define HIST_BUCKETS 32
+
+/* Room for ",%zu\n" and the NUL, and for " " and ":%.6g" besides a class
+ * name, whose length is the model's to choose */
+#define ANSWER_LEN 24
+#define SCORE_LEN 16
+
+enum { H_LISTEN, H_CONN, H_DONE, H_TIMER, H_SIGNAL, H_RELOAD };
+
+/* what an epoll event refers to */
+typedef struct {
+    int fd;
+    int kind;
+} Handle;
+
+typedef struct Conn Conn;
+
+struct Conn {
+    Handle h;               /* first, so that a Handle * is a Conn * */
+    char *in;
+    size_t in_len, in_size;
+    size_t scan;            /* bytes of in already searched for a newline */
+    char *out;
+    size_t out_off, out_len, out_size;
+    unsigned inflight;      /* requests read but not yet answered */
+    unsigned long stamp;    /* serial of the last batch answering it */
+    int eof, dead;          /* no more input; socket closed */
+    int parsing;            /* its requests are being taken out of in */
+    uint32_t events;        /* epoll events currently asked for */
+    Conn *prev, *next;      /* all connections */
+    Conn *grave;            /* closed ones, freed once they are answered */
+};
+
+/* Requests classified together. Request i is buf[start[i]] .. buf[start[i+1]] */
+typedef struct {
+    char *buf;
+    size_t len, size;
+    size_t *start;
+    Conn **conn;
+    uint64_t *arrive;       /* when each request was complete, in ns */
+    const char **lang;
+    LangScore *scores;      /* nbest per request, if ranking */
+    size_t n, max;
+    unsigned nbest;
+    uint64_t submitted;
+} Batch;
+
+typedef struct {
+    uint64_t count[HIST_BUCKETS];
+    uint64_t n, sum, max;
+} Histogram;
+
+typedef struct {
+    const ServeOptions *opts;
+    ModelRef *ref;
+    ModelReader *reader;    /* for the event loop's own look at the model */
+    ThreadPool *pool;
+    int epfd;
+    Handle listen, done, timer, signal;
+    Handle reloaded;        /* an eventfd written once a reload is loaded */
+    char *unix_path;        /* to remove at exit */
+
+    /* the thread loading a model after SIGHUP, and what it loaded */
+    pthread_t loader;
+    int loading;
+    LanguageIdentifier *loaded;
+    void *loaded_owner;
+    unsigned retired;       /* replaced models not yet released */
+
+    Batch batches[2], *pending, *flight;
+    int busy, stop;
+    unsigned long serial;
+    Conn **touched;
+    Conn *conn_list, *graveyard;
+
+    uint64_t requests, batches_run, conns, open_conns, reloads;
+    Histogram queue_us, latency_us, batch_size;
+} Server;
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void hist_add(Histogram *h, uint64_t v){
+    unsigned b = 0;
+
+    while (b < HIST_BUCKETS - 1 && ((uint64_t) 1 << b) < v) b++;
+    h->count[b]++;
+    h->n++;
+    h->sum += v;
+    if (v > h->max) h->max = v;
+}
+
+/* upper bound of the bucket holding the q-th quantile */
+static uint64_t hist_quantile(const Histogram *h, double q){
+    uint64_t seen = 0;
+    unsigned b;
+
+    for (b = 0; b < HIST_BUCKETS - 1; b++) {
+        seen += h->count[b];
+        if (seen >= q * h->n) break;
+    }
+    return b < HIST_BUCKETS - 1 && ((uint64_t) 1 << b) < h->max ? (uint64_t) 1 << b : h->max;
+}
+
+static void print_histogram(const char *name, const char *unit, const Histogram *h){
+    unsigned b, first = HIST_BUCKETS, last = 0;
+
+    fprintf(stderr, "  %-10s mean %.1f, p50 <= %" PRIu64 ", p90 <= %" PRIu64 ", p99 <= %" PRIu64 ", max %" PRIu64 " %s\n",
+            name, h->n ? (double) h->sum / h->n : 0.0, hist_quantile(h, 0.5), hist_quantile(h, 0.9),
+            hist_quantile(h, 0.99), h->max, unit);
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        if (!h->count[b]) continue;
+        if (first == HIST_BUCKETS) first = b;
+        last = b;
+    }
+    for (b = first; b <= last && first < HIST_BUCKETS; b++) {
+        if (b < HIST_BUCKETS - 1)
+            fprintf(stderr, "    <= %10" PRIu64 " %s %12" PRIu64 " %5.1f%%\n", (uint64_t) 1 << b, unit,
+                    h->count[b], 100.0 * h->count[b] / h->n);
+        else
+            fprintf(stderr, "     > %10" PRIu64 " %s %12" PRIu64 " %5.1f%%\n", (uint64_t) 1 << (b - 1), unit,
+                    h->count[b], 100.0 * h->count[b] / h->n);
+    }
+}
+
+/* Report the requests served so far on stderr. queue is the time from a
+ * request being read to its batch being submitted, latency the time to
+ * its answer being ready to send.
+ */
+static void print_report(const Server *s){
+    const LanguageIdentifier *lid;
+    CacheStats cs;
+    CascadeStats ks;
+
+    fprintf(stderr, "langid serve: %" PRIu64 " requests, %" PRIu64 " connections (%" PRIu64 " open), "
+            "%" PRIu64 " batches, %.1f requests/batch\n", s->requests, s->conns, s->open_conns, s->batches_run,
+            s->batches_run ? (double) s->requests / s->batches_run : 0.0);
+    print_histogram("queue", "us", &s->queue_us);
+    print_histogram("latency", "us", &s->latency_us);
+    print_histogram("batch", "reqs", &s->batch_size);
+    if (s->reloads)
+        fprintf(stderr, "  reloads    %" PRIu64 ", the counts below are for the current model\n", s->reloads);
+    lid = model_enter(s->reader);
+    if (get_cache_stats(lid, &cs))
+        fprintf(stderr, "  cache      %" PRIu64 " hits of %" PRIu64 " lookups (%.1f%%), %" PRIu64 " evictions\n",
+                cs.hits, cs.lookups, cs.lookups ? 100.0 * cs.hits / cs.lookups : 0.0, cs.evictions);
+    if (get_cascade_stats(lid, &ks))
+        fprintf(stderr, "  cascade    %" PRIu64 " of %" PRIu64 " texts scored again (%.1f%%)\n",
+                ks.fallbacks, ks.docs, ks.docs ? 100.0 * ks.fallbacks / ks.docs : 0.0);
+    model_leave(s->reader);
+}
+
+static void reserve(char **buf, size_t *size, size_t need){
+    if (need <= *size) return;
+    while (*size < need) *size = *size ? 2 * *size : READ_CHUNK;
+    if ((*buf = (char *) realloc(*buf, *size)) == 0) exit(-1);
+}
+
+static void init_batch(Batch *b, size_t max, unsigned nbest){
+    memset(b, 0, sizeof(Batch));
+    b->max = max;
+    b->nbest = nbest;
+    if ((b->start = (size_t *) malloc((max + 1) * sizeof(size_t))) == 0) exit(-1);
+    if ((b->conn = (Conn **) malloc(max * sizeof(Conn *))) == 0) exit(-1);
+    if ((b->arrive = (uint64_t *) malloc(max * sizeof(uint64_t))) == 0) exit(-1);
+    if ((b->lang = (const char **) malloc(max * sizeof(char *))) == 0) exit(-1);
+    if (nbest && (b->scores = (LangScore *) malloc(max * nbest * sizeof(LangScore))) == 0) exit(-1);
+    b->start[0] = 0;
+}
+
+static void free_batch(Batch *b){
+    free(b->buf);
+    free(b->start);
+    free(b->conn);
+    free(b->arrive);
+    free(b->lang);
+    free(b->scores);
+}
+
+/* Classify the i-th group of BATCH_SIZE requests of a batch */
+static void answer_requests(void *arg, const LanguageIdentifier *lid, Workspace *ws, size_t i){
+    Batch *b = (Batch *) arg;
+    const char *texts[BATCH_SIZE];
+    int lens[BATCH_SIZE];
+    size_t first = i * BATCH_SIZE, n = b->n - first < BATCH_SIZE ? b->n - first : BATCH_SIZE, j;
+
+    for (j = 0; j < n; j++) {
+        texts[j] = b->buf + b->start[first+j];
+        lens[j] = b->start[first+j+1] - b->start[first+j];
+    }
+    if (b->nbest) {
+        for (j = 0; j < n; j++) rank_r(lid, ws, texts[j], lens[j], b->scores + (first+j) * b->nbest, b->nbest);
+        return;
+    }
+    identify_batch_r(lid, ws, texts, lens, n, b->lang + first);
+}
+
+static void watch(Server *s, Handle *h, uint32_t events, int op){
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.ptr = h;
+    if (epoll_ctl(s->epfd, op, h->fd, &ev) == -1) {
+        fprintf(stderr, "epoll_ctl failed: %s\n", strerror(errno));
+        exit(-1);
+    }
+}
+
+/* Ask for input unless the peer has finished sending, and for output while
+ * some is waiting to be written */
+static void update_events(Server *s, Conn *c){
+    uint32_t events = (c->eof ? 0 : EPOLLIN) | (c->out_len > c->out_off ? EPOLLOUT : 0);
+
+    if (events != c->events) {
+        c->events = events;
+        watch(s, &c->h, events, EPOLL_CTL_MOD);
+    }
+}
+
+/* Close the socket of c. The Conn itself stays until the end of the
+ * round of events, and until no request of it is left in a batch, as
+ * either may still refer to it. */
+static void close_conn(Server *s, Conn *c){
+    if (c->dead) return;
+    close(c->h.fd);
+    c->h.fd = -1;
+    c->dead = 1;
+    s->open_conns--;
+    c->grave = s->graveyard;
+    s->graveyard = c;
+}
+
+static void free_conn(Server *s, Conn *c){
+    if (c->prev) c->prev->next = c->next;
+    else s->conn_list = c->next;
+    if (c->next) c->next->prev = c->prev;
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+/* Free the closed connections that have no request left in a batch */
+static void sweep_conns(Server *s){
+    Conn **p = &s->graveyard, *c;
+
+    while ((c = *p) != NULL) {
+        if (c->inflight) {
+            p = &c->grave;
+            continue;
+        }
+        *p = c->grave;
+        free_conn(s, c);
+    }
+}
+
+/* Read and discard the count of an eventfd or timerfd */
+static void drain(int fd){
+    uint64_t count;
+
+    while (read(fd, &count, sizeof(count)) > 0);
+}
+
+/* Write as much of c's output as the socket takes. Returns -1 if c was
+ * closed. */
+static int flush_conn(Server *s, Conn *c){
+    ssize_t n;
+
+    while (c->out_off < c->out_len) {
+        n = send(c->h.fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n == -1) {
+            close_conn(s, c);
+            return -1;
+        }
+        c->out_off += n;
+    }
+    if (c->out_off == c->out_len) c->out_off = c->out_len = 0;
+
+    /* every request answered and written: nothing more can happen */
+    if (c->eof && !c->parsing && c->inflight == 0 && c->out_len == 0) {
+        close_conn(s, c);
+        return -1;
+    }
+    update_events(s, c);
+    return 0;
+}
+
+static void append_answer(Conn *c, const Batch *b, size_t i){
+    size_t len = b->start[i+1] - b->start[i], need = ANSWER_LEN, n;
+    const LangScore *scores = NULL;
+    unsigned k;
+
+    /* the exact bound, so that nothing formatted below is cut short */
+    if (!b->nbest) need += strlen(b->lang[i]);
+    else {
+        scores = b->scores + i * b->nbest;
+        for (k = 0; k < b->nbest; k++) need += strlen(scores[k].lang) + SCORE_LEN;
+    }
+    reserve(&c->out, &c->out_size, c->out_len + need);
+    if (!b->nbest) {
+        n = snprintf(c->out + c->out_len, need, "%s,%zu\n", b->lang[i], len);
+    }
+    else {
+        for (k = 0, n = 0; k < b->nbest; k++)
+            n += snprintf(c->out + c->out_len + n, need - n, k ? " %s:%.6g" : "%s:%.6g", scores[k].lang, scores[k].prob);
+        n += snprintf(c->out + c->out_len + n, need - n, ",%zu\n", len);
+    }
+    c->out_len += n;
+}
+
+/* Wait for the batch in flight, and hand its answers to the connections */
+static void complete_batch(Server *s){
+    Batch *b = s->flight;
+    size_t i, ntouched = 0;
+    uint64_t t;
+    Conn *c;
+
+    pool_wait(s->pool);
+    /* the pool has signalled by now; take it so that the event is not
+     * mistaken for the next batch */
+    drain(s->done.fd);
+    s->busy = 0;
+    s->serial++;
+
+    t = now_ns();
+    for (i = 0; i < b->n; i++) {
+        c = b->conn[i];
+        c->inflight--;
+        if (c->stamp != s->serial) {
+            c->stamp = s->serial;
+            s->touched[ntouched++] = c;
+        }
+        if (!c->dead) append_answer(c, b, i);
+        hist_add(&s->latency_us, (t - b->arrive[i]) / 1000);
+    }
+    for (i = 0; i < ntouched; i++)
+        if (!s->touched[i]->dead) flush_conn(s, s->touched[i]);
+    b->n = b->len = 0;
+
+    /* its answers are copied out, and the workers have left the models
+     * they used for it */
+    if (s->retired) s->retired = model_reclaim(s->ref);
+}
+
+static void submit_batch(Server *s){
+    Batch *b = s->pending;
+    size_t i;
+
+    s->pending = s->flight;
+    s->flight = b;
+    b->submitted = now_ns();
+    for (i = 0; i < b->n; i++) hist_add(&s->queue_us, (b->submitted - b->arrive[i]) / 1000);
+    hist_add(&s->batch_size, b->n);
+    s->batches_run++;
+    s->busy = 1;
+    pool_submit(s->pool, answer_requests, b, (b->n + BATCH_SIZE - 1) / BATCH_SIZE);
+}
+
+/* Copy a request of c into the pending batch, making room for it first if
+ * the batch is full */
+static void add_request(Server *s, Conn *c, const char *text, size_t len, uint64_t t){
+    Batch *b = s->pending;
+
+    if (b->n == b->max) {
+        if (s->busy) complete_batch(s);
+        submit_batch(s);
+        b = s->pending;
+    }
+    reserve(&b->buf, &b->size, b->len + len);
+    memcpy(b->buf + b->len, text, len);
+    b->len += len;
+    b->conn[b->n] = c;
+    b->arrive[b->n] = t;
+    b->start[++b->n] = b->len;
+    c->inflight++;
+    s->requests++;
+}
+
+/* Take the complete requests out of c's input. Returns -1 if c sent a
+ * request that is too long, or a malformed one. */
+static int parse_requests(Server *s, Conn *c, uint64_t t){
+    size_t pos = 0, len;
+    const unsigned char *p;
+    char *nl;
+
+    if (s->opts->framing == SERVE_LINES) {
+        while ((nl = memchr(c->in + c->scan, '\n', c->in_len - c->scan)) != NULL) {
+            c->scan = nl - c->in + 1;
+            add_request(s, c, c->in + pos, c->scan - pos, t);
+            pos = c->scan;
+        }
+        c->scan = c->in_len;
+        /* a final line without a newline is a request too, as in -l */
+        if (c->eof && pos < c->in_len) {
+            add_request(s, c, c->in + pos, c->in_len - pos, t);
+            pos = c->in_len;
+        }
+        if (c->in_len - pos > SERVE_MAX_REQUEST) return -1;
+    }
+    else {
+        while (c->in_len - pos >= 4) {
+            p = (const unsigned char *) c->in + pos;
+            len = (size_t) p[0] << 24 | (size_t) p[1] << 16 | (size_t) p[2] << 8 | p[3];
+            if (len > SERVE_MAX_REQUEST) return -1;
+            if (c->in_len - pos - 4 < len) break;
+            add_request(s, c, c->in + pos + 4, len, t);
+            pos += 4 + len;
+        }
+        if (c->eof && pos < c->in_len) return -1;
+    }
+
+    if (pos) {
+        memmove(c->in, c->in + pos, c->in_len - pos);
+        c->in_len -= pos;
+        c->scan -= pos;
+    }
+    return 0;
+}
+
+static void read_conn(Server *s, Conn *c){
+    ssize_t n;
+    int status;
+
+    reserve(&c->in, &c->in_size, c->in_len + READ_CHUNK);
+    n = read(c->h.fd, c->in + c->in_len, c->in_size - c->in_len);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+    if (n == -1) {
+        close_conn(s, c);
+        return;
+    }
+    if (n == 0) c->eof = 1;
+    c->in_len += n;
+
+    /* taking a request may complete a batch, which must not close c */
+    c->parsing = 1;
+    status = parse_requests(s, c, now_ns());
+    c->parsing = 0;
+    if (c->dead) return;
+    if (status != 0) {
+        fprintf(stderr, "langid serve: closing a connection after a malformed or oversized request\n");
+        close_conn(s, c);
+        return;
+    }
+    flush_conn(s, c);
+}
+
+static void accept_conns(Server *s){
+    Conn *c;
+    int fd, one = 1;
+
+    while ((fd = accept4(s->listen.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+        /* answers are small and should not wait for more to fill a segment */
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if ((c = (Conn *) calloc(1, sizeof(Conn))) == 0) exit(-1);
+        c->h.fd = fd;
+        c->h.kind = H_CONN;
+        c->events = EPOLLIN;
+        watch(s, &c->h, c->events, EPOLL_CTL_ADD);
+        c->next = s->conn_list;
+        if (c->next) c->next->prev = c;
+        s->conn_list = c;
+        s->conns++;
+        s->open_conns++;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+        fprintf(stderr, "langid serve: accept failed: %s\n", strerror(errno));
+}
+
+/* Bind a listening socket to addr: unix:PATH or a PATH containing '/' for
+ * a Unix socket, otherwise [HOST:]PORT. Returns -1 on failure. */
+static int open_listener(Server *s, const char *addr){
+    struct addrinfo hints, *res, *ai;
+    struct sockaddr_un sun;
+    struct stat st;
+    char host[256];
+    const char *port, *path = NULL;
+    int fd = -1, one = 1, err;
+
+    if (strncmp(addr, "unix:", 5) == 0) path = addr + 5;
+    else if (strchr(addr, '/') != NULL) path = addr;
+
+    if (path != NULL) {
+        if (strlen(path) >= sizeof(sun.sun_path)) {
+            fprintf(stderr, "socket path too long: %s\n", path);
+            return -1;
+        }
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strcpy(sun.sun_path, path);
+        /* replace a socket left behind by an earlier server, but nothing else */
+        if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+        if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1
+            || bind(fd, (struct sockaddr *) &sun, sizeof(sun)) == -1 || listen(fd, SOMAXCONN) == -1) {
+            fprintf(stderr, "unable to listen on %s: %s\n", path, strerror(errno));
+            if (fd != -1) close(fd);
+            return -1;
+        }
+        if ((s->unix_path = strdup(path)) == 0) exit(-1);
+        return fd;
+    }
+
+    /* [HOST:]PORT, with the last colon separating them so that a bare IPv6
+     * address in brackets works */
+    host[0] = '\0';
+    if ((port = strrchr(addr, ':')) != NULL) {
+        if ((size_t) (port - addr) >= sizeof(host)) {
+            fprintf(stderr, "invalid address: %s\n", addr);
+            return -1;
+        }
+        memcpy(host, addr, port - addr);
+        host[port - addr] = '\0';
+        port++;
+        if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+            memmove(host, host + 1, strlen(host));
+            host[strlen(host) - 1] = '\0';
+        }
+    }
+    else port = addr;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if ((err = getaddrinfo(host[0] ? host : NULL, port, &hints, &res)) != 0) {
+        fprintf(stderr, "invalid address %s: %s\n", addr, gai_strerror(err));
+        return -1;
+    }
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol)) == -1) continue;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd == -1) fprintf(stderr, "unable to listen on %s: %s\n", addr, strerror(errno));
+    return fd;
+}
+
+/* Arm the timer for when the oldest pending request has waited max_delay */
+static void arm_timer(Server *s, uint64_t deadline){
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = deadline / 1000000000;
+    its.it_value.tv_nsec = deadline % 1000000000;
+    timerfd_settime(s->timer.fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void *load_model(void *arg){
+    Server *s = (Server *) arg;
+    uint64_t one = 1;
+
+    s->loaded = s->opts->reload(s->opts->reload_arg, &s->loaded_owner);
+    if (write(s->reloaded.fd, &one, sizeof(one)) != sizeof(one))
+        fprintf(stderr, "unable to signal the end of a reload\n");
+    return NULL;
+}
+
+/* Start loading a model, in the background so that requests are still
+ * answered meanwhile */
+static void start_reload(Server *s){
+    /* the replicas of a NUMA pool are copies of the model it started with */
+    if (s->opts->reload == NULL || s->opts->numa) {
+        fprintf(stderr, "langid serve: this model cannot be reloaded\n");
+        return;
+    }
+    if (s->loading) {
+        fprintf(stderr, "langid serve: already reloading\n");
+        return;
+    }
+    fprintf(stderr, "langid serve: reloading the model\n");
+    if (pthread_create(&s->loader, NULL, load_model, s) != 0) {
+        fprintf(stderr, "langid serve: unable to start loading a model\n");
+        return;
+    }
+    s->loading = 1;
+}
+
+/* Swap in the model loaded. Batches submitted from now on are classified
+ * with it; the one in flight, if any, goes on with the model it has. */
+static void finish_reload(Server *s){
+    drain(s->reloaded.fd);
+    if (!s->loading) return;
+    pthread_join(s->loader, NULL);
+    s->loading = 0;
+    if (s->loaded == NULL) {
+        fprintf(stderr, "langid serve: keeping the current model\n");
+        return;
+    }
+    model_swap(s->ref, s->loaded, s->loaded_owner);
+    s->loaded = NULL;
+    /* the answers of a batch in flight point into the model it used, so
+     * that one is only released once they are written out */
+    s->retired = s->busy ? 1 : model_reclaim(s->ref);
+    s->reloads++;
+    fprintf(stderr, "langid serve: reloaded the model\n");
+}
+
+static void handle_signal(Server *s){
+    struct signalfd_siginfo si;
+
+    while (read(s->signal.fd, &si, sizeof(si)) == sizeof(si)) {
+        if (si.ssi_signo == SIGUSR1) print_report(s);
+        else if (si.ssi_signo == SIGHUP) start_reload(s);
+        else if (!s->stop) {
+            /* stop taking new connections; those open get their answers */
+            s->stop = 1;
+            close(s->listen.fd);
+            s->listen.fd = -1;
+        }
+    }
+}
+
+/* Run the server until SIGINT or SIGTERM, on the current model of ref and
+ * those swapped in by SIGHUP. Returns non-zero if it could not be started.
+ */
+int serve(ModelRef *ref, const ServeOptions *opts){
+    struct epoll_event events[MAX_EVENTS];
+    Server s;
+    sigset_t mask, old;
+    uint64_t deadline;
+    Handle *h;
+    int i, n;
+
+    memset(&s, 0, sizeof(s));
+    s.opts = opts;
+    s.ref = ref;
+    s.listen.kind = H_LISTEN;
+    s.done.kind = H_DONE;
+    s.timer.kind = H_TIMER;
+    s.signal.kind = H_SIGNAL;
+    s.reloaded.kind = H_RELOAD;
+    if ((s.listen.fd = open_listener(&s, opts->addr)) == -1) return 1;
+
+    /* the signals are taken through a signalfd, so they must be blocked in
+     * every thread, the workers included */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, &old);
+
+    if ((s.epfd = epoll_create1(EPOLL_CLOEXEC)) == -1
+        || (s.done.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1
+        || (s.reloaded.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1
+        || (s.timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1
+        || (s.signal.fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1) {
+        fprintf(stderr, "unable to set up the event loop: %s\n", strerror(errno));
+        exit(-1);
+    }
+    watch(&s, &s.listen, EPOLLIN, EPOLL_CTL_ADD);
+    watch(&s, &s.done, EPOLLIN, EPOLL_CTL_ADD);
+    watch(&s, &s.timer, EPOLLIN, EPOLL_CTL_ADD);
+    watch(&s, &s.signal, EPOLLIN, EPOLL_CTL_ADD);
+    watch(&s, &s.reloaded, EPOLLIN, EPOLL_CTL_ADD);
+
+    init_batch(&s.batches[0], opts->max_batch, opts->nbest);
+    init_batch(&s.batches[1], opts->max_batch, opts->nbest);
+    s.pending = &s.batches[0];
+    s.flight = &s.batches[1];
+    if ((s.touched = (Conn **) malloc(opts->max_batch * sizeof(Conn *))) == 0) exit(-1);
+
+    s.reader = alloc_model_reader(ref);
+    if (opts->numa) {
+        /* which is then never swapped, see start_reload */
+        s.pool = alloc_numa_pool(model_enter(s.reader), opts->nthreads);
+        model_leave(s.reader);
+    }
+    else s.pool = alloc_ref_pool(ref, opts->nthreads);
+    pool_notify(s.pool, s.done.fd);
+    fprintf(stderr, "langid serve: listening on %s with %u worker%s\n", opts->addr, opts->nthreads,
+            opts->nthreads == 1 ? "" : "s");
+
+    while (!s.stop || s.busy || s.pending->n) {
+        n = epoll_wait(s.epfd, events, MAX_EVENTS, -1);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) {
+            fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+            exit(-1);
+        }
+        for (i = 0; i < n; i++) {
+            h = (Handle *) events[i].data.ptr;
+            switch (h->kind) {
+              case H_LISTEN:
+                if (s.listen.fd != -1) accept_conns(&s);
+                break;
+              case H_DONE:
+                if (s.busy) complete_batch(&s);
+                else drain(s.done.fd);
+                break;
+              case H_TIMER:
+                drain(s.timer.fd);
+                break;
+              case H_SIGNAL:
+                handle_signal(&s);
+                break;
+              case H_RELOAD:
+                finish_reload(&s);
+                break;
+              case H_CONN:
+                /* one closed earlier in this round is still allocated */
+                if (((Conn *) h)->dead) break;
+                if (events[i].events & EPOLLERR) close_conn(&s, (Conn *) h);
+                else if (!((Conn *) h)->eof && events[i].events & (EPOLLIN | EPOLLHUP)) read_conn(&s, (Conn *) h);
+                /* hung up after sending everything: nobody to answer */
+                else if (events[i].events & EPOLLHUP) close_conn(&s, (Conn *) h);
+                else if (events[i].events & EPOLLOUT) flush_conn(&s, (Conn *) h);
+                break;
+            }
+        }
+        sweep_conns(&s);
+
+        if (s.busy || !s.pending->n) continue;
+        deadline = s.pending->arrive[0] + (uint64_t) opts->max_delay_us * 1000;
+        if (s.stop || s.pending->n >= s.pending->max || now_ns() >= deadline) submit_batch(&s);
+        else arm_timer(&s, deadline);
+    }
+
+    pool_notify(s.pool, -1);
+    free_pool(s.pool);
+    print_report(&s);
+    /* a model still loading is swapped in all the same, for the caller to
+     * release with ref */
+    if (s.loading) finish_reload(&s);
+    free_model_reader(s.reader);
+
+    while (s.conn_list != NULL) {
+        close_conn(&s, s.conn_list);
+        free_conn(&s, s.conn_list);
+    }
+
+    close(s.epfd);
+    close(s.done.fd);
+    close(s.timer.fd);
+    close(s.signal.fd);
+    close(s.reloaded.fd);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (s.unix_path != NULL) {
+        unlink(s.unix_path);
+        free(s.unix_path);
+    }
+    free_batch(&s.batches[0]);
+    free_batch(&s.batches[1]);
+    free(s.touched);
+    return 0;
+}
@@ -0,0 +1,41 @@
+#ifndef _SERVER_H
+#define _SERVER_H
+
+#include <stddef.h>
+#include "liblangid.h"
+#include "modelref.h"
+
+/* How requests are delimited on a connection. SERVE_LINES takes each line
+ * as a document, newline included, as langid -l does. SERVE_LENGTH takes a
+ * 4-byte big-endian length followed by that many bytes, so documents may
+ * hold newlines. Either way each answer is one line, in request order.
+ */
+#define SERVE_LINES 0
+#define SERVE_LENGTH 1
+
+/* longest request accepted; a connection sending a longer one is closed */
+#define SERVE_MAX_REQUEST (64 * 1024 * 1024)
+
+/* defaults for --max-batch and --max-delay. With no delay, requests only
+ * share a batch if they arrive while the previous one is classified. */
+#define SERVE_BATCH 1024
+#define SERVE_DELAY_US 0
+
+typedef struct {
+    const char *addr;       /* unix:PATH, a PATH containing '/', or [HOST:]PORT */
+    int framing;            /* SERVE_LINES or SERVE_LENGTH */
+    size_t max_batch;       /* most requests classified together */
+    unsigned max_delay_us;  /* longest a request waits for its batch to fill */
+    unsigned nbest;         /* if set, answer with the top nbest languages */
+    unsigned nthreads;
+    int numa;               /* a model replica per NUMA node, as alloc_numa_pool */
+    /* if set, SIGHUP has a thread call reload(reload_arg, &owner) for a new
+     * model, which is swapped in for the current one, see modelref.h. It
+     * returns NULL, having said why, if there is none to be had. */
+    LanguageIdentifier *(*reload)(void *arg, void **owner);
+    void *reload_arg;
+} ServeOptions;
+
+extern int serve(ModelRef *ref, const ServeOptions *opts);
+
+#endif
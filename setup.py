@@ -1,11 +1,39 @@
-from distutils.core import setup, Extension
+"""
+Build the _langid extension. By default it uses the in-built model from
+model.bin, assembled by model.S; pass --model=PATH to make a protocol-buffer or native model file
+the default instead. Any model file can also be loaded at run time with
+_langid.load_model.
+"""
+import sys
+
+try:
+    from setuptools import setup, Extension
+    from setuptools.command.build_ext import build_ext
+except ImportError:
+    from distutils.core import setup, Extension
+    from distutils.command.build_ext import build_ext
+
+class build_ext_asm(build_ext):
+    """Let the C compiler assemble model.S, which includes model.bin."""
+    def build_extensions(self):
+        self.compiler.src_extensions.append('.S')
+        build_ext.build_extensions(self)
+
+define_macros = []
+for arg in list(sys.argv):
+    if arg.startswith('--model='):
+        sys.argv.remove(arg)
+        define_macros.append(('LANGID_DEFAULT_MODEL', '"{}"'.format(arg.split('=', 1)[1])))
 
 langid = Extension("_langid", 
                    language = 'c',
-                   libraries = ['protobuf-c'],
-                   sources = ["_langid.c", "liblangid.c", "model.c", "sparseset.c", "langid.pb-c.c"],
+                   libraries = ['protobuf-c', 'm'],
+                   define_macros = define_macros,
+                   sources = ["_langid.c", "liblangid.c", "model.S", "sparseset.c", "kernels.c", "resultcache.c", "modelref.c", "langid.pb-c.c"],
                    )
 
 setup(
+    name="langid",
     ext_modules=[langid],
+    cmdclass={'build_ext': build_ext_asm},
 )
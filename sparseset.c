@@ -14,43 +14,24 @@ Set *alloc_set(size_t size){
     if ( (void *)(s = (Set *) malloc(sizeof(Set))) == 0 ) exit(-1);
 
     s->members=0;
-    if ( (void *)(s->sparse = (unsigned *) malloc(size * sizeof(unsigned))) == 0 ) exit(-1);
-    if ( (void *)(s->dense  = (unsigned *) malloc(size * sizeof(unsigned))) == 0 ) exit(-1);
-    if ( (void *)(s->counts = (unsigned *) malloc(size * sizeof(unsigned))) == 0 ) exit(-1);
+    s->sparse16 = NULL;
+    s->sparse32 = NULL;
+    /* never empty, so that posix_memalign returns a pointer to free */
+    if (size == 0) size = 1;
+    if (posix_memalign((void **) &s->dense, 64, size * sizeof(SetEntry)) != 0) exit(-1);
+    if (size <= SET_SPARSE16) {
+        if (posix_memalign((void **) &s->sparse16, 64, size * sizeof(uint16_t)) != 0) exit(-1);
+    }
+    else {
+        if (posix_memalign((void **) &s->sparse32, 64, size * sizeof(unsigned)) != 0) exit(-1);
+    }
 
     return s;
 }
 
 void free_set(Set * s){
-    free(s->sparse);
+    free(s->sparse16);
+    free(s->sparse32);
     free(s->dense);
-    free(s->counts);
     free(s);
 }
-
-void clear(Set *s) {
-    s->members = 0;
-} 
-
-unsigned get(Set *s, unsigned key) {
-    unsigned index = s->sparse[key];
-    if (index < s->members && s->dense[index] == key) {
-        return s->counts[index];
-    }
-    else {
-        return 0;
-    }
-}
-
-void add(Set *s, unsigned key, unsigned val){
-    unsigned index = s->sparse[key];
-    if (index < s->members && s->dense[index] == key) {
-        s->counts[index] += val;
-    }
-    else {
-        index = s->members++;
-        s->sparse[key] = index;
-        s->dense[index] = key;
-        s->counts[index] = val;
-    }
-}
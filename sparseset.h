@@ -1,17 +1,66 @@
 #ifndef _SPARSESET_H
 #define _SPARSESET_H
 #include <stdlib.h>
+#include <stdint.h>
+
+/* A counting set of keys below a fixed size. Clearing it is O(1): a key
+ * is a member only if its slot in sparse points at an entry of dense that
+ * holds it back. Each member's key and count are kept together, so an add
+ * touches a single entry of dense besides the slot in sparse, and sparse
+ * holds 16-bit indices whenever the size of the set allows. Both arrays
+ * are cache-line aligned.
+ */
+typedef struct {
+    unsigned key;
+    unsigned count;
+} SetEntry;
 
 typedef struct {
     unsigned members;
-    unsigned *sparse;
-    unsigned *dense;
-    unsigned *counts;
+    SetEntry *dense;
+    /* only one is set; sparse16 if the size is at most SET_SPARSE16 */
+    uint16_t *sparse16;
+    unsigned *sparse32;
 } Set;
 
+#define SET_SPARSE16 65536
+
 extern Set *alloc_set(size_t size);
 extern void free_set(Set *s);
-extern void clear(Set *s);
-extern void add(Set *s, unsigned key, unsigned val);
+
+static inline void clear(Set *s) {
+    s->members = 0;
+}
+
+/* Index of key in dense, or members if it is not in the set */
+static inline unsigned find(const Set *s, unsigned key){
+    unsigned index = s->sparse16 ? s->sparse16[key] : s->sparse32[key];
+    return index < s->members && s->dense[index].key == key ? index : s->members;
+}
+
+/* Insert key with a count of 0 if it is not already a member, and return
+ * its index in dense.
+ */
+static inline unsigned add_key(Set *s, unsigned key){
+    unsigned index = find(s, key);
+
+    if (index == s->members) {
+        s->members++;
+        if (s->sparse16) s->sparse16[key] = index;
+        else s->sparse32[key] = index;
+        s->dense[index].key = key;
+        s->dense[index].count = 0;
+    }
+    return index;
+}
+
+static inline void add(Set *s, unsigned key, unsigned val){
+    s->dense[add_key(s, key)].count += val;
+}
+
+static inline unsigned get(const Set *s, unsigned key){
+    unsigned index = find(s, key);
+    return index < s->members ? s->dense[index].count : 0;
+}
 
 #endif
@@ -0,0 +1,240 @@
+/*
+ * Minimal worker pool for running identify_r over ranges of documents.
+ *
+ * Only one range is in flight at a time: pool_submit hands a range to the
+ * workers and returns immediately, pool_wait blocks until every item of it
+ * has been processed. Callers use the gap between the two to overlap I/O
+ * with classification.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#ifdef LANGID_NUMA
+#include <numa.h>
+#endif
+#include "threadpool.h"
+
+typedef struct {
+    ThreadPool *pool;
+    pthread_t thread;
+    const LanguageIdentifier *lid;  /* the pool's model, its node's replica or the one entered */
+    Workspace *ws;
+    ModelReader *reader;            /* with a ModelRef, the model is read through this */
+    unsigned long version;          /* of the model ws was allocated for */
+    int node;                       /* NUMA node to run on, or -1 */
+} Worker;
+
+struct ThreadPool {
+    ModelRef *ref;      /* if set, where the model is taken from for each range */
+    unsigned nthreads;
+    Worker *workers;
+    /* per-node replicas of lid, if any */
+    LanguageIdentifier **replicas;
+    int nnodes;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_cv, done_cv;
+
+    /* current range, protected by lock except for next */
+    pool_task fn;
+    void *arg;
+    size_t n, grain;
+    atomic_size_t next;
+    unsigned long generation;
+    unsigned active;
+    int shutdown;
+    int notify_fd;      /* eventfd written when a range completes, or -1 */
+};
+
+static void *worker_main(void *p){
+    Worker *w = (Worker *) p;
+    ThreadPool *pool = w->pool;
+    unsigned long seen = 0;
+    uint64_t one = 1;
+    size_t i, end;
+
+#ifdef LANGID_NUMA
+    if (w->node >= 0) numa_run_on_node(w->node);
+#endif
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->shutdown && pool->generation == seen)
+            pthread_cond_wait(&pool->work_cv, &pool->lock);
+        if (pool->shutdown) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        /* a model swapped in since the last range needs a Workspace of its own */
+        if (pool->ref != NULL) {
+            w->lid = model_enter(w->reader);
+            if (model_version(w->reader) != w->version) {
+                free_workspace(w->ws);
+                w->ws = alloc_workspace(w->lid);
+                w->version = model_version(w->reader);
+            }
+        }
+
+        /* claim items in small chunks until the range is exhausted */
+        while ((i = atomic_fetch_add(&pool->next, pool->grain)) < pool->n) {
+            end = i + pool->grain < pool->n ? i + pool->grain : pool->n;
+            for (; i < end; i++) pool->fn(pool->arg, w->lid, w->ws, i);
+        }
+        if (pool->ref != NULL) model_leave(w->reader);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->active == 0) {
+            pthread_cond_signal(&pool->done_cv);
+            /* written under the lock, so it is there once pool_wait returns */
+            if (pool->notify_fd >= 0 && write(pool->notify_fd, &one, sizeof(one)) != sizeof(one))
+                fprintf(stderr, "unable to signal the completion of a range\n");
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static ThreadPool *start_pool(const LanguageIdentifier *lid, ModelRef *ref, unsigned nthreads, const int *nodes, int nnodes){
+    ThreadPool *p;
+    unsigned i;
+    int n;
+
+    if (nthreads == 0) nthreads = 1;
+    if ((p = (ThreadPool *) calloc(1, sizeof(ThreadPool))) == 0) exit(-1);
+    if ((p->workers = (Worker *) calloc(nthreads, sizeof(Worker))) == 0) exit(-1);
+
+    p->ref = ref;
+    p->nthreads = nthreads;
+    p->notify_fd = -1;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work_cv, NULL);
+    pthread_cond_init(&p->done_cv, NULL);
+
+    if (nnodes > 0) {
+        if ((p->replicas = (LanguageIdentifier **) calloc(nnodes, sizeof(LanguageIdentifier *))) == 0) exit(-1);
+        p->nnodes = nnodes;
+        for (n = 0; n < nnodes; n++) p->replicas[n] = replicate_identifier(lid, nodes[n]);
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        Worker *w = &p->workers[i];
+
+        w->pool = p;
+        /* spread the workers over the nodes round-robin */
+        w->node = nnodes > 0 ? nodes[i % nnodes] : -1;
+        w->lid = nnodes > 0 ? p->replicas[i % nnodes] : lid;
+        if (ref != NULL) {
+            w->reader = alloc_model_reader(ref);
+            w->lid = model_enter(w->reader);
+            w->version = model_version(w->reader);
+        }
+        w->ws = alloc_workspace(w->lid);
+        if (ref != NULL) model_leave(w->reader);
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+            fprintf(stderr, "unable to start worker thread\n");
+            exit(-1);
+        }
+    }
+
+    return p;
+}
+
+ThreadPool *alloc_pool(const LanguageIdentifier *lid, unsigned nthreads){
+    return start_pool(lid, NULL, nthreads, NULL, 0);
+}
+
+/* A pool that takes the model from ref at the start of each range, so that
+ * the model may be swapped while the pool runs. A range in flight during a
+ * swap may be classified partly with the old model, by workers that
+ * started on it before, and partly with the new one.
+ */
+ThreadPool *alloc_ref_pool(ModelRef *ref, unsigned nthreads){
+    return start_pool(NULL, ref, nthreads, NULL, 0);
+}
+
+/* A pool whose workers are spread over the NUMA nodes, each pinned to its
+ * node and reading a replica of the model held there. On a single-node
+ * host, or without LANGID_NUMA, this is alloc_pool.
+ */
+ThreadPool *alloc_numa_pool(const LanguageIdentifier *lid, unsigned nthreads){
+#ifdef LANGID_NUMA
+    ThreadPool *p;
+    int *nodes, nnodes = 0, n;
+
+    if (numa_available() >= 0) {
+        /* node numbers need not be contiguous */
+        if ((nodes = (int *) malloc((numa_max_node() + 1) * sizeof(int))) == 0) exit(-1);
+        for (n = 0; n <= numa_max_node(); n++)
+            if (numa_bitmask_isbitset(numa_all_nodes_ptr, n)) nodes[nnodes++] = n;
+        p = nnodes > 1 ? start_pool(lid, NULL, nthreads, nodes, nnodes) : NULL;
+        free(nodes);
+        if (p != NULL) return p;
+    }
+#endif
+    return alloc_pool(lid, nthreads);
+}
+
+void free_pool(ThreadPool *p){
+    unsigned i;
+
+    pool_wait(p);
+    pthread_mutex_lock(&p->lock);
+    p->shutdown = 1;
+    pthread_cond_broadcast(&p->work_cv);
+    pthread_mutex_unlock(&p->lock);
+
+    for (i = 0; i < p->nthreads; i++) {
+        pthread_join(p->workers[i].thread, NULL);
+        free_workspace(p->workers[i].ws);
+        if (p->workers[i].reader != NULL) free_model_reader(p->workers[i].reader);
+    }
+    for (i = 0; i < (unsigned) p->nnodes; i++) destroy_identifier(p->replicas[i]);
+    free(p->replicas);
+
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->work_cv);
+    pthread_cond_destroy(&p->done_cv);
+    free(p->workers);
+    free(p);
+}
+
+/* Hand items [0, n) to the workers. Any previously submitted range must
+ * have been waited for.
+ */
+void pool_submit(ThreadPool *p, pool_task fn, void *arg, size_t n){
+    pthread_mutex_lock(&p->lock);
+    p->fn = fn;
+    p->arg = arg;
+    p->n = n;
+    /* small chunks keep the load balanced, but not so small that the
+     * workers spend their time contending on the counter */
+    p->grain = n / (p->nthreads * 16);
+    if (p->grain == 0) p->grain = 1;
+    atomic_store(&p->next, 0);
+    p->active = p->nthreads;
+    p->generation++;
+    pthread_cond_broadcast(&p->work_cv);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* Have the pool write 1 to the eventfd fd whenever a range completes, so
+ * that an event loop can wait for it alongside other descriptors; -1 stops
+ * the notifications. The caller still calls pool_wait, which then returns
+ * at once.
+ */
+void pool_notify(ThreadPool *p, int fd){
+    pthread_mutex_lock(&p->lock);
+    p->notify_fd = fd;
+    pthread_mutex_unlock(&p->lock);
+}
+
+void pool_wait(ThreadPool *p){
+    pthread_mutex_lock(&p->lock);
+    while (p->active > 0)
+        pthread_cond_wait(&p->done_cv, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
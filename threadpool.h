@@ -0,0 +1,28 @@
+#ifndef _THREADPOOL_H
+#define _THREADPOOL_H
+
+#include <stddef.h>
+#include "liblangid.h"
+#include "modelref.h"
+
+/* A fixed set of worker threads sharing a single LanguageIdentifier. Each
+ * worker owns a Workspace, so tasks can call identify_r without further
+ * synchronisation. Work is submitted as a range of n items; idle workers
+ * claim items from the range until it is exhausted.
+ */
+typedef struct ThreadPool ThreadPool;
+
+/* Whichever the pool, a task sees one model for the whole range it is
+ * part of, and the Workspace to go with it. */
+
+typedef void (*pool_task)(void *arg, const LanguageIdentifier *lid, Workspace *ws, size_t i);
+
+extern ThreadPool *alloc_pool(const LanguageIdentifier *lid, unsigned nthreads);
+extern ThreadPool *alloc_numa_pool(const LanguageIdentifier *lid, unsigned nthreads);
+extern ThreadPool *alloc_ref_pool(ModelRef *ref, unsigned nthreads);
+extern void free_pool(ThreadPool *p);
+extern void pool_submit(ThreadPool *p, pool_task fn, void *arg, size_t n);
+extern void pool_wait(ThreadPool *p);
+extern void pool_notify(ThreadPool *p, int fd);
+
+#endif
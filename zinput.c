@@ -0,0 +1,319 @@
+/*
+ * Decompression of gzip and zstd input, see zinput.h
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+#ifdef LANGID_ZSTD
+#include <zstd.h>
+#endif
+#include "zinput.h"
+
+/* size of the reads of compressed data */
+#define ZINPUT_READ (256 * 1024)
+
+typedef struct {
+    int format;
+    int ended;          /* at the end of a gzip member or zstd frame */
+    z_stream gz;
+#ifdef LANGID_ZSTD
+    ZSTD_DStream *zd;
+#endif
+} Codec;
+
+typedef struct {
+    char *data;
+    size_t len;
+} ZBlock;
+
+struct ZInput {
+    int fd;
+    Codec codec;
+    char *in;               /* compressed data, ZINPUT_READ bytes */
+    size_t head_len;        /* of it read before the thread started */
+    pthread_t thread;
+
+    pthread_mutex_t lock;
+    pthread_cond_t filled_cv, freed_cv;
+    /* the queue, blocks[first] .. blocks[first+count-1], protected by lock */
+    ZBlock blocks[ZINPUT_QUEUE];
+    size_t first, count;
+    int done;               /* no more blocks will be queued */
+    int closing;            /* the reader is gone */
+    size_t pos;             /* read offset in blocks[first], reader only */
+};
+
+int zinput_format(const void *head, size_t n){
+    const unsigned char *p = (const unsigned char *) head;
+
+    if (n >= 2 && p[0] == 0x1f && p[1] == 0x8b) return ZINPUT_GZIP;
+    if (n >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f && p[3] == 0xfd) return ZINPUT_ZSTD;
+    return ZINPUT_NONE;
+}
+
+#ifndef LANGID_ZSTD
+static pthread_once_t zstd_reported = PTHREAD_ONCE_INIT;
+
+static void report_zstd(void){
+    fprintf(stderr, "zstd input needs langid built with -DLANGID_ZSTD (make ZSTD=1).\n");
+}
+#endif
+
+/* Whether this build decompresses format. The first time it does not, that
+ * is reported, once for all threads and files. */
+int zinput_supported(int format){
+    if (format != ZINPUT_ZSTD) return 1;
+#ifdef LANGID_ZSTD
+    return 1;
+#else
+    pthread_once(&zstd_reported, report_zstd);
+    return 0;
+#endif
+}
+
+/* format must be supported; otherwise this reports it and exits */
+static void codec_init(Codec *c, int format){
+    memset(c, 0, sizeof(Codec));
+    c->format = format;
+    if (!zinput_supported(format)) exit(-1);
+    if (format == ZINPUT_GZIP) {
+        /* 15 bits of window, plus 16 to expect a gzip header */
+        if (inflateInit2(&c->gz, 15 + 16) != Z_OK) exit(-1);
+        return;
+    }
+#ifdef LANGID_ZSTD
+    if ((c->zd = ZSTD_createDStream()) == NULL || ZSTD_isError(ZSTD_initDStream(c->zd))) exit(-1);
+#endif
+}
+
+static void codec_end(Codec *c){
+    if (c->format == ZINPUT_GZIP) inflateEnd(&c->gz);
+#ifdef LANGID_ZSTD
+    else ZSTD_freeDStream(c->zd);
+#endif
+}
+
+/* Decompress from the inlen bytes at *in into at most outlen bytes of out,
+ * advancing *in and inlen past the input consumed. Returns the number of
+ * bytes written, or -1 for corrupt input, which is reported.
+ */
+static long codec_step(Codec *c, const char **in, size_t *inlen, char *out, size_t outlen){
+    size_t used;
+    int ret;
+
+    if (c->format == ZINPUT_GZIP) {
+        if (c->ended) {
+            if (*inlen == 0) return 0;
+            /* another member follows, as in the output of pigz or cat */
+            inflateReset(&c->gz);
+            c->ended = 0;
+        }
+        c->gz.next_in = (Bytef *) *in;
+        c->gz.avail_in = *inlen > UINT_MAX ? UINT_MAX : *inlen;
+        c->gz.next_out = (Bytef *) out;
+        c->gz.avail_out = outlen > UINT_MAX ? UINT_MAX : outlen;
+        ret = inflate(&c->gz, Z_NO_FLUSH);
+        used = (const char *) c->gz.next_in - *in;
+        *in += used;
+        *inlen -= used;
+        if (ret == Z_STREAM_END) c->ended = 1;
+        else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            fprintf(stderr, "gzip error: %s\n", c->gz.msg ? c->gz.msg : zError(ret));
+            return -1;
+        }
+        return (char *) c->gz.next_out - out;
+    }
+#ifdef LANGID_ZSTD
+    {
+        ZSTD_inBuffer ib = {*in, *inlen, 0};
+        ZSTD_outBuffer ob = {out, outlen, 0};
+        size_t r = ZSTD_decompressStream(c->zd, &ob, &ib);
+
+        if (ZSTD_isError(r)) {
+            fprintf(stderr, "zstd error: %s\n", ZSTD_getErrorName(r));
+            return -1;
+        }
+        *in += ib.pos;
+        *inlen -= ib.pos;
+        /* 0 at the end of a frame; the next one, if any, just follows */
+        c->ended = r == 0;
+        return ob.pos;
+    }
+#else
+    return -1;
+#endif
+}
+
+/* As read_some in langid.c: errors are reported and taken as the end */
+static size_t read_fd(int fd, char *buf, size_t n){
+    ssize_t got;
+
+    while ((got = read(fd, buf, n)) == -1 && errno == EINTR);
+    if (got == -1) {
+        fprintf(stderr, "read error: %s\n", strerror(errno));
+        return 0;
+    }
+    return got;
+}
+
+/* Queue the filled block b, and return the next one to fill once there is
+ * room for it, or NULL if the reader is gone.
+ */
+static ZBlock *queue_block(ZInput *z, ZBlock *b){
+    pthread_mutex_lock(&z->lock);
+    if (b != NULL && b->len) {
+        z->count++;
+        pthread_cond_signal(&z->filled_cv);
+    }
+    while (z->count == ZINPUT_QUEUE && !z->closing) pthread_cond_wait(&z->freed_cv, &z->lock);
+    b = z->closing ? NULL : &z->blocks[(z->first + z->count) % ZINPUT_QUEUE];
+    pthread_mutex_unlock(&z->lock);
+    if (b != NULL) b->len = 0;
+    return b;
+}
+
+static void *zinput_main(void *p){
+    ZInput *z = (ZInput *) p;
+    const char *in = z->in;
+    size_t inlen = z->head_len;
+    ZBlock *b = queue_block(z, NULL);
+    long n;
+    int eof = 0;
+
+    while (b != NULL) {
+        if (inlen == 0 && !eof) {
+            in = z->in;
+            eof = (inlen = read_fd(z->fd, z->in, ZINPUT_READ)) == 0;
+        }
+        if (inlen == 0 && eof) {
+            if (!z->codec.ended) fprintf(stderr, "compressed input is truncated\n");
+            break;
+        }
+        if ((n = codec_step(&z->codec, &in, &inlen, b->data + b->len, ZINPUT_BLOCK - b->len)) < 0) break;
+        b->len += n;
+        if (b->len == ZINPUT_BLOCK) b = queue_block(z, b);
+    }
+
+    /* queue what is left, and let the reader know that was all */
+    pthread_mutex_lock(&z->lock);
+    if (b != NULL && b->len) z->count++;
+    z->done = 1;
+    pthread_cond_signal(&z->filled_cv);
+    pthread_mutex_unlock(&z->lock);
+    return NULL;
+}
+
+/* Start decompressing fd, in the given format, on a thread of its own; an
+ * unsupported format is reported and exits, as there is no other input.
+ * head holds the first n <= ZINPUT_MAGIC bytes of the input, already read
+ * from fd to tell its format. fd stays open until the caller closes it,
+ * after free_zinput.
+ */
+ZInput *alloc_zinput(int fd, int format, const void *head, size_t n){
+    ZInput *z;
+    unsigned i;
+
+    if ((z = (ZInput *) calloc(1, sizeof(ZInput))) == 0) exit(-1);
+    z->fd = fd;
+    codec_init(&z->codec, format);
+    if ((z->in = (char *) malloc(ZINPUT_READ)) == 0) exit(-1);
+    memcpy(z->in, head, n);
+    z->head_len = n;
+    for (i = 0; i < ZINPUT_QUEUE; i++)
+        if ((z->blocks[i].data = (char *) malloc(ZINPUT_BLOCK)) == 0) exit(-1);
+    pthread_mutex_init(&z->lock, NULL);
+    pthread_cond_init(&z->filled_cv, NULL);
+    pthread_cond_init(&z->freed_cv, NULL);
+    if (pthread_create(&z->thread, NULL, zinput_main, z) != 0) {
+        fprintf(stderr, "failed to start decompression thread\n");
+        exit(-1);
+    }
+    return z;
+}
+
+/* Read up to n decompressed bytes into buf, as read(2) would: waiting
+ * only while none are available. Returns 0 at the end of the input.
+ */
+size_t zinput_read(ZInput *z, char *buf, size_t n){
+    size_t got = 0, k;
+    ZBlock *b;
+
+    pthread_mutex_lock(&z->lock);
+    while (got < n) {
+        while (z->count == 0 && !z->done && got == 0) pthread_cond_wait(&z->filled_cv, &z->lock);
+        if (z->count == 0) break;
+
+        /* the thread only writes to blocks outside the queue */
+        b = &z->blocks[z->first];
+        pthread_mutex_unlock(&z->lock);
+        k = b->len - z->pos < n - got ? b->len - z->pos : n - got;
+        memcpy(buf + got, b->data + z->pos, k);
+        got += k;
+        z->pos += k;
+        pthread_mutex_lock(&z->lock);
+
+        if (z->pos == b->len) { /* hand the block back */
+            z->first = (z->first + 1) % ZINPUT_QUEUE;
+            z->count--;
+            z->pos = 0;
+            pthread_cond_signal(&z->freed_cv);
+        }
+    }
+    pthread_mutex_unlock(&z->lock);
+    return got;
+}
+
+/* Stop the thread, whether or not the input was read to the end */
+void free_zinput(ZInput *z){
+    unsigned i;
+
+    pthread_mutex_lock(&z->lock);
+    z->closing = 1;
+    pthread_cond_signal(&z->freed_cv);
+    pthread_mutex_unlock(&z->lock);
+    pthread_join(z->thread, NULL);
+
+    codec_end(&z->codec);
+    pthread_mutex_destroy(&z->lock);
+    pthread_cond_destroy(&z->filled_cv);
+    pthread_cond_destroy(&z->freed_cv);
+    for (i = 0; i < ZINPUT_QUEUE; i++) free(z->blocks[i].data);
+    free(z->in);
+    free(z);
+}
+
+/* Decompress all of data on the calling thread, for a caller that needs the
+ * text in one piece. Errors are reported, and leave what was decompressed
+ * before them. Returns a buffer of *outlen bytes, to be freed. The format
+ * must be supported, see zinput_supported.
+ */
+char *zinput_decompress(int format, const char *data, size_t len, size_t *outlen){
+    Codec c;
+    size_t size = 4 * len + 4096;
+    char *out;
+    long n;
+
+    codec_init(&c, format);
+    if ((out = (char *) malloc(size)) == 0) exit(-1);
+    *outlen = 0;
+    for (;;) {
+        if (*outlen == size) {
+            size *= 2;
+            if ((out = (char *) realloc(out, size)) == 0) exit(-1);
+        }
+        if ((n = codec_step(&c, &data, &len, out + *outlen, size - *outlen)) < 0) break;
+        *outlen += n;
+        /* all input taken, and no more output although there was room */
+        if (len == 0 && (c.ended || *outlen < size)) {
+            if (!c.ended) fprintf(stderr, "compressed input is truncated\n");
+            break;
+        }
+    }
+    codec_end(&c);
+    return out;
+}
@@ -0,0 +1,34 @@
+#ifndef _ZINPUT_H
+#define _ZINPUT_H
+
+#include <stddef.h>
+
+/* Compressed input, recognised by its first bytes. gzip (any number of
+ * concatenated members) is read with zlib; zstd needs langid built with
+ * -DLANGID_ZSTD (make ZSTD=1), and is otherwise rejected.
+ */
+#define ZINPUT_NONE 0
+#define ZINPUT_GZIP 1
+#define ZINPUT_ZSTD 2
+
+/* bytes needed to tell the formats apart */
+#define ZINPUT_MAGIC 4
+
+/* A stream decompressed on a thread of its own, which hands blocks of
+ * ZINPUT_BLOCK bytes to the reader through a queue of ZINPUT_QUEUE of
+ * them, so reading, decompressing and whatever the reader does with the
+ * data all overlap.
+ */
+typedef struct ZInput ZInput;
+
+#define ZINPUT_BLOCK (1024 * 1024)
+#define ZINPUT_QUEUE 4
+
+extern int zinput_format(const void *head, size_t n);
+extern int zinput_supported(int format);
+extern ZInput *alloc_zinput(int fd, int format, const void *head, size_t n);
+extern size_t zinput_read(ZInput *z, char *buf, size_t n);
+extern void free_zinput(ZInput *z);
+extern char *zinput_decompress(int format, const char *data, size_t len, size_t *outlen);
+
+#endif